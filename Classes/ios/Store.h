@@ -271,13 +271,26 @@
 #endif
 
 // Включает возможность запросить логи методом [Store logs]
-// Он не зависим от двух других парамтров выше и включает все логи
+// Он не зависим от двух других парамтров выше и включает все логи.
+// Если логи из приложения не нужны, ENABLE_STORE_LOG_WITH_METHOD=NO в настройках сборки
+// убирает и форматирование строк, и запись в файл
+#ifndef ENABLE_STORE_LOG_WITH_METHOD
 #define ENABLE_STORE_LOG_WITH_METHOD YES
+#endif
+
+// Лог пишется в файл с ротацией: при превышении размера текущий файл
+// становится архивным, хранится не более STORE_LOG_MAX_SEGMENTS файлов
+#define STORE_LOG_MAX_SIZE     262144
+#define STORE_LOG_MAX_SEGMENTS 4
 
 @class StoreItem;
+@class StoreConsumableReservation;
 
 #define STORE_MANAGER_CHANGED @"StoreManagerChanged"
 
+// Ключ в userInfo STORE_MANAGER_CHANGED, NSSet идентификаторов изменившихся покупок
+#define STORE_CHANGED_IDENTIFIERS @"StoreChangedIdentifiers"
+
 typedef enum
 {
     StoreItemTypeUnknown,
@@ -353,10 +366,23 @@ typedef void(^PurchaseCompletion)(NSError *error);
 -(void)consumablePurchaseDecrease;
 -(void)consumablePurchaseDecreaseCount:(NSNumber *)decreaseCount;
 
+// Количество единиц, доступных для траты (без зарезервированных)
+@property (nonatomic, assign, readonly) NSInteger                 consumableAvailableCount;
+
+// Атомарно тратит единицы, если их хватает, иначе возвращает NO и ничего не меняет.
+// Баланс меняется в памяти, на диск пишется отложенно, STORE_MANAGER_CHANGED
+// приходит не чаще одного раза за проход main run loop
+-(BOOL)consumableSpendCount:(NSInteger)count;
+-(void)consumableGrantCount:(NSInteger)count;
+
+// Резервирует единицы для предварительной траты, nil если не хватает.
+// Резерв затем подтверждается (commit) или возвращается (rollback)
+-(StoreConsumableReservation *)consumableReserveCount:(NSInteger)count;
+
 // Делает покупку приобретенной, на определенный период или несколько периодов
 -(void)setAsPurchasedForRanges:(NSArray <NSString *> *)ranges;
-//   определенная дата: @"12/31/2020"
-//        диапазон дат: @"1/1/2020-12/31/2020" (включительно)
+//   определенная дата: @"31/12/2020" (день/месяц/год, UTC)
+//        диапазон дат: @"1/1/2020-31/12/2020" (включительно)
 // определенная версия: @"3.0.1"
 //     диапазон версий: @"1.0-3.0.1" (включительно)
 
@@ -375,8 +401,99 @@ typedef void(^PurchaseCompletion)(NSError *error);
 
 @end
 
+#pragma mark - Consumable Reservation
+
+@interface StoreConsumableReservation : NSObject
+
+@property (nonatomic, strong, readonly) StoreItem *storeItem;
+@property (nonatomic, assign, readonly) NSInteger  count;
+
+-(void)commit;   // Списывает зарезервированные единицы
+-(void)rollback; // Возвращает их, так же происходит если резерв просто отпустить
+
+@end
+
+#pragma mark - Store Change
+
+typedef enum
+{
+    StoreChangeKindEntitlement = 1 << 0, // Время окончания покупки (0 если бессрочная), NSNull если не куплена
+    StoreChangeKindBalance     = 1 << 1, // consumableCount
+    StoreChangeKindPrice       = 1 << 2, // priceString, вместе с ним title и остальные цены
+    StoreChangeKindValidity    = 1 << 3  // isInvalid
+}StoreChangeKind;
+
+// Изменения одной покупки за один проход main run loop.
+// Значения по ключу @(StoreChangeKind), отсутствующее значение это NSNull
+@interface StoreChange : NSObject
+
+@property (nonatomic, strong, readonly) NSString                    *identifier;
+@property (nonatomic, assign, readonly) StoreItemType                type;
+@property (nonatomic, assign, readonly) StoreChangeKind              kinds; // Маска
+
+@property (nonatomic, strong, readonly) NSDictionary <NSNumber *, id> *oldValues;
+@property (nonatomic, strong, readonly) NSDictionary <NSNumber *, id> *currentValues;
+
+@end
+
+typedef void(^StoreChangesHandler)(NSArray <StoreChange *> *changes);
+
+#pragma mark - Store Transport
+
+// Предельное время запроса конфига и проверки чека, в секундах
+#define STORE_CONFIG_TIMEOUT  15.
+#define STORE_RECEIPT_TIMEOUT 30.
+
+// Ответ проверки чека переиспользуется, пока чек на диске не изменился и не истекла
+// ни одна активная подписка, но не дольше этого времени, в секундах
+#define STORE_RECEIPT_CACHE_MAX_AGE 86400.
+
+// Планировщик обновлений: конфиг и чек перепроверяются не чаще раза в STORE_REFRESH_INTERVAL
+// (раньше, если истекает подписка), серия входов в приложение схлопывается за STORE_REFRESH_DEBOUNCE,
+// после ошибок повтор через STORE_REFRESH_BACKOFF_MIN, 2x, 4x... но не дольше STORE_REFRESH_BACKOFF_MAX
+#define STORE_REFRESH_INTERVAL    21600.
+#define STORE_REFRESH_DEBOUNCE    1.
+#define STORE_REFRESH_BACKOFF_MIN 30.
+#define STORE_REFRESH_BACKOFF_MAX 3600.
+
+typedef void(^StoreTransportCompletion)(NSData *data, NSHTTPURLResponse *response, NSError *error);
+
+// Сетевой транспорт, по умолчанию работает через NSURLSession.
+// Можно подменить своим, например для запросов к локальному тестовому серверу
+@protocol StoreTransport <NSObject>
+
+// Completion вызывается один раз, на любой очереди
+-(void)sendRequest:(NSURLRequest            *)request
+        completion:(StoreTransportCompletion )completion;
+
+// Прерывает все запросы, их completion получают NSURLErrorCancelled
+-(void)cancelAllRequests;
+
+@optional
+
+// Прерывает один запрос, переданный в sendRequest:completion: (тот же объект).
+// Вызывается, когда истек timeoutInterval, а транспорт так и не ответил
+-(void)cancelRequest:(NSURLRequest *)request;
+
+@end
+
+// Содержимое чека вместо файла appStoreReceiptURL, nil если чека нет
+typedef NSData *(^StoreReceiptProvider)(void);
+
+#pragma mark - Store Metrics
+
+// Снимок замеров, см. +[Store metrics]
+typedef void(^StoreMetricsHandler)(NSDictionary <NSString *, id> *metrics);
+
 #pragma mark - Store Manager
 
+typedef enum
+{
+    StoreReceiptVerificationServer,        // Чек проверяется на сервере Apple (по умолчанию)
+    StoreReceiptVerificationLocal,         // Чек только разбирается на устройстве, без сети (подпись не проверяется)
+    StoreReceiptVerificationLocalAndServer // Покупки выдаются по разбору на устройстве, затем сервер подтверждает чек в фоне
+}StoreReceiptVerification;
+
 typedef void(^RestoreCompletion)(NSError *error);
 typedef BOOL(^LockRules)(UIViewController *controller, NSInteger rule);
 typedef NSDictionary *(^RawRecieptHandler)(BOOL sandbox);
@@ -392,6 +509,24 @@ typedef NSDictionary *(^RawRecieptHandler)(BOOL sandbox);
                   storeItems:(NSArray <StoreItem *> *)storeItems // @[@"com.purchase.year".storeItem.consumable]
                   completion:(RestoreCompletion      )completion;
 
+// Подменяет сетевой транспорт, nil возвращает транспорт по умолчанию
++(void)setTransport:(id <StoreTransport>)transport;
+
+// Подменяет очередь платежей (например, на проигрывающую записанные транзакции), nil возвращает SKPaymentQueue.defaultQueue
++(void)setPaymentQueue:(SKPaymentQueue *)paymentQueue;
+
+// Подмены для воспроизведения записанных сценариев без App Store, nil возвращает поведение по умолчанию.
+// Класс должен наследовать SKProductsRequest и сам вызывать делегат из -start
++(void)setProductsRequestClass:(Class)productsRequestClass;
++(void)setReceiptProvider:(StoreReceiptProvider)receiptProvider;
+
+// Папка сохраненного состояния вместо Application Support/Store. Отложенное дописывается
+// в старую папку, конфиг, балансы, снимок каталога и покупки перечитываются из новой
++(void)setStateDirectory:(NSString *)directory;
+
+// Способ проверки чека, если не задан checkRawReceipt:
++(void)setReceiptVerification:(StoreReceiptVerification)receiptVerification;
+
 // Метод принимает RAW JSON выданный сервером Эпл нeoбходим,
 // если вы проводите проверку чека на своем сервере
 +(void)checkRawReceipt:(RawRecieptHandler)rawRecieptHandler;
@@ -402,7 +537,37 @@ typedef NSDictionary *(^RawRecieptHandler)(BOOL sandbox);
 // Создает покупку либо находит в имеющихся
 +(StoreItem *)storeItemWithIdentifier:(NSString *)identifier;
 
+// Когда запланирована следующая проверка конфига и чека
++(NSDate *)nextRefreshDate;
+
+// Проверить прямо сейчас, не дожидаясь плана
++(void)refresh;
+
+// Замеры этапов setup/restore (config, products, receiptRefresh, verify, parse, completion, restore).
+// По умолчанию выключены, выключенные ничего не стоят. Интервалы видны в Instruments (os_signpost)
++(void)setMetricsEnabled:(BOOL)metricsEnabled;
+
+// @{@"phases":@{@"verify":@{@"start", @"end", @"count", @"errors", @"lastMs", @"maxMs", @"totalMs", @"histogram"}},
+//   @"histogramBoundsMs":@[10, 50...], @"counters":@{@"verify.status.21007":@1...}, @"bytes":@{@"receipt":...}}
+// start и end в секундах монотонных часов, histogram на одну корзину длиннее границ
++(NSDictionary <NSString *, id> *)metrics;
++(void)resetMetrics;
+
+// Вызывает handler со снимком на main queue раз в interval, nil отключает
++(void)setMetricsHandler:(StoreMetricsHandler)handler
+                interval:(NSTimeInterval     )interval;
+
+// Трата и начисление сразу для нескольких одноразовых покупок: @{identifier:count}.
+// Трата выполняется целиком либо не выполняется вовсе (возвращает NO)
++(BOOL)consumableSpendCounts:(NSDictionary <NSString *, NSNumber *> *)counts;
++(void)consumableGrantCounts:(NSDictionary <NSString *, NSNumber *> *)counts;
+
 +(BOOL)isReady;
+
+// Названия и цены показаны из сохраненного на диске каталога и еще не подтверждены App Store.
+// Показывать их можно сразу, покупать только после isReady
++(BOOL)isStale;
+
 +(BOOL)isSandbox;
 
 // Выдает имеющиеся StoreItems, и приобретенные и с определенным типом
@@ -412,6 +577,20 @@ typedef NSDictionary *(^RawRecieptHandler)(BOOL sandbox);
 +(NSArray <StoreItem *> *)storeItemsWithType:(StoreItemType)type;
 +(NSArray <StoreItem *> *)storeItemsPurchasedWithType:(StoreItemType)type;
 
+// Увеличивается каждый раз, когда меняется набор купленных покупок
++(NSUInteger)entitlementsGeneration;
+
+// Подписка на изменения покупок, вместо STORE_MANAGER_CHANGED (он остается для совместимости).
+// nil (или 0 для kinds) снимает фильтр, types это @(StoreItemType), queue nil это main queue.
+// Возвращает подписку, которую нужно передать в unsubscribeFromChanges:
++(id)subscribeToChangesWithIdentifiers:(NSSet <NSString *> *)identifiers
+                                 types:(NSSet <NSNumber *> *)types
+                                 kinds:(StoreChangeKind     )kinds
+                                 queue:(dispatch_queue_t    )queue
+                               handler:(StoreChangesHandler )handler;
+
++(void)unsubscribeFromChanges:(id)subscription;
+
 // Дата когда юзер в самый первый раз поставил (купил) апку из стора и ее версия на тот момент
 +(NSDate   *)firstInstallDate;
 +(NSString *)firstInstallAppVersion;
@@ -425,7 +604,11 @@ typedef NSDictionary *(^RawRecieptHandler)(BOOL sandbox);
 +(NSData *)receipt;     // Рецепт с диска устройства
 +(NSData *)receiptJSON; // Рецепт от сервера Apple
 
+// Сколько раз проверка чека обошлась без сервера и сколько раз потребовала запрос
++(NSUInteger)receiptCacheHits;
++(NSUInteger)receiptCacheMisses;
+
 +(void)reset; // Обнуляет все сохраненные данные
-+(NSData *)logs; // Если включен параметр ENABLE_STORE_LOG_WITH_METHOD
++(NSData *)logs; // Если включен параметр ENABLE_STORE_LOG_WITH_METHOD, все сегменты лога от старого к новому
 
 @end
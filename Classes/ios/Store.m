@@ -7,1834 +7,4542 @@
 //
 
 #import "Store.h"
+#import "StoreBalance.h"
+#import "StoreJournal.h"
+#import "StoreLogFile.h"
+#import "StoreReceipt.h"
+#import "StoreRanges.h"
+#import <CommonCrypto/CommonDigest.h>
+#import <os/lock.h>
+#import <os/signpost.h>
+#import <time.h>
 
 //#define MANUAL_RESTORED     @"ManualRestored"
 
-#pragma mark - Store Item Category
+// Строка лога форматируется только если она куда-то попадет: в NSLog (addInfoLog:/addErrorLog:)
+// или в файл (addFileLog:). Без ENABLE_STORE_LOG_WITH_METHOD в релизе обе ветки выключены
+#define STORE_iNFO_LOG_ENABLED  (ENABLE_STORE_iNFO_LOG  || ENABLE_STORE_LOG_WITH_METHOD)
+#define STORE_ERROR_LOG_ENABLED (ENABLE_STORE_ERROR_LOG || ENABLE_STORE_LOG_WITH_METHOD)
 
-@implementation NSString (Identifier)
+#define StoreInfoLog(format, ...)\
+do { if (STORE_iNFO_LOG_ENABLED) [StoreItem addInfoLog:[NSString stringWithFormat:format, ##__VA_ARGS__]]; } while (0)
 
--(StoreItem *)storeItem
-{
-    return
-    [Store storeItemWithIdentifier:self];
-}
+#define StoreErrorLog(format, ...)\
+do { if (STORE_ERROR_LOG_ENABLED) [StoreItem addErrorLog:[NSString stringWithFormat:format, ##__VA_ARGS__]]; } while (0)
 
-@end
+@interface StoreItem ()
 
-#pragma mark - Store Item
++(void)addInfoLog:(NSString *)log;
++(void)addErrorLog:(NSString *)log;
 
-@interface StoreItem () <SKPaymentTransactionObserver>
+@end
 
-@property (nonatomic, strong) SKProduct      *product;
-@property (nonatomic, strong) SKPaymentQueue *purchaseQueue;
+#define STORE_CONSUMABLE_FLUSH_INTERVAL 1.
 
-@property (nonatomic, strong) NSMutableArray <PurchaseCompletion> *purchaseCompletions;
+#define STORE_LOG_FLUSH_SIZE     16384
+#define STORE_LOG_FLUSH_INTERVAL 1.
 
-@property (nonatomic, assign) BOOL            isPurchasing;
+#pragma mark - Store Log
+
+// Лог пишется в конец открытого файла пачками из буфера на отдельной очереди,
+// при превышении STORE_LOG_MAX_SIZE файл ротируется (StoreLogFile.h)
+@interface StoreLog : NSObject
+{
+    StoreLogFile _file; // Только на queue
+}
 
-@property (nonatomic, strong) NSArray <NSDictionary <NSString *, NSDate *> *> *asPurchasedDates;
-@property (nonatomic, strong) NSArray <NSDictionary <NSString *, NSArray <NSString *> *> *> *asPurchasedVersions;
+@property (nonatomic, strong) dispatch_queue_t    queue;
+@property (nonatomic, strong) NSMutableData      *buffer;
+@property (nonatomic, assign) BOOL                isFlushScheduled;
 
 @end
 
-@implementation StoreItem
+@implementation StoreLog
+
++(instancetype)current
+{
+    static StoreLog *_current = nil;
+    static dispatch_once_t oncePredicate;
+
+    dispatch_once(&oncePredicate, ^
+    {
+        _current = self.new;
+    });
+
+    return _current;
+}
 
 -(instancetype)init
 {
     if (self = [super init])
     {
-        self.purchaseCompletions =
-        NSMutableArray.new;
-        
-        self.purchaseQueue =
-        SKPaymentQueue.defaultQueue;
+        self.queue =
+        dispatch_queue_create("Store.log", DISPATCH_QUEUE_SERIAL);
+
+        self.buffer =
+        NSMutableData.new;
+
+        NSString *directory =
+        NSSearchPathForDirectoriesInDomains(NSCachesDirectory,
+                                            NSUserDomainMask,
+                                            YES).firstObject;
+
+        StoreLogFileInit(&_file,
+                         directory.fileSystemRepresentation,
+                         STORE_LOG_MAX_SIZE,
+                         STORE_LOG_MAX_SEGMENTS);
     }
-    
+
     return self;
 }
 
--(void)setIdentifier:(NSString *)identifier
+-(NSString *)pathForSegment:(NSUInteger)segment
 {
-    _identifier = identifier;
+    char path[STORE_LOG_FILE_PATH_SIZE + 32];
+
+    if (!StoreLogFileSegmentPath(&_file, (unsigned)segment, path, sizeof(path)))
+        return nil;
+
+    return
+    [NSString
+     stringWithUTF8String:path];
 }
 
--(void)setStartDate:(NSDate *)startDate
+-(void)addLog:(NSString *)log
 {
-    _startDate = startDate;
+    dispatch_async(self.queue, ^(void)
+    {
+        [self.buffer
+         appendData:[log
+                     dataUsingEncoding:NSUTF8StringEncoding]];
+
+        [self.buffer
+         appendBytes:"\n"
+         length:1];
+
+        if (self.buffer.length >= STORE_LOG_FLUSH_SIZE)
+        {
+            [self flush];
+
+            return;
+        }
+
+        if (self.isFlushScheduled)
+            return;
+
+        self.isFlushScheduled = YES;
+
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(STORE_LOG_FLUSH_INTERVAL * NSEC_PER_SEC)), self.queue, ^(void)
+        {
+            [self flush];
+        });
+    });
 }
 
--(void)setEndDate:(NSDate *)endDate
+// Дописывает буфер сразу, например перед уходом в фон
+-(void)synchronize
 {
-    _endDate = endDate;
+    dispatch_sync(self.queue, ^(void)
+    {
+        [self flush];
+    });
 }
 
--(void)setIsTrial:(BOOL)isTrial
+// Вызывается только на self.queue
+-(void)flush
 {
-    _isTrial = isTrial;
+    self.isFlushScheduled = NO;
+
+    if (self.buffer.length == 0)
+        return;
+
+    StoreLogFileWrite(&_file,
+                      self.buffer.bytes,
+                      self.buffer.length);
+
+    self.buffer.length = 0;
 }
 
--(void)setIsNotForSell:(BOOL)isNotForSell
+-(void)remove
 {
-    _isNotForSell = isNotForSell;
+    dispatch_sync(self.queue, ^(void)
+    {
+        self.buffer.length = 0;
+
+        StoreLogFileRemove(&_file);
+    });
 }
 
--(void)setType:(StoreItemType)type
+// Склеивает все сегменты лога, от самого старого к текущему
+-(NSData *)data
 {
-    _type = type;
+    NSMutableData *data =
+    NSMutableData.new;
+
+    dispatch_sync(self.queue, ^(void)
+    {
+        [self flush];
+
+        for (NSInteger segment = STORE_LOG_MAX_SEGMENTS - 1; segment >= 0; segment --)
+        {
+            NSData *segmentData =
+            [NSData
+             dataWithContentsOfFile:[self pathForSegment:segment]];
+
+            if (segmentData)
+                [data
+                 appendData:segmentData];
+        }
+    });
+
+    if (data.length == 0)
+        return nil;
+
+    return
+    data.copy;
 }
 
--(void)setPeriod:(StoreItemPeriod)period
+@end
+
+#pragma mark - Store State
+
+#define STORE_STATE_COMPACT_SIZE 65536
+
+// Сохраненное состояние покупок. Значения читаются из памяти, изменения
+// накапливаются и записываются одной записью в журнал (Store.journal) при commit.
+// Формат записи в StoreJournal.h, в записи binary plist @{set:..., remove:...},
+// недописанная после сбоя запись отбрасывается при загрузке. Журнал периодически
+// сворачивается в Store.state
+@interface StoreState : NSObject
+
+@property (nonatomic, strong) dispatch_queue_t                      queue;
+@property (nonatomic, strong) NSMutableDictionary <NSString *, id> *values;
+@property (nonatomic, strong) NSMutableDictionary <NSString *, id> *changes;
+
+// Только записанное в журнал, из этого сворачивается Store.state. Меняется только на queue
+@property (nonatomic, strong) NSMutableDictionary <NSString *, id> *committed;
+@property (nonatomic, strong) NSMutableSet <NSString *>            *removals;
+@property (nonatomic, strong) NSFileHandle                         *journal;
+@property (nonatomic, assign) unsigned long long                    journalSize;
+@property (nonatomic, strong) NSString                             *directory;
+
+// Файлов состояния еще не было, т.е. данные нужно перенести из NSUserDefaults
+@property (nonatomic, assign) BOOL                                  isNew;
+
+@end
+
+@implementation StoreState
+
++(instancetype)current
 {
-    _period = period;
+    static StoreState *_current = nil;
+    static dispatch_once_t oncePredicate;
+    
+    dispatch_once(&oncePredicate, ^
+    {
+        _current = self.new;
+    });
+    
+    return _current;
 }
 
--(void)setIsInvalid:(BOOL)isInvalid
+-(instancetype)init
 {
-    _isInvalid = isInvalid;
+    if (self = [super init])
+    {
+        self.queue =
+        dispatch_queue_create("Store.state", DISPATCH_QUEUE_SERIAL);
+        
+        self.values =
+        NSMutableDictionary.new;
+        
+        self.changes =
+        NSMutableDictionary.new;
+        
+        self.committed =
+        NSMutableDictionary.new;
+        
+        self.removals =
+        NSMutableSet.new;
+        
+        self.directory =
+        StoreState.defaultDirectory;
+        
+        [NSFileManager.defaultManager
+         createDirectoryAtPath:self.directory
+         withIntermediateDirectories:YES
+         attributes:nil
+         error:nil];
+        
+        [self load];
+    }
+    
+    return self;
 }
 
--(void)setProduct:(SKProduct *)product
++(NSString *)defaultDirectory
 {
-    _product = product;
+    return
+    [NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory,
+                                         NSUserDomainMask,
+                                         YES).firstObject
+     stringByAppendingPathComponent:@"Store"];
+}
 
-    NSNumberFormatter *numberFormatter = NSNumberFormatter.new;
-    
-    numberFormatter.formatterBehavior = NSNumberFormatterBehavior10_4;
-    numberFormatter.numberStyle       = NSNumberFormatterCurrencyStyle;
-    numberFormatter.locale            = product.priceLocale;
-    
-    NSString *formattedPrice =
-    [numberFormatter stringFromNumber:product.price];
+// Состояние загружается из новой папки. Изменения нужно записать commit заранее,
+// незаписанные к этому моменту пропадают
+-(void)switchToDirectory:(NSString *)directory
+{
+    dispatch_sync(self.queue, ^(void)
+    {
+        @synchronized (self)
+        {
+            [self.journal
+             closeAndReturnError:nil];
+            
+            [self.values
+             removeAllObjects];
+            
+            [self.changes
+             removeAllObjects];
+            
+            [self.removals
+             removeAllObjects];
+            
+            [self.committed
+             removeAllObjects];
+            
+            self.directory =
+            directory;
+            
+            [NSFileManager.defaultManager
+             createDirectoryAtPath:self.directory
+             withIntermediateDirectories:YES
+             attributes:nil
+             error:nil];
+            
+            [self load];
+        }
+    });
+}
+
+-(NSString *)statePath
+{
+    return
+    [self.directory
+     stringByAppendingPathComponent:@"Store.state"];
+}
+
+-(NSString *)journalPath
+{
+    return
+    [self.directory
+     stringByAppendingPathComponent:@"Store.journal"];
+}
+
+// Запись журнала, которая не читается как plist, считается поврежденной вместе с хвостом
+static int StoreStateApplyRecord(const uint8_t *payload, size_t length, void *context)
+{
+    NSMutableDictionary *values =
+    (__bridge NSMutableDictionary *)context;
+    
+    NSDictionary *record =
+    [NSPropertyListSerialization
+     propertyListWithData:[NSData
+                           dataWithBytesNoCopy:(void *)payload
+                           length:length
+                           freeWhenDone:NO]
+     options:NSPropertyListImmutable
+     format:nil
+     error:nil];
     
-    formattedPrice =
-    [self cleanPrice:formattedPrice];
+    if (![record
+          isKindOfClass:NSDictionary.class])
+        return 1;
     
-    _priceString = [numberFormatter stringFromNumber:product.price];
-    _priceNumber = product.price;
+    [values
+     addEntriesFromDictionary:record[@"set"]];
     
-    _currencyCode =
-    [product.priceLocale objectForKey:NSLocaleCurrencyCode];
+    [values
+     removeObjectsForKeys:record[@"remove"]];
     
-    _currencySymbol =
-    [product.priceLocale objectForKey:NSLocaleCurrencySymbol];
+    return 0;
+}
+
+-(void)load
+{
+    self.isNew =
+    (![NSFileManager.defaultManager
+       fileExistsAtPath:self.statePath] &&
+     ![NSFileManager.defaultManager
+       fileExistsAtPath:self.journalPath]);
     
-    _titleWithPrice =
-    [NSString
-     stringWithFormat:@"%@ %@",
-     formattedPrice,
-     product.localizedTitle];
+    NSData *stateData =
+    [NSData
+     dataWithContentsOfFile:self.statePath];
     
-    _title = product.localizedTitle;
+    NSDictionary *state;
     
-    NSInteger days   = 0;
-    NSInteger months = 0;
-    NSInteger years  = 0;
+    if (stateData)
+        state =
+        [NSPropertyListSerialization
+         propertyListWithData:stateData
+         options:NSPropertyListImmutable
+         format:nil
+         error:nil];
     
-    if (product.subscriptionPeriod.unit == SKProductPeriodUnitDay)
-        days = 1 * product.subscriptionPeriod.numberOfUnits;
+    if ([state
+         isKindOfClass:NSDictionary.class])
+        [self.values
+         addEntriesFromDictionary:state];
     
-    else if (product.subscriptionPeriod.unit == SKProductPeriodUnitWeek)
-        days = 7 * product.subscriptionPeriod.numberOfUnits;
+    NSData *journalData =
+    [NSData
+     dataWithContentsOfFile:self.journalPath
+     options:NSDataReadingMappedIfSafe
+     error:nil];
     
-    else if (product.subscriptionPeriod.unit == SKProductPeriodUnitMonth)
-        months = 1 * product.subscriptionPeriod.numberOfUnits;
+    NSUInteger length =
+    journalData.length;
     
-    else if (product.subscriptionPeriod.unit == SKProductPeriodUnitYear)
-        years = 1 * product.subscriptionPeriod.numberOfUnits;
+    NSUInteger offset =
+    StoreJournalScan(journalData.bytes,
+                     length,
+                     StoreStateApplyRecord,
+                     (__bridge void *)self.values);
     
-    if (days > 0 && days < 8)
-        _period = StoreItemPeriodWeek;
+    if (offset < length)
+        StoreErrorLog(@"[ERROR] Store state: journal is damaged at %lu, tail dropped",
+                      (unsigned long)offset);
     
-    else if (months > 0)
-        _period = StoreItemPeriodMonth;
+    if (![NSFileManager.defaultManager
+          fileExistsAtPath:self.journalPath])
+        [NSFileManager.defaultManager
+         createFileAtPath:self.journalPath
+         contents:nil
+         attributes:nil];
+    
+    self.journal =
+    [NSFileHandle
+     fileHandleForWritingAtPath:self.journalPath];
+    
+    // Отбрасываем недописанную запись
+    [self.journal
+     truncateAtOffset:offset
+     error:nil];
     
-    else if (years > 0)
-        _period = StoreItemPeriodYear;
+    self.journalSize = offset;
     
-    if (_period == StoreItemPeriodYear)
-    {
-        CGFloat p =
-        _priceNumber.floatValue / 52.;
-        
-        if (p > 0)
-            _pricePerWeekString  =
-            [self
-             cleanPrice:[numberFormatter
-                         stringFromNumber:@(p)]];
-        
-        p =
-        _priceNumber.floatValue / 12.;
-        
-        if (p > 0)
-            _pricePerMonthString =
-            [self
-             cleanPrice:[numberFormatter
-                         stringFromNumber:@(p)]];
-    }
+    [self.committed
+     setDictionary:self.values];
+}
+
+-(id)objectForKey:(NSString *)key
+{
+    if (key == nil)
+        return nil;
     
-    if (_period == StoreItemPeriodMonth)
+    @synchronized (self)
     {
-        NSInteger p =
-        _priceNumber.floatValue / 4.;
-        
-        if (p > 0)
-            _pricePerWeekString  =
-            [self
-             cleanPrice:[numberFormatter
-                         stringFromNumber:@(p)]];
+        return
+        self.values[key];
     }
 }
 
--(NSString *)detail
+-(void)setObject:(id        )object
+          forKey:(NSString *)key
 {
-    if (self.isPurchased == NO ||
-        self.startDate   == nil)
-        return
-        _product.localizedDescription;
-    
-    NSString *dateString;
-    
-    if (self.startDate && self.endDate)
-        dateString =
-        [NSString
-         stringWithFormat:@"%@—%@",
-         [self
-          startDateStringWithFormat:@"dd.MM.yyyy"],
-         [self
-          endDateStringWithFormat:@"dd.MM.yyyy"]];
+    if (key == nil)
+        return;
     
-    else
-        dateString =
-        [self
-         startDateStringWithFormat:@"dd.MM.yyyy"];
-
-    return
-    [NSString
-     stringWithFormat:@"%@ %@",
-     _product.localizedDescription,
-     dateString];
+    @synchronized (self)
+    {
+        if (object)
+        {
+            self.values[key]  = object;
+            self.changes[key] = object;
+            
+            [self.removals
+             removeObject:key];
+        }
+        
+        else
+        {
+            [self.values
+             removeObjectForKey:key];
+            
+            [self.changes
+             removeObjectForKey:key];
+            
+            [self.removals
+             addObject:key];
+        }
+    }
 }
 
--(NSString *)cleanPrice:(NSString *)price
+-(void)removeObjectForKey:(NSString *)key
 {
-    price =
-    [price
-     stringByReplacingOccurrencesOfString:@" "
-     withString:@""];
-    
-    price =
-    [price
-     stringByReplacingOccurrencesOfString:@".00"
-     withString:@""];
-    
-    price =
-    [price
-     stringByReplacingOccurrencesOfString:@",00"
-     withString:@""];
-    
-    return price;
+    [self
+     setObject:nil
+     forKey:key];
 }
 
--(BOOL)isPurchased
+// Записывает все накопленные изменения одной записью в журнал, синхронно
+-(void)commit
 {
-    BOOL purchased = NO;
-    
-    if (self.asPurchasedDates.count > 0 && Store.firstInstallDate)
+    dispatch_sync(self.queue, ^(void)
     {
-        NSCalendar *calendar = NSCalendar.currentCalendar;
-        
-        NSDateComponents *purchasedComponents =
-        [calendar
-         components:(NSCalendarUnitYear | NSCalendarUnitMonth | NSCalendarUnitDay)
-         fromDate:Store.firstInstallDate];
+        NSDictionary *record;
         
-        for (NSDictionary <NSString *, NSDate *> *range in self.asPurchasedDates)
-            if (range[@"single"])
-            {
-                NSDateComponents *singleComponents =
-                [calendar
-                 components:(NSCalendarUnitYear | NSCalendarUnitMonth | NSCalendarUnitDay)
-                 fromDate:range[@"single"]];
-                
-                if (singleComponents.year  == purchasedComponents.year  &&
-                    singleComponents.month == purchasedComponents.month &&
-                    singleComponents.day   == purchasedComponents.day)
-                {
-                    _startDate = Store.firstInstallDate;
-                    
-                    purchased = YES;
-                }
-            }
+        @synchronized (self)
+        {
+            if (self.changes.count  == 0 &&
+                self.removals.count == 0)
+                return;
             
-            else if (range[@"from"].timeIntervalSince1970 <= Store.firstInstallDate.timeIntervalSince1970 &&
-                     range[@"to"].timeIntervalSince1970 >= Store.firstInstallDate.timeIntervalSince1970)
-            {
-                _startDate = Store.firstInstallDate;
-                
-                purchased = YES;
-            }
-    }
-    
-    if (purchased == NO &&
-        self.asPurchasedVersions > 0 && Store.firstInstallAppVersion)
-    {
-        NSArray <NSString *> *purchasedVersion =
-        [Store.firstInstallAppVersion
-         componentsSeparatedByString:@"."];
+            record =
+            @{@"set":self.changes.copy,
+              @"remove":self.removals.allObjects};
+            
+            [self.changes
+             removeAllObjects];
+            
+            [self.removals
+             removeAllObjects];
+        }
         
-        for (NSDictionary <NSString *, NSArray <NSString *> *> *range in self.asPurchasedVersions)
-            if (range[@"single"])
-            {
-                if (range[@"single"].count != purchasedVersion.count)
-                    continue;
-                
-                if ([[range[@"single"]
-                      componentsJoinedByString:@"."]
-                     isEqualToString:[purchasedVersion
-                                      componentsJoinedByString:@"."]])
-                {
-                    _startDate = Store.firstInstallDate;
-                    
-                    purchased = YES;
-                }
-            }
+        NSData *payload =
+        [NSPropertyListSerialization
+         dataWithPropertyList:record
+         format:NSPropertyListBinaryFormat_v1_0
+         options:0
+         error:nil];
         
-            else
-            {
-                NSComparisonResult from =
-                [self
-                 compareVersion:purchasedVersion
-                 toVersion:range[@"from"]];
-                
-                NSComparisonResult to =
-                [self
-                 compareVersion:purchasedVersion
-                 toVersion:range[@"to"]];
-
-                if ((from == NSOrderedDescending || from == NSOrderedSame) &&
-                    (to   == NSOrderedAscending  || to   == NSOrderedSame))
-                {
-                    _startDate = Store.firstInstallDate;
-                    
-                    purchased = YES;
-                }
-            }
-    }
-    
-    if (purchased == NO)
-        switch (self.type)
+        if (payload == nil)
         {
-            case StoreItemTypeConsumable:
-            {
-                purchased =
-                self.consumableCount.integerValue > 0;
-                
-                break;
-            }
-
-            case StoreItemTypeNonConsumable:
-            {
-                purchased =
-                [NSUserDefaults.standardUserDefaults
-                 objectForKey:_identifier] != nil;
-                
-                break;
-            }
-
-            case StoreItemTypeNonRenewingSubscription:
-            case StoreItemTypeAutoRenewableSubscription:
-            {
-                purchased =
-                [NSUserDefaults.standardUserDefaults
-                 objectForKey:_identifier] &&
-                _endDate.timeIntervalSince1970 > NSDate.new.timeIntervalSince1970;
-                
-                break;
-            }
-                
-            case StoreItemTypeUnknown:
-                break;
+            StoreErrorLog(@"[ERROR] Store state: can't serialize %@",
+                          record);
+            
+            return;
         }
-    
-    if (purchased)
-        [StoreItem
-         addInfoLog:[NSString
-                     stringWithFormat:@"[INFO] Store isPurchased: Identifier '%@' %@ (type: %u)",
-                     _identifier,
-                     purchased ? @"is purchased" : @"is not purchased",
-                     self.type]];
-    
-    return
-    purchased;
-}
-
--(NSComparisonResult)compareVersion:(NSArray <NSString *> *)versionOneComp
-                          toVersion:(NSArray <NSString *> *)versionTwoComp
-{
-    NSInteger pos = 0;
-    
-    while (versionOneComp.count > pos || versionTwoComp.count > pos)
-    {
-        NSInteger v1 =
-        versionOneComp.count > pos ? versionOneComp[pos].intValue : 0;
-        
-        NSInteger v2 =
-        versionTwoComp.count > pos ? versionTwoComp[pos].intValue : 0;
-        
-        if (v1 < v2)
-            return
-            NSOrderedAscending;
-        
-        else if (v1 > v2)
-            return
-            NSOrderedDescending;
-        
-        pos ++;
-    }
-    
-    return
-    NSOrderedSame;
-}
-
-//   определенная дата: @"12/31/2020"
-//        диапазон дат: @"1/1/2020-12/31/2020"
-// определенная версия: @"3.0.1"
-//     диапазон версий: @"1.0-3.0.1"
--(void)setAsPurchasedForRanges:(NSArray <NSString *> *)ranges
-{
-    _asPurchasedDates    = @[];
-    _asPurchasedVersions = @[];
-    
-    if (ranges == nil)
-        return;
-    
-    for (NSString *range in ranges)
-    {
-        NSCharacterSet *charactersToRemove =
-        [[NSCharacterSet
-         characterSetWithCharactersInString:@"0123456789./-"]
-         invertedSet];
-        
-        NSString *cleanRange =
-        [[range
-          componentsSeparatedByCharactersInSet:charactersToRemove]
-         componentsJoinedByString:@""];
-        
-        if (cleanRange.length < 3)
-            continue;
-        
-        NSArray <NSString *> *period =
-        [cleanRange
-         componentsSeparatedByString:@"-"];
-        
-        if (period.count > 2)
-            [NSException
-             raise:@"Store"
-             format:@"Wrong range: %@", range];
         
-        NSString *from =
-        period.firstObject;
-        
-        NSString *to =
-        period.lastObject;
+        uint8_t header[STORE_JOURNAL_HEADER_SIZE];
         
-        if (([from
-              containsString:@"/"] &&
-             [from
-              containsString:@"."]) ||
-            ([to
-              containsString:@"/"] &&
-             [to
-              containsString:@"."]))
-            [NSException
-             raise:@"Store"
-             format:@"Wrong range: %@", range];
-
-        NSDate *fromDate;
-        NSDate *toDate;
+        StoreJournalHeader(header,
+                           payload.bytes,
+                           (uint32_t)payload.length);
         
-        NSDateFormatter *dateFormater =
-        NSDateFormatter.new;
+        NSMutableData *data =
+        [NSMutableData
+         dataWithBytes:header
+         length:sizeof(header)];
         
-        dateFormater.dateFormat = @"dd/MM/yyyy";
+        [data
+         appendData:payload];
         
-        dateFormater.timeZone =
-        [NSTimeZone
-         timeZoneWithName:@"UTC"];
+        [self.journal
+         writeData:data
+         error:nil];
         
-        if ([from
-             containsString:@"/"])
-            fromDate =
-            [dateFormater
-             dateFromString:from];
+        [self.journal
+         synchronizeAndReturnError:nil];
         
-        if ([to
-             containsString:@"/"])
-            toDate =
-            [dateFormater
-             dateFromString:to];
-
-        NSArray <NSString *> *fromVersion;
-        NSArray <NSString *> *toVersion;
+        self.journalSize += data.length;
         
-        if ([from
-             containsString:@"."])
-            fromVersion =
-            [from
-             componentsSeparatedByString:@"."];
-        
-        if ([to
-             containsString:@"."])
-            toVersion =
-            [to
-             componentsSeparatedByString:@"."];
-
-        NSMutableArray <NSDictionary <NSString *, NSDate *> *> *dates =
-        _asPurchasedDates.mutableCopy;
+        [self.committed
+         addEntriesFromDictionary:record[@"set"]];
         
-        NSMutableArray <NSDictionary <NSString *, NSArray <NSString *> *> *> *versions =
-        _asPurchasedVersions.mutableCopy;
+        [self.committed
+         removeObjectsForKeys:record[@"remove"]];
         
-        if (period.count == 1)
-        {
-            if (fromDate)
-            {
-                [dates
-                 addObject:@{@"single":fromDate}];
-                
-                _asPurchasedDates =
-                dates.copy;
-            }
-            
-            else if (fromVersion)
-            {
-                [versions
-                 addObject:@{@"single":fromVersion}];
-                
-                _asPurchasedVersions =
-                versions.copy;
-            }
-            
-            else
-                [NSException
-                 raise:@"Store"
-                 format:@"Wrong range: %@", range];
-        }
-                
-        else if (period.count == 2)
-        {
-            if (fromDate && toDate)
-            {
-                [dates
-                 addObject:@{@"from":fromDate,
-                               @"to":toDate}];
-                
-                _asPurchasedDates =
-                dates.copy;
-            }
-            
-            else if (fromVersion && toVersion)
-            {
-                [versions
-                 addObject:@{@"from":fromVersion,
-                               @"to":toVersion}];
-                
-                _asPurchasedVersions =
-                versions.copy;
-            }
-            
-            else
-                [NSException
-                 raise:@"Store"
-                 format:@"Wrong range: %@", range];
-        }
-    }
+        if (self.journalSize > STORE_STATE_COMPACT_SIZE)
+            [self compact];
+    });
 }
 
-#pragma mark - Purchase Product
+// Вызывается только на self.queue
+// В values могут быть еще не записанные изменения других потоков, поэтому только committed
+-(void)compact
+{
+    NSDictionary *values =
+    self.committed;
+    
+    NSData *data =
+    [NSPropertyListSerialization
+     dataWithPropertyList:values
+     format:NSPropertyListBinaryFormat_v1_0
+     options:0
+     error:nil];
+    
+    // Снимок пишется атомарно, и только после этого журнал обнуляется.
+    // Если сбой произойдет между ними, журнал просто применится к снимку повторно
+    if (![data
+          writeToFile:self.statePath
+          options:NSDataWritingAtomic
+          error:nil])
+        return;
+    
+    [self.journal
+     truncateAtOffset:0
+     error:nil];
+    
+    [self.journal
+     synchronizeAndReturnError:nil];
+    
+    self.journalSize = 0;
+}
 
--(void)purchaseWithCompletion:(PurchaseCompletion)completion
+// Переносит ключи из NSUserDefaults, если их еще нет в состоянии
+-(void)migrateKeys:(NSArray <NSString *> *)keys
 {
-    [StoreItem
-      addInfoLog:[NSString
-                  stringWithFormat:@"[INFO] Store: Try purchasing product with identifier '%@'...",
-                  _identifier]];
+    NSMutableArray <NSString *> *migrated =
+    NSMutableArray.new;
     
-    if (!self.product || !Store.isReady)
+    for (NSString *key in keys)
     {
-        NSString *errorMessage =
-        [NSString stringWithFormat:@"[ERROR] Store: Purchase with identifier '%@' failed. Store is not Ready, or product for this identifier not found!",
-              _identifier];
-        
-        [StoreItem
-         addErrorLog:errorMessage];
+        id object =
+        [NSUserDefaults.standardUserDefaults
+         objectForKey:key];
         
-        NSError *error =
-        [NSError
-         errorWithDomain:@"Store"
-         code:-1
-         userInfo:@{NSLocalizedDescriptionKey:errorMessage}];
+        if (object == nil)
+            continue;
         
-        if (completion)
-            completion(error);
+        if ([self
+             objectForKey:key] == nil)
+            [self
+             setObject:object
+             forKey:key];
         
-        return;
+        [migrated
+         addObject:key];
     }
     
-    if (completion)
-        [self.purchaseCompletions
-         addObject:completion];
-    
-    if (self.isPurchasing)
+    if (migrated.count == 0)
         return;
     
-    self.isPurchasing = YES;
-    
-    SKMutablePayment *payment =
-    [SKMutablePayment
-     paymentWithProduct:self.product];
-    
-    payment.quantity = 1;
+    [self commit];
     
-    [self.purchaseQueue
-     addTransactionObserver:self];
+    for (NSString *key in migrated)
+        [NSUserDefaults.standardUserDefaults
+         removeObjectForKey:key];
     
-    [self.purchaseQueue
-     addPayment:payment];
+    StoreInfoLog(@"[INFO] Store state: migrated keys %@",
+                 migrated);
 }
 
--(void)setDefaultConsumableCount:(NSNumber *)defaultConsumableCount
+-(void)migrateKeysWithPrefixes:(NSArray <NSString *> *)prefixes
 {
-    [NSUserDefaults.standardUserDefaults
-     setObject:defaultConsumableCount
-     forKey:[@"defaultConsumableCount:"
-             stringByAppendingString:self.identifier]];
+    NSMutableArray <NSString *> *keys =
+    NSMutableArray.new;
     
-    [NSUserDefaults.standardUserDefaults
-     synchronize];
+    for (NSString *key in NSUserDefaults.standardUserDefaults.dictionaryRepresentation.allKeys)
+        for (NSString *prefix in prefixes)
+            if ([key
+                 hasPrefix:prefix])
+                [keys
+                 addObject:key];
+    
+    [self
+     migrateKeys:keys];
 }
 
--(NSNumber *)defaultConsumableCount
+@end
+
+#pragma mark - Store Entitlements
+
+// Неизменяемый снимок купленных покупок. Пересобирается после разбора чека,
+// транзакции или изменения одноразовых покупок, читается с любого потока без блокировок
+@interface StoreEntitlements : NSObject
+
+@property (nonatomic, assign, readonly) NSUInteger generation;
+
+// identifier -> время окончания (timeIntervalSince1970) или 0 если покупка бессрочная
+@property (nonatomic, strong, readonly) NSDictionary <NSString *, NSNumber *> *expirations;
+
+@property (nonatomic, strong, readonly) NSArray <StoreItem *> *storeItemsPurchased;
+@property (nonatomic, strong, readonly) NSDictionary <NSNumber *, NSArray <StoreItem *> *> *storeItemsPurchasedByType;
+
+// Ближайшее окончание подписки, после которого снимок нужно пересобрать
+@property (nonatomic, assign, readonly) NSTimeInterval validUntil;
+
+@end
+
+@implementation StoreEntitlements
+
+-(instancetype)initWithGeneration:(NSUInteger                                           )generation
+                      expirations:(NSDictionary <NSString *, NSNumber *>                *)expirations
+              storeItemsPurchased:(NSArray <StoreItem *>                                *)storeItemsPurchased
+        storeItemsPurchasedByType:(NSDictionary <NSNumber *, NSArray <StoreItem *> *> *)storeItemsPurchasedByType
+                       validUntil:(NSTimeInterval                                       )validUntil
 {
-    [NSUserDefaults.standardUserDefaults
-     synchronize];
-    
-    NSNumber *defaultConsumableCount =
-    [NSUserDefaults.standardUserDefaults
-     objectForKey:[@"defaultConsumableCount:"
-                   stringByAppendingString:self.identifier]];
-    
-    if (defaultConsumableCount == nil)
-        return @1;
+    if (self = [super init])
+    {
+        _generation                = generation;
+        _expirations               = expirations.copy;
+        _storeItemsPurchased       = storeItemsPurchased.copy;
+        _storeItemsPurchasedByType = storeItemsPurchasedByType.copy;
+        _validUntil                = validUntil;
+    }
     
-    return
-    defaultConsumableCount;
+    return self;
 }
 
--(void)setConsumableCount:(NSNumber *)consumableCount
+@end
+
+#pragma mark - Store Catalog
+
+static NSComparisonResult StoreItemComparePrice(StoreItem *storeItem1, StoreItem *storeItem2)
 {
-    if (consumableCount == nil)
-        [NSUserDefaults.standardUserDefaults
-         removeObjectForKey:[@"consumableCount:"
-                             stringByAppendingString:self.identifier]];
+    if (storeItem1.priceNumber == storeItem2.priceNumber)
+        return NSOrderedSame;
     
-    else
-        [NSUserDefaults.standardUserDefaults
-         setObject:consumableCount
-         forKey:[@"consumableCount:"
-                 stringByAppendingString:self.identifier]];
+    if (storeItem1.priceNumber == nil)
+        return NSOrderedAscending;
     
-    [NSUserDefaults.standardUserDefaults
-     synchronize];
-}
-
--(NSNumber *)consumableCount
-{
-    [NSUserDefaults.standardUserDefaults
-     synchronize];
+    if (storeItem2.priceNumber == nil)
+        return NSOrderedDescending;
     
     return
-    [NSUserDefaults.standardUserDefaults
-     objectForKey:[@"consumableCount:"
-                   stringByAppendingString:self.identifier]];
+    [storeItem1.priceNumber
+     compare:storeItem2.priceNumber];
 }
 
--(void)consumablePurchaseDecrease
-{
-    [self 
-    consumablePurchaseDecreaseCount:@(1)];
-}
+// Неизменяемый индекс покупок и отсортированные списки из него.
+// Сбрасывается при смене списка покупок или продуктов, пересобирается при первом обращении
+@interface StoreCatalog : NSObject
 
--(void)consumablePurchaseDecreaseCount:(NSNumber *)decreaseCount
-{
-    [StoreItem
-     addInfoLog:[NSString
-                 stringWithFormat:@"[INFO] Store: Purchasing decrease product from:%@ with identifier '%@'",
-                 self.consumableCount,
-                 _identifier]];
+@property (nonatomic, strong, readonly) NSDictionary <NSString *, StoreItem *> *storeItemsByIdentifier;
 
-    NSUInteger dCount =
-    labs(decreaseCount.integerValue);
-    
-    NSInteger count =
-    self.consumableCount.integerValue;
-    
-    count =
-    count - dCount;
-    
-    if (count <= 0)
+@property (nonatomic, strong, readonly) NSArray <StoreItem *> *storeItemsAll; // По типу и цене
+@property (nonatomic, strong, readonly) NSArray <StoreItem *> *storeItems;    // По типу и цене, без invalid
+@property (nonatomic, strong, readonly) NSDictionary <NSNumber *, NSArray <StoreItem *> *> *storeItemsByType; // По цене, только загруженные
+
+@end
+
+@implementation StoreCatalog
+
+-(instancetype)initWithStoreItems:(NSArray <StoreItem *> *)storeItems
+{
+    if (self = [super init])
     {
-        self.consumableCount =
-        nil;
+        NSMutableDictionary <NSString *, StoreItem *> *storeItemsByIdentifier =
+        [NSMutableDictionary
+         dictionaryWithCapacity:storeItems.count];
+        
+        for (StoreItem *storeItem in storeItems)
+            storeItemsByIdentifier[storeItem.identifier] =
+            storeItem;
+        
+        NSArray <StoreItem *> *storeItemsAll =
+        [storeItems
+         sortedArrayWithOptions:NSSortStable
+         usingComparator:^NSComparisonResult(StoreItem *storeItem1, StoreItem *storeItem2)
+        {
+            if (storeItem1.type != storeItem2.type)
+                return
+                storeItem1.type < storeItem2.type ? NSOrderedAscending : NSOrderedDescending;
+            
+            return
+            StoreItemComparePrice(storeItem1, storeItem2);
+        }];
         
-        [NSUserDefaults.standardUserDefaults
-         removeObjectForKey:self.identifier];
+        NSMutableArray <StoreItem *> *validStoreItems =
+        [NSMutableArray
+         arrayWithCapacity:storeItemsAll.count];
         
-        [NSUserDefaults.standardUserDefaults
-         synchronize];
+        NSMutableDictionary <NSNumber *, NSMutableArray <StoreItem *> *> *storeItemsByType =
+        NSMutableDictionary.new;
         
-        [StoreItem
-         addInfoLog:[NSString
-                     stringWithFormat:@"[INFO] Store: Purchasing product remove with identifier '%@'",
-                  _identifier]];
-    }
-    
-    else
-    {
-        self.consumableCount =
-        @(count);
+        for (StoreItem *storeItem in storeItemsAll)
+        {
+            if (storeItem.isInvalid == NO)
+                [validStoreItems
+                 addObject:storeItem];
+            
+            if (storeItem.title.length == 0)
+                continue;
+            
+            NSMutableArray <StoreItem *> *typed =
+            storeItemsByType[@(storeItem.type)];
+            
+            if (typed == nil)
+                storeItemsByType[@(storeItem.type)] =
+                typed =
+                NSMutableArray.new;
+            
+            [typed
+             addObject:storeItem];
+        }
         
-        [StoreItem
-         addInfoLog:[NSString
-                     stringWithFormat:@"[INFO] Store: Purchasing decreased product to:%@ with identifier '%@'",
-                     self.consumableCount,
-                     _identifier]];
+        for (NSNumber *type in storeItemsByType.allKeys)
+            storeItemsByType[type] =
+            storeItemsByType[type].copy;
+        
+        _storeItemsByIdentifier = storeItemsByIdentifier.copy;
+        _storeItemsAll          = storeItemsAll;
+        _storeItems             = validStoreItems.copy;
+        _storeItemsByType       = storeItemsByType.copy;
     }
-         
-    dispatch_async(dispatch_get_main_queue(), ^(void)
-    {
-        [NSNotificationCenter.defaultCenter
-         postNotificationName:STORE_MANAGER_CHANGED
-         object:nil];
-    });
+    
+    return self;
 }
 
--(void)returnCompletionsWithError:(NSError *)error
+@end
+
+#pragma mark - Store Formatters
+
+// Форматтеры создаются один раз на локаль и формат, после настройки не меняются.
+// Сами NSNumberFormatter и NSDateFormatter потокобезопасны, блокировка нужна только кешу
+@interface StoreFormatters : NSObject
+
++(NSNumberFormatter *)currencyFormatterWithLocale:(NSLocale *)locale;
+
+// Время всегда UTC
++(NSDateFormatter *)dateFormatterWithFormat:(NSString *)format
+                                     locale:(NSLocale *)locale;
+
+// При смене локали устройства
++(void)reset;
+
+@end
+
+@implementation StoreFormatters
+
+static os_unfair_lock                                   StoreFormattersLock = OS_UNFAIR_LOCK_INIT;
+static NSMutableDictionary <NSArray *, NSFormatter *> *StoreFormattersCache;
+
++(NSFormatter *)formatterWithKey:(NSArray                 *)key
+                          create:(NSFormatter *(^)(void)   )create
 {
-    [self.purchaseQueue
-     addTransactionObserver:self];
+    os_unfair_lock_lock(&StoreFormattersLock);
     
-    self.isPurchasing = NO;
+    NSFormatter *formatter =
+    StoreFormattersCache[key];
     
-    for (PurchaseCompletion completion in self.purchaseCompletions)
-        completion(error);
+    os_unfair_lock_unlock(&StoreFormattersLock);
     
-    [self.purchaseCompletions removeAllObjects];
+    if (formatter)
+        return formatter;
     
-    dispatch_async(dispatch_get_main_queue(), ^(void)
+    // Создаем вне блокировки, при гонке остается первый
+    formatter =
+    create();
+    
+    os_unfair_lock_lock(&StoreFormattersLock);
+    
+    if (StoreFormattersCache == nil)
+        StoreFormattersCache =
+        NSMutableDictionary.new;
+    
+    if (StoreFormattersCache[key])
+        formatter =
+        StoreFormattersCache[key];
+    
+    else
+        StoreFormattersCache[key] =
+        formatter;
+    
+    os_unfair_lock_unlock(&StoreFormattersLock);
+    
+    return formatter;
+}
+
++(NSNumberFormatter *)currencyFormatterWithLocale:(NSLocale *)locale
+{
+    return
+    (NSNumberFormatter *)[self
+                          formatterWithKey:@[@"currency", locale.localeIdentifier ?: @""]
+                          create:^NSFormatter *(void)
     {
-        [NSNotificationCenter.defaultCenter
-         postNotificationName:STORE_MANAGER_CHANGED
-         object:error];
-    });
+        NSNumberFormatter *numberFormatter = NSNumberFormatter.new;
+        
+        numberFormatter.formatterBehavior = NSNumberFormatterBehavior10_4;
+        numberFormatter.numberStyle       = NSNumberFormatterCurrencyStyle;
+        numberFormatter.locale            = locale;
+        
+        return numberFormatter;
+    }];
 }
 
-#pragma mark - Purchase Product Delegate
++(NSDateFormatter *)dateFormatterWithFormat:(NSString *)format
+                                     locale:(NSLocale *)locale
+{
+    return
+    (NSDateFormatter *)[self
+                        formatterWithKey:@[format, locale.localeIdentifier ?: @""]
+                        create:^NSFormatter *(void)
+    {
+        NSDateFormatter *dateFormatter = NSDateFormatter.new;
+        
+        dateFormatter.timeZone   = [NSTimeZone timeZoneWithAbbreviation:@"UTC"];
+        dateFormatter.dateFormat = format;
+        dateFormatter.locale     = locale;
+        
+        return dateFormatter;
+    }];
+}
 
--(void)paymentQueue:(SKPaymentQueue *)queue
-updatedTransactions:(NSArray        *)transactions
++(void)reset
 {
-    [StoreItem
-     addInfoLog:@"[INFO] Store: Update transaction fired with Purchase Queue"];
+    os_unfair_lock_lock(&StoreFormattersLock);
     
-//    NSMutableDictionary <NSString *, NSNumber *> *manualRestored =
-//    [[NSUserDefaults.standardUserDefaults
-//      objectForKey:MANUAL_RESTORED] mutableCopy];
-//
-//    if (manualRestored == nil)
-//        manualRestored =
-//        NSMutableDictionary.new;
+    [StoreFormattersCache
+     removeAllObjects];
     
-    NSNumber *timestamp =
-    @(NSDate.new.timeIntervalSince1970);
+    os_unfair_lock_unlock(&StoreFormattersLock);
+}
+
+@end
+
+#pragma mark - Store Metrics
+
+typedef enum
+{
+    StoreMetricsPhaseConfig,
+    StoreMetricsPhaseProducts,
+    StoreMetricsPhaseReceiptRefresh,
+    StoreMetricsPhaseVerify,
+    StoreMetricsPhaseParse,
+    StoreMetricsPhaseCompletion,
+    StoreMetricsPhaseRestore, // Весь путь от запроса продуктов до completion
+    StoreMetricsPhaseCount
+}StoreMetricsPhase;
+
+static const char *StoreMetricsPhaseNames[StoreMetricsPhaseCount] =
+{"config", "products", "receiptRefresh", "verify", "parse", "completion", "restore"};
+
+// Верхние границы корзин гистограммы в мс, последняя корзина для всего что дольше
+#define STORE_METRICS_BUCKETS 10
+
+static const uint64_t StoreMetricsBucketBoundsMs[STORE_METRICS_BUCKETS - 1] =
+{10, 50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
+// Выключенные замеры стоят одной проверки флага, аргументы при этом не вычисляются
+static volatile BOOL StoreMetricsEnabled = NO;
+
+#define StoreMetricsBegin(phase)\
+do { if (StoreMetricsEnabled) [StoreMetrics.current beginPhase:phase]; } while (0)
+
+#define StoreMetricsEnd(phase, error)\
+do { if (StoreMetricsEnabled) [StoreMetrics.current endPhase:phase withError:error]; } while (0)
+
+#define StoreMetricsCount(format, ...)\
+do { if (StoreMetricsEnabled) [StoreMetrics.current addCount:1 forKey:[NSString stringWithFormat:format, ##__VA_ARGS__]]; } while (0)
+
+#define StoreMetricsBytes(key, length)\
+do { if (StoreMetricsEnabled) [StoreMetrics.current addBytes:length forKey:key]; } while (0)
+
+typedef struct
+{
+    uint64_t         start;   // нс монотонных часов (CLOCK_UPTIME_RAW)
+    uint64_t         end;
+    uint64_t         count;
+    uint64_t         errors;
+    uint64_t         lastNs;
+    uint64_t         maxNs;
+    uint64_t         totalNs;
+    uint64_t         histogram[STORE_METRICS_BUCKETS];
+    os_signpost_id_t signpost;
+}StoreMetricsPhaseData;
+
+// Замеры этапов setup/restore. Интервалы также видны в Instruments (os_signpost, категория Restore)
+@interface StoreMetrics : NSObject
+{
+    os_unfair_lock        _lock;
+    StoreMetricsPhaseData _phases[StoreMetricsPhaseCount];
+}
+
+@property (nonatomic, strong) NSMutableDictionary <NSString *, NSNumber *> *counters;
+@property (nonatomic, strong) NSMutableDictionary <NSString *, NSNumber *> *bytes;
+@property (nonatomic, strong) os_log_t                                      log;
+
+@property (nonatomic, strong) dispatch_source_t                             timer;
+
+@end
+
+@implementation StoreMetrics
+
++(instancetype)current
+{
+    static StoreMetrics *_current = nil;
+    static dispatch_once_t oncePredicate;
     
-    for (SKPaymentTransaction *transaction in transactions)
+    dispatch_once(&oncePredicate, ^
     {
-        [StoreItem
-         addInfoLog:[NSString
-                     stringWithFormat:@"[INFO] Store: Transaction is [%@]",
-                     transaction.payment.productIdentifier]];
+        _current = self.new;
+    });
+    
+    return _current;
+}
+
+-(instancetype)init
+{
+    if (self = [super init])
+    {
+        _lock = OS_UNFAIR_LOCK_INIT;
         
-        if (![transaction.payment.productIdentifier
-              isEqualToString:_identifier])
-            continue;
+        self.counters =
+        NSMutableDictionary.new;
         
-        switch (transaction.transactionState)
-        {
-            case SKPaymentTransactionStateFailed:
-            {
-                [StoreItem
-                 addErrorLog:@"[ERROR] Store: Update transaction fired [SKPaymentTransactionStateFailed]"];
-                
-                dispatch_async(dispatch_get_main_queue(), ^(void)
-                {
-                    [StoreItem
-                     addErrorLog:[NSString
-                                  stringWithFormat:@"[ERROR] Store: %@",
-                                  transaction.error]];
-                    
-                    [self
-                     returnCompletionsWithError:transaction.error];
-                });
-                
-                [queue
-                 finishTransaction:transaction];
-                
-                break;
-            }
-                
-            case SKPaymentTransactionStateRestored:
-            case SKPaymentTransactionStatePurchased:
-            {
-                _transactionState =
-                transaction.transactionState;
-                
-                [StoreItem
-                 addInfoLog:[NSString
-                             stringWithFormat:@"[INFO] Store: Update transaction fired [SKPaymentTransactionStatePurchased || restored]"]];
-
-                [self
-                 restoreWithTransaction:transaction];
-                
-//                if (self.type == StoreItemTypeNonConsumable &&
-//                    self.isPurchased)
-//                {
-//                    manualRestored[transaction.payment.productIdentifier] =
-//                    timestamp;
-//
-//                    [StoreItem
-//                     addInfoLog:[NSString
-//                                 stringWithFormat:@"[INFO] Store: added manualRestored identifier %@",
-//                                 transaction.payment.productIdentifier]];
-//                }
-                
-                dispatch_async(dispatch_get_main_queue(), ^(void)
-                {
-                    [self
-                     returnCompletionsWithError:nil];
-                });
-                
-                [queue
-                 finishTransaction:transaction];
-                
-                break;
-            }
-                
-            case SKPaymentTransactionStatePurchasing:
-            case SKPaymentTransactionStateDeferred:
-            default:
-                break;
-        }
+        self.bytes =
+        NSMutableDictionary.new;
+        
+        self.log =
+        os_log_create("Store", "Restore");
     }
     
-//    [NSUserDefaults.standardUserDefaults
-//     setObject:manualRestored.copy
-//     forKey:MANUAL_RESTORED];
-//
-//    [NSUserDefaults.standardUserDefaults
-//     synchronize];
-//
-//    [StoreItem
-//     addInfoLog:[NSString
-//                 stringWithFormat:@"[INFO] Store: manualRestored is %@",
-//                 manualRestored]];
+    return self;
 }
 
--(void)restoreWithTransaction:(SKPaymentTransaction *)transaction
+-(void)beginPhase:(StoreMetricsPhase)phase
 {
-    [StoreItem
-     addInfoLog:[NSString
-                 stringWithFormat:@"[INFO] Store restoreWithTransaction: added identifier %@",
-                 transaction.payment.productIdentifier]];
-        
-    [NSUserDefaults.standardUserDefaults
-     setObject:transaction.transactionDate.description
-     forKey:transaction.payment.productIdentifier];
+    os_signpost_id_t signpost =
+    os_signpost_id_generate(self.log);
     
-    [NSUserDefaults.standardUserDefaults
-     synchronize];
+    os_unfair_lock_lock(&_lock);
     
-    [StoreItem
-     addInfoLog:[NSString
-                 stringWithFormat:@"[INFO] Store restoreWithTransaction: check for added identifier %@, is %@",
-                 transaction.payment.productIdentifier,
-                 [NSUserDefaults.standardUserDefaults
-                  objectForKey:transaction.payment.productIdentifier] == nil ? @"NO" : @"YES"]];
+    // Незакрытый интервал (например, повтор после 21007) просто перезапускается
+    _phases[phase].start    = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    _phases[phase].end      = 0;
+    _phases[phase].signpost = signpost;
     
-    self.consumableCount =
-    @(self.consumableCount.integerValue +
-    self.defaultConsumableCount.integerValue);
+    os_unfair_lock_unlock(&_lock);
     
-    _startDate =
-    transaction.transactionDate;
+    os_signpost_interval_begin(self.log, signpost, "Phase", "%{public}s", StoreMetricsPhaseNames[phase]);
+}
+
+-(void)endPhase:(StoreMetricsPhase)phase
+      withError:(NSError         *)error
+{
+    uint64_t now =
+    clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
     
-    _transactionId =
-    transaction.transactionIdentifier;
+    os_unfair_lock_lock(&_lock);
     
-    if (_product.subscriptionPeriod)
+    StoreMetricsPhaseData *data =
+    &_phases[phase];
+    
+    // Конец без начала (замеры включили посреди этапа) не считаем
+    if (data->start == 0 || data->end != 0)
     {
-        NSDateComponents *dayComponent =
-        NSDateComponents.new;
-        
-        if (_product.subscriptionPeriod.unit == SKProductPeriodUnitDay)
-            dayComponent.day = 1 * self.product.subscriptionPeriod.numberOfUnits;
+        os_unfair_lock_unlock(&_lock);
         
-        else if (_product.subscriptionPeriod.unit == SKProductPeriodUnitWeek)
-            dayComponent.day = 7 * self.product.subscriptionPeriod.numberOfUnits;
-        
-        else if (_product.subscriptionPeriod.unit == SKProductPeriodUnitMonth)
-            dayComponent.month = 1 * self.product.subscriptionPeriod.numberOfUnits;
-        
-        else if (_product.subscriptionPeriod.unit == SKProductPeriodUnitYear)
-            dayComponent.year = 1 * self.product.subscriptionPeriod.numberOfUnits;
-        
-        _endDate =
-        [NSCalendar.currentCalendar
-         dateByAddingComponents:dayComponent
-         toDate:_startDate
-         options:0];
+        return;
     }
     
-    else if (_type == StoreItemTypeNonRenewingSubscription)
+    uint64_t duration =
+    now - data->start;
+    
+    data->end      = now;
+    data->lastNs   = duration;
+    data->totalNs += duration;
+    data->maxNs    = MAX(data->maxNs, duration);
+    data->count   ++;
+    
+    size_t bucket = 0;
+    
+    while (bucket < STORE_METRICS_BUCKETS - 1 &&
+           duration > StoreMetricsBucketBoundsMs[bucket] * NSEC_PER_MSEC)
+        bucket ++;
+    
+    data->histogram[bucket] ++;
+    
+    if (error)
     {
-        NSDateComponents *dayComponent =
-        NSDateComponents.new;
-        
-        if (_period == StoreItemPeriodWeek)
-            dayComponent.day = 7;
-        
-        else if (_period == StoreItemPeriodMonth)
-            dayComponent.month = 1;
+        data->errors ++;
         
-        else if (_period == StoreItemPeriodYear)
-            dayComponent.year = 1;
+        NSString *key =
+        [NSString
+         stringWithFormat:@"%s.error.%ld",
+         StoreMetricsPhaseNames[phase],
+         (long)error.code];
         
-        _endDate =
-        [NSCalendar.currentCalendar
-         dateByAddingComponents:dayComponent
-         toDate:_startDate
-         options:0];
-    }        
+        self.counters[key] =
+        @(self.counters[key].unsignedLongLongValue + 1);
+    }
+    
+    os_signpost_id_t signpost =
+    data->signpost;
+    
+    os_unfair_lock_unlock(&_lock);
+    
+    os_signpost_interval_end(self.log, signpost, "Phase", "%{public}s%{public}s", StoreMetricsPhaseNames[phase], error ? " error" : "");
 }
 
-#pragma mark - Store Item Helpers
-
--(NSString *)startDateStringWithFormat:(NSString *)stringFormat
+-(void)addCount:(uint64_t  )count
+         forKey:(NSString *)key
 {
-    if (!self.startDate)
-        return nil;
+    os_unfair_lock_lock(&_lock);
+    
+    self.counters[key] =
+    @(self.counters[key].unsignedLongLongValue + count);
     
-    NSDateFormatter *dateFormater =
-    NSDateFormatter.new;
+    os_unfair_lock_unlock(&_lock);
+}
+
+// Последний размер и сумма за все время
+-(void)addBytes:(uint64_t  )length
+         forKey:(NSString *)key
+{
+    NSString *totalKey =
+    [key
+     stringByAppendingString:@".total"];
     
-    dateFormater.timeZone         =
-    [NSTimeZone
-     timeZoneWithAbbreviation:@"UTC"];
+    os_unfair_lock_lock(&_lock);
     
-    dateFormater.dateFormat       =
-    stringFormat;
+    self.bytes[key] =
+    @(length);
     
-    dateFormater.locale           =
-    NSLocale.currentLocale;
+    self.bytes[totalKey] =
+    @(self.bytes[totalKey].unsignedLongLongValue + length);
     
-    return
-    [dateFormater
-     stringFromDate:self.startDate];
+    os_unfair_lock_unlock(&_lock);
 }
 
--(NSString *)endDateStringWithFormat:(NSString *)stringFormat
+-(NSDictionary <NSString *, id> *)snapshot
 {
-    if (!self.endDate)
-        return nil;
+    NSMutableArray <NSNumber *> *bounds =
+    NSMutableArray.new;
     
-    NSDateFormatter *dateFormater =
-    NSDateFormatter.new;
+    for (size_t index = 0; index < STORE_METRICS_BUCKETS - 1; index ++)
+        [bounds
+         addObject:@(StoreMetricsBucketBoundsMs[index])];
     
-    dateFormater.timeZone         =
-    [NSTimeZone
-     timeZoneWithAbbreviation:@"UTC"];
+    NSMutableDictionary <NSString *, NSDictionary *> *phases =
+    NSMutableDictionary.new;
     
-    dateFormater.dateFormat       =
-    stringFormat;
+    os_unfair_lock_lock(&_lock);
     
-    dateFormater.locale           =
-    NSLocale.currentLocale;
+    for (size_t phase = 0; phase < StoreMetricsPhaseCount; phase ++)
+    {
+        StoreMetricsPhaseData data =
+        _phases[phase];
+        
+        if (data.start == 0)
+            continue;
+        
+        NSMutableArray <NSNumber *> *histogram =
+        NSMutableArray.new;
+        
+        for (size_t bucket = 0; bucket < STORE_METRICS_BUCKETS; bucket ++)
+            [histogram
+             addObject:@(data.histogram[bucket])];
+        
+        phases[@(StoreMetricsPhaseNames[phase])] =
+        @{@"start":@(data.start / (double)NSEC_PER_SEC),
+          @"end":@(data.end / (double)NSEC_PER_SEC), // 0 если этап еще идет
+          @"count":@(data.count),
+          @"errors":@(data.errors),
+          @"lastMs":@(data.lastNs / (double)NSEC_PER_MSEC),
+          @"maxMs":@(data.maxNs / (double)NSEC_PER_MSEC),
+          @"totalMs":@(data.totalNs / (double)NSEC_PER_MSEC),
+          @"histogram":histogram.copy};
+    }
     
-    return
-    [dateFormater
-     stringFromDate:self.endDate];
-}
-
--(StoreItem *)consumable
-{
-    _type =
-    StoreItemTypeConsumable;
+    NSDictionary *snapshot =
+    @{@"phases":phases.copy,
+      @"histogramBoundsMs":bounds.copy,
+      @"counters":self.counters.copy,
+      @"bytes":self.bytes.copy};
     
-    return self;
+    os_unfair_lock_unlock(&_lock);
+    
+    return snapshot;
 }
 
--(StoreItem *)nonConsumable
+-(void)reset
 {
-    _type =
-    StoreItemTypeNonConsumable;
+    os_unfair_lock_lock(&_lock);
     
-    return self;
+    memset(_phases, 0, sizeof(_phases));
+    
+    [self.counters
+     removeAllObjects];
+    
+    [self.bytes
+     removeAllObjects];
+    
+    os_unfair_lock_unlock(&_lock);
 }
 
--(StoreItem *)autoRenewableSubscription
+@end
+
+#pragma mark - Store Transport
+
+// Транспорт по умолчанию: без кеша и cookies, чтобы 304 доходил до нас как есть
+@interface StoreURLSessionTransport : NSObject <StoreTransport>
+
+@property (nonatomic, strong) NSURLSession *session;
+
+// Задачи по объекту запроса, для cancelRequest:
+@property (nonatomic, strong) NSMapTable <NSURLRequest *, NSURLSessionTask *> *tasks;
+
+@end
+
+@implementation StoreURLSessionTransport
+
+-(instancetype)init
 {
-    _type =
-    StoreItemTypeAutoRenewableSubscription;
+    if (self = [super init])
+    {
+        NSURLSessionConfiguration *configuration =
+        NSURLSessionConfiguration.ephemeralSessionConfiguration;
+        
+        configuration.URLCache           = nil;
+        configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+        
+        configuration.timeoutIntervalForResource =
+        MAX(STORE_CONFIG_TIMEOUT, STORE_RECEIPT_TIMEOUT);
+        
+        self.session =
+        [NSURLSession
+         sessionWithConfiguration:configuration];
+        
+        self.tasks =
+        [NSMapTable
+         mapTableWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+         valueOptions:NSPointerFunctionsStrongMemory];
+    }
     
     return self;
 }
 
--(StoreItem *)nonRenewingSubscriptionWeek
+-(void)sendRequest:(NSURLRequest            *)request
+        completion:(StoreTransportCompletion )completion
 {
-    _type =
-    StoreItemTypeNonRenewingSubscription;
+    NSURLSessionTask *task =
+    [self.session
+     dataTaskWithRequest:request
+     completionHandler:^(NSData *data, NSURLResponse *response, NSError *error)
+    {
+        @synchronized (self.tasks)
+        {
+            [self.tasks
+             removeObjectForKey:request];
+        }
+        
+        completion(data,
+                   [response isKindOfClass:NSHTTPURLResponse.class] ? (NSHTTPURLResponse *)response : nil,
+                   error);
+    }];
     
-    _period =
-    StoreItemPeriodWeek;
+    @synchronized (self.tasks)
+    {
+        [self.tasks
+         setObject:task
+         forKey:request];
+    }
     
-    return self;
+    [task resume];
 }
 
--(StoreItem *)nonRenewingSubscriptionMonth
+-(void)cancelRequest:(NSURLRequest *)request
 {
-    _type =
-    StoreItemTypeNonRenewingSubscription;
+    NSURLSessionTask *task;
     
-    _period =
-    StoreItemPeriodMonth;
+    @synchronized (self.tasks)
+    {
+        task =
+        [self.tasks
+         objectForKey:request];
+    }
     
-    return self;
+    [task cancel];
 }
 
--(StoreItem *)nonRenewingSubscriptionYear
+-(void)cancelAllRequests
 {
-    _type =
-    StoreItemTypeNonRenewingSubscription;
-    
-    _period =
-    StoreItemPeriodYear;
-    
-    return self;
+    [self.session
+     getAllTasksWithCompletionHandler:^(NSArray <__kindof NSURLSessionTask *> *tasks)
+    {
+        for (NSURLSessionTask *task in tasks)
+            [task cancel];
+    }];
 }
 
--(NSString *)description
+@end
+
+@interface Store ()
+
++(instancetype)current;
+
+// Единственная очередь платежей и ее единственный наблюдатель (Store)
+@property (nonatomic, strong) SKPaymentQueue *paymentQueue;
+
+-(StoreEntitlements *)currentEntitlements;
+-(void)rebuildEntitlements;
+
+-(StoreCatalog *)currentCatalog;
+-(void)invalidateCatalog;
+
+// Первая установка в упакованном виде для правил setAsPurchasedForRanges:
+@property (atomic, assign, readonly) uint64_t firstInstallDay;     // 0 если неизвестна
+@property (atomic, assign, readonly) uint64_t firstInstallVersion;
+@property (atomic, assign, readonly) BOOL     isFirstInstallVersionKnown;
+
+-(void)scheduleConsumableFlushForStoreItem:(StoreItem *)storeItem;
+-(void)scheduleChangeNotificationForStoreItem:(StoreItem *)storeItem;
+
+// oldValue запоминается только для первого изменения kind за проход run loop
+-(void)scheduleChange:(StoreChangeKind)kind
+         forStoreItem:(StoreItem     *)storeItem
+             oldValue:(id             )oldValue;
+
+@end
+
+#pragma mark - Store Change
+
+@interface StoreChange ()
+
+@property (nonatomic, strong) NSString                    *identifier;
+@property (nonatomic, assign) StoreItemType                type;
+@property (nonatomic, assign) StoreChangeKind              kinds;
+
+@property (nonatomic, strong) NSDictionary <NSNumber *, id> *oldValues;
+@property (nonatomic, strong) NSDictionary <NSNumber *, id> *currentValues;
+
+@end
+
+@implementation StoreChange
+
++(id)valueForKind:(StoreChangeKind)kind
+        storeItem:(StoreItem     *)storeItem
 {
-    NSString *typeString;
+    id value;
     
-    switch (self.type)
+    switch (kind)
     {
-        case StoreItemTypeUnknown:
-            typeString =
-            @"StoreItemTypeUnknown";
-            break;
-            
-        case StoreItemTypeConsumable:
-            typeString =
-            @"StoreItemTypeConsumable";
+        case StoreChangeKindEntitlement:
+            value = Store.current.currentEntitlements.expirations[storeItem.identifier];
             break;
             
-        case StoreItemTypeNonConsumable:
-            typeString =
-            @"StoreItemTypeNonConsumable";
+        case StoreChangeKindBalance:
+            value = storeItem.consumableCount;
             break;
             
-        case StoreItemTypeAutoRenewableSubscription:
-            typeString =
-            @"StoreItemTypeAutoRenewableSubscription";
+        case StoreChangeKindPrice:
+            value = storeItem.priceString;
             break;
             
-        case StoreItemTypeNonRenewingSubscription:
-            typeString =
-            @"StoreItemTypeNonRenewingSubscription";
+        case StoreChangeKindValidity:
+            value = @(storeItem.isInvalid);
             break;
     }
     
-    NSString *periodString;
+    return
+    value ?: NSNull.null;
+}
+
+// nil если все значения вернулись к старым
+-(instancetype)initWithStoreItem:(StoreItem                     *)storeItem
+                       oldValues:(NSDictionary <NSNumber *, id> *)oldValues
+{
+    NSMutableDictionary <NSNumber *, id> *changedOldValues =
+    NSMutableDictionary.new;
     
-    switch (self.period)
-    {
-        case StoreItemPeriodNone:
-            periodString =
-            @"StoreItemPeriodNone";
-            break;
-            
-        case StoreItemPeriodWeek:
-            periodString =
-            @"StoreItemPeriodWeek";
-            break;
-            
-        case StoreItemPeriodMonth:
-            periodString =
-            @"StoreItemPeriodMonth";
-            break;
-            
-        case StoreItemPeriodYear:
-            periodString =
-            @"StoreItemPeriodYear";
-            break;
-    }
+    NSMutableDictionary <NSNumber *, id> *currentValues =
+    NSMutableDictionary.new;
     
-    NSString *transactionStateString;
+    StoreChangeKind kinds = 0;
     
-    switch (self.transactionState)
+    for (NSNumber *kind in oldValues)
     {
-        case SKPaymentTransactionStatePurchasing:
-            transactionStateString =
-            @"SKPaymentTransactionStatePurchasing";
-            break;
-            
-        case SKPaymentTransactionStatePurchased:
-            transactionStateString =
-            @"SKPaymentTransactionStatePurchased";
-            break;
-            
-        case SKPaymentTransactionStateFailed:
-            transactionStateString =
-            @"SKPaymentTransactionStateFailed";
-            break;
-            
-        case SKPaymentTransactionStateRestored:
-            transactionStateString =
-            @"SKPaymentTransactionStateRestored";
-            break;
-            
-        case SKPaymentTransactionStateDeferred:
-            transactionStateString =
-            @"SKPaymentTransactionStateDeferred";
-            break;
+        id value =
+        [StoreChange
+         valueForKind:(StoreChangeKind)kind.intValue
+         storeItem:storeItem];
+        
+        if ([value isEqual:oldValues[kind]])
+            continue;
+        
+        changedOldValues[kind] = oldValues[kind];
+        currentValues[kind]    = value;
+        
+        kinds |= kind.intValue;
     }
     
-    NSDictionary *dictionary =
-    @{@"description":super.description,
-      @"identifier":self.identifier,
-      @"type":typeString,
-      @"period":periodString,
-      @"title":self.title ? self.title : @"nil",
-      @"title with price":self.titleWithPrice ? self.titleWithPrice : @"nil",
-      @"detail":self.detail ? self.detail : @"nil",
-      @"price number":self.priceNumber ? self.priceNumber : @"nil",
-      @"price string":self.priceString ? self.priceString : @"nil",
-      @"currency code":self.currencyCode ? self.currencyCode : @"nil",
-      @"currency symbol":self.currencySymbol ? self.currencySymbol : @"nil",
-      @"price per week string":self.pricePerWeekString ? self.pricePerWeekString : @"nil",
-      @"price per month string":self.pricePerMonthString ? self.pricePerMonthString : @"nil",
-      @"is invalid":self.isInvalid ? @"YES" : @"NO",
-      @"is purchased":self.isPurchased ? @"YES" : @"NO",
-      @"transaction id":self.transactionId ? self.transactionId : @"nil",
-      @"transaction state string":transactionStateString,
-      @"default consumable count":self.defaultConsumableCount ? self.defaultConsumableCount : @"nil",
-      @"consumable count":self.consumableCount ? self.consumableCount : @"nil",
-      @"start date":self.startDate ? self.startDate : @"nil",
-      @"end date":self.endDate ? self.endDate : @"nil",
-      @"is trial":self.isTrial ? @"YES" : @"NO"
-    };
+    if (kinds == 0)
+        return nil;
     
-    NSData *jsonData =
-    [NSJSONSerialization
-     dataWithJSONObject:dictionary
-     options:NSJSONWritingPrettyPrinted
-     error:nil];
+    if (self = [super init])
+    {
+        self.identifier    = storeItem.identifier;
+        self.type          = storeItem.type;
+        self.kinds         = kinds;
+        self.oldValues     = changedOldValues.copy;
+        self.currentValues = currentValues.copy;
+    }
     
-    return
-    [NSString.alloc
-     initWithData:jsonData
-     encoding:NSUTF8StringEncoding];
+    return self;
 }
 
-+(void)addInfoLog:(NSString *)log
+-(NSString *)description
 {
-    if (ENABLE_STORE_iNFO_LOG)
-        NSLog(@"%@",
-              log);
-    
-    [StoreItem
-     addFileLog:log];
+    return
+    [NSString
+     stringWithFormat:@"<StoreChange %@ kinds:%d old:%@ current:%@>",
+     self.identifier,
+     self.kinds,
+     self.oldValues,
+     self.currentValues];
 }
 
-+(void)addErrorLog:(NSString *)log
-{
-    if (ENABLE_STORE_ERROR_LOG)
-        NSLog(@"%@",
-              log);
-    
-    [StoreItem
-     addFileLog:log];
-}
+@end
 
-+(void)addFileLog:(NSString *)log
+@interface StoreChangeSubscription : NSObject
+
+@property (nonatomic, strong) NSSet <NSString *> *identifiers;
+@property (nonatomic, strong) NSSet <NSNumber *> *types;
+@property (nonatomic, assign) StoreChangeKind     kinds;
+@property (nonatomic, strong) dispatch_queue_t    queue;
+@property (nonatomic, copy)   StoreChangesHandler handler;
+
+@end
+
+@implementation StoreChangeSubscription
+
+-(NSArray <StoreChange *> *)filteredChanges:(NSArray <StoreChange *> *)changes
 {
-    if (ENABLE_STORE_LOG_WITH_METHOD)
-    {
-        NSString *directory =
-        NSSearchPathForDirectoriesInDomains(NSCachesDirectory,
-                                            NSUserDomainMask,
-                                            YES).firstObject;
-        
-        NSString *logPath =
-        [directory
-         stringByAppendingPathComponent:@"Store.log"];
-        
-        NSString *contents =
-        [NSString
-         stringWithContentsOfFile:logPath
-         encoding:NSUTF8StringEncoding
-         error:nil];
-        
-        if (contents == nil)
-            contents =
-            @"";
-        
-        else
-            contents =
-            [contents
-             stringByAppendingString:@"\n"];
-        
-        contents =
-        [contents
-         stringByAppendingString:log];
-        
-        [contents
-         writeToFile:logPath
-         atomically:YES
-         encoding:NSUTF8StringEncoding
-         error:nil];
-    }
+    NSMutableArray <StoreChange *> *filtered =
+    NSMutableArray.new;
+    
+    for (StoreChange *change in changes)
+        if ((self.identifiers == nil || [self.identifiers containsObject:change.identifier]) &&
+            (self.types       == nil || [self.types containsObject:@(change.type)]) &&
+            (self.kinds       == 0   || (change.kinds & self.kinds)))
+            [filtered
+             addObject:change];
+    
+    return
+    filtered.copy;
 }
 
 @end
 
-#pragma mark - Store Manager
+#pragma mark - Store Item Category
 
-#define STORE_SHAREDSECRET  @"StoreSharedSecred"
-#define STORE_iTEMS         @"StoreItems"
-#define STORE_UPDATE        @"StoreUpdate"
+@implementation NSString (Identifier)
 
-#define CONFiG_SHAREDSECRET @"sharedSecred"
-#define CONFiG_iDENTiFiERS  @"identifiers"
-#define CONFiG_iDENTiFiER   @"identifier"
-#define CONFiG_TYPE         @"type"
-#define CONFiG_COUNT        @"count"
-#define CONFiG_NOT_FOR_SELL @"notForSell"
-#define CONFiG_AS_RANGE     @"asPurchasedForRanges"
+-(StoreItem *)storeItem
+{
+    return
+    [Store storeItemWithIdentifier:self];
+}
 
-#define TYPE_CONSUMABLE     @"consumable"
-#define TYPE_NCONSUMABLE    @"nonConsumable"
-#define TYPE_NR_WEEK        @"nonRenewingSubscriptionWeek"
-#define TYPE_NR_MONTH       @"nonRenewingSubscriptionMonth"
-#define TYPE_NR_YEAR        @"nonRenewingSubscriptionYear"
-#define TYPE_RENEWABLE      @"autoRenewableSubscription"
+@end
 
-@interface Store () <SKProductsRequestDelegate, SKRequestDelegate, SKPaymentTransactionObserver>
+#pragma mark - Store Item
 
-@property (nonatomic, strong) NSString                           *sharedSecret;
-@property (nonatomic, strong) NSArray <StoreItem *>              *storeItems;
+@interface StoreConsumableReservation ()
 
-@property (nonatomic, strong) NSArray <SKProduct *>              *products;
+@property (nonatomic, strong) StoreItem *storeItem;
+@property (nonatomic, assign) NSInteger  count;
+@property (nonatomic, assign) BOOL       isFinished; // Меняется только под блокировкой storeItem
 
-@property (nonatomic, assign) BOOL                                isRestoring;
-@property (nonatomic, assign) BOOL                                isRestoringFull;
-@property (nonatomic, assign) BOOL                                isSandbox;
+@end
 
-@property (nonatomic, strong) SKProductsRequest                  *productsRequest;
-@property (nonatomic, strong) SKReceiptRefreshRequest            *receiptRequest;
+// Ключи описания продукта (productInfo), из него же состоит снимок каталога на диске
+#define PRODUCT_TiTLE        @"title"
+#define PRODUCT_DETAiL       @"detail"
+#define PRODUCT_PRiCE        @"price"  // Десятичная строка с точкой
+#define PRODUCT_LOCALE       @"locale"
+#define PRODUCT_PERiOD_UNiT  @"periodUnit"
+#define PRODUCT_PERiOD_COUNT @"periodCount"
 
-@property (nonatomic, strong) SKPaymentQueue                     *restoreQueue;
+@interface StoreItem ()
+{
+    // Баланс одноразовой покупки в памяти, в StoreState пишется отложенно
+    StoreBalance _consumable;
+}
 
-// Массивы для хранения блоков
-@property (nonatomic, strong) NSMutableArray <RestoreCompletion> *restoreCompletions;
-@property (nonatomic, strong) NSMutableArray <RestoreCompletion> *restoreFullCompletions;
+@property (nonatomic, strong) SKProduct      *product;
 
-// Метод для проверки купленности самостоятельно юзером
-@property (nonatomic, strong) RawRecieptHandler                   rawRecieptHandler;
+@property (nonatomic, strong) NSMutableArray <PurchaseCompletion> *purchaseCompletions;
 
-@property (nonatomic, assign) BOOL                                isTrialPeriod;
+@property (nonatomic, assign) BOOL            isPurchasing;
 
-@property (nonatomic, strong) NSDate                             *purchasedDate;
-@property (nonatomic, strong) NSString                           *purchasedVersion;
+// Правила setAsPurchasedForRanges: скомпилированные в StoreRangesInterval, подменяются целиком
+@property (atomic,    strong) NSData         *asPurchasedDays;
+@property (atomic,    strong) NSData         *asPurchasedVersions;
 
-@property (nonatomic, strong) LockRules                           lockRules;
+// detail купленной покупки (описание и даты), считается при смене продукта, дат или локали
+@property (atomic,    strong) NSString       *purchasedDetail;
 
-@property (nonatomic, strong) NSURL                              *url;
+// Описание продукта из SKProduct или из снимка каталога, все поля цены считаются из него
+@property (atomic,    strong) NSDictionary   *productInfo;
 
-@property (nonatomic, assign) BOOL                                isSetupProgress;
+-(void)lockConsumable;
+-(void)unlockConsumable;
+-(NSInteger)consumableAvailableCountLocked;
+-(StoreBalanceChange)applyConsumableDelta:(NSInteger)delta;
+-(void)didChangeConsumable:(StoreBalanceChange)change;
+-(void)persistConsumableBalance;
+-(void)resetConsumableBalance;
+-(NSNumber *)clearConsumableNotifyPending;
+-(void)finishConsumableReservation:(StoreConsumableReservation *)reservation
+                            commit:(BOOL                        )commit;
 
-@property (nonatomic,   copy) RestoreCompletion                   setupWithURLCompletion;
+// Применяет купленную или восстановленную транзакцию без commit, его делает роутер за всю пачку
+-(void)applyTransaction:(SKPaymentTransaction *)transaction;
+-(void)returnCompletionsWithError:(NSError *)error;
 
-@property (nonatomic, strong) NSData                             *receiptJSON;
+-(void)updatePurchasedDetail;
+
+// Переносит настройки из списка покупок (тип, период, количество, правила) на этот экземпляр
+-(void)applyConfigurationFromStoreItem:(StoreItem *)storeItem;
+
++(NSDictionary *)productInfoWithProduct:(SKProduct *)product;
++(BOOL)isValidProductInfo:(NSDictionary *)productInfo;
+
+// NO если описание не изменилось и пересчитывать нечего
+-(BOOL)applyProductInfo:(NSDictionary *)productInfo;
+-(BOOL)clearProductInfo;
 
 @end
 
-@implementation Store
+#pragma mark - Consumable Reservation
 
--(BOOL)isSandbox
+@implementation StoreConsumableReservation
+
+-(instancetype)initWithStoreItem:(StoreItem *)storeItem
+                           count:(NSInteger  )count
 {
-    #if DEBUG
+    if (self = [super init])
+    {
+        self.storeItem = storeItem;
+        self.count     = count;
+    }
     
-    return
-    YES;
+    return self;
+}
+
+-(void)commit
+{
+    [self.storeItem
+     finishConsumableReservation:self
+     commit:YES];
+}
+
+-(void)rollback
+{
+    [self.storeItem
+     finishConsumableReservation:self
+     commit:NO];
+}
+
+-(void)dealloc
+{
+    // Незавершенный резерв возвращается
+    if (self.isFinished == NO)
+        [self rollback];
+}
+
+@end
+
+@implementation StoreItem
+
+-(instancetype)init
+{
+    if (self = [super init])
+    {
+        self.purchaseCompletions =
+        NSMutableArray.new;
+        
+        StoreBalanceInit(&_consumable);
+    }
     
-    #else
+    return self;
+}
+
+-(void)dealloc
+{
+    StoreBalanceDestroy(&_consumable);
+}
+
+-(void)setIdentifier:(NSString *)identifier
+{
+    _identifier = identifier;
+}
+
+-(void)setStartDate:(NSDate *)startDate
+{
+    _startDate = startDate;
     
-    return
-    NO;
+    [self
+     updatePurchasedDetail];
+}
+
+-(void)setEndDate:(NSDate *)endDate
+{
+    _endDate = endDate;
     
-    #endif
+    [self
+     updatePurchasedDetail];
 }
 
-+(instancetype)current
+-(void)setIsTrial:(BOOL)isTrial
 {
-    static Store *_current = nil;
-    static dispatch_once_t oncePredicate;
+    _isTrial = isTrial;
+}
+
+-(void)setIsNotForSell:(BOOL)isNotForSell
+{
+    _isNotForSell = isNotForSell;
+}
+
+-(void)setType:(StoreItemType)type
+{
+    _type = type;
     
-    dispatch_once(&oncePredicate, ^
-    {
-        _current = self.new;
-    });
+    [Store.current
+     invalidateCatalog];
+}
+
+-(void)setPeriod:(StoreItemPeriod)period
+{
+    _period = period;
+}
+
+-(void)applyConfigurationFromStoreItem:(StoreItem *)storeItem
+{
+    self.type                   = storeItem.type;
+    self.period                 = storeItem.period;
+    self.isNotForSell           = storeItem.isNotForSell;
+    self.defaultConsumableCount = storeItem.defaultConsumableCount;
     
-    return _current;
+    self.asPurchasedDays        = storeItem.asPurchasedDays;
+    self.asPurchasedVersions    = storeItem.asPurchasedVersions;
 }
 
-+(void)setupWithURLString:(NSString        *)urlString
-               completion:(RestoreCompletion)completion;
+-(void)setIsInvalid:(BOOL)isInvalid
 {
-    if (Store.current.isSetupProgress)
+    if (_isInvalid != isInvalid)
+        [Store.current
+         scheduleChange:StoreChangeKindValidity
+         forStoreItem:self
+         oldValue:@(_isInvalid)];
+    
+    _isInvalid = isInvalid;
+    
+    [Store.current
+     invalidateCatalog];
+}
+
+-(void)setProduct:(SKProduct *)product
+{
+    _product = product;
+    
+    NSString *priceString =
+    _priceString;
+    
+    // Если поля уже заполнены из снимка и продукт не поменялся, ничего не пересчитываем
+    if ([self
+         applyProductInfo:[StoreItem
+                           productInfoWithProduct:product]])
+        [Store.current
+         scheduleChange:StoreChangeKindPrice
+         forStoreItem:self
+         oldValue:priceString];
+}
+
++(NSDictionary *)productInfoWithProduct:(SKProduct *)product
+{
+    NSMutableDictionary *productInfo =
+    NSMutableDictionary.new;
+    
+    productInfo[PRODUCT_TiTLE]  = product.localizedTitle;
+    productInfo[PRODUCT_DETAiL] = product.localizedDescription;
+    productInfo[PRODUCT_PRiCE]  = product.price.stringValue;
+    productInfo[PRODUCT_LOCALE] = product.priceLocale.localeIdentifier;
+    
+    if (product.subscriptionPeriod)
     {
-        if (completion)
-            completion(nil);
+        productInfo[PRODUCT_PERiOD_UNiT] =
+        @(product.subscriptionPeriod.unit);
         
-        return;
+        productInfo[PRODUCT_PERiOD_COUNT] =
+        @(product.subscriptionPeriod.numberOfUnits);
     }
     
-    Store.current.isSetupProgress = YES;
-    
-    Store.current.setupWithURLCompletion = nil;
-    
-    NSURL *url =
-    [NSURL
-     URLWithString:urlString];
+    return
+    productInfo.copy;
+}
+
+// Сбрасывает поля, заполненные applyProductInfo:, NO если сбрасывать нечего
+-(BOOL)clearProductInfo
+{
+    if (self.productInfo == nil &&
+        _product         == nil)
+        return NO;
     
-    if (url == nil)
-        [NSException
-         raise:@"Store"
-         format:@"Url string is not valid: %@",
-         urlString];
+    _product = nil;
     
-    Store.current.url = url;
+    self.productInfo = nil;
     
-    [NSUserDefaults.standardUserDefaults
-     synchronize];
-     
-    Store.current.sharedSecret =
-    [NSUserDefaults.standardUserDefaults
-     objectForKey:STORE_SHAREDSECRET];
+    _priceString         = nil;
+    _priceNumber         = nil;
+    _currencyCode        = nil;
+    _currencySymbol      = nil;
+    _titleWithPrice      = nil;
+    _title               = nil;
+    _pricePerWeekString  = nil;
+    _pricePerMonthString = nil;
     
-    Store.current.storeItems =
     [self
-     storeItemsParsedFromArray:[NSUserDefaults.standardUserDefaults
-                          objectForKey:STORE_iTEMS]];
+     updatePurchasedDetail];
     
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(void)
-    {
-        NSDate *fileDate =
-        [self
-         lastModificationDateOfFileAtURL:url];
+    [Store.current
+     invalidateCatalog];
+    
+    return YES;
+}
 
-        NSDate *updateDate =
-        [NSUserDefaults.standardUserDefaults
-         objectForKey:STORE_UPDATE];
++(BOOL)isValidProductInfo:(NSDictionary *)productInfo
+{
+    return
+    ([productInfo isKindOfClass:NSDictionary.class] &&
+     [productInfo[PRODUCT_TiTLE]  isKindOfClass:NSString.class] &&
+     [productInfo[PRODUCT_PRiCE]  isKindOfClass:NSString.class] &&
+     [productInfo[PRODUCT_LOCALE] isKindOfClass:NSString.class]);
+}
 
-        if (updateDate && fileDate)
-            if (!([fileDate
-                   compare:updateDate] == NSOrderedDescending))
-            {
-                dispatch_async(dispatch_get_main_queue(), ^(void)
-                {
-                    [Store.current
-                     restoreProductsCompletion:^(NSError *error)
-                    {
-                        Store.current.isSetupProgress = NO;
-                        
-                        if (completion)
-                            completion(error);
-                    }];
-                });
+-(BOOL)applyProductInfo:(NSDictionary *)productInfo
+{
+    if ([self.productInfo
+         isEqualToDictionary:productInfo])
+        return NO;
+    
+    self.productInfo =
+    productInfo;
+    
+    NSLocale *priceLocale =
+    [NSLocale
+     localeWithLocaleIdentifier:productInfo[PRODUCT_LOCALE]];
+    
+    NSDecimalNumber *price =
+    [NSDecimalNumber
+     decimalNumberWithString:productInfo[PRODUCT_PRiCE]];
+    
+    NSNumberFormatter *numberFormatter =
+    [StoreFormatters
+     currencyFormatterWithLocale:priceLocale];
+    
+    _priceString = [numberFormatter stringFromNumber:price];
+    _priceNumber = price;
+    
+    _currencyCode =
+    [priceLocale objectForKey:NSLocaleCurrencyCode];
+    
+    _currencySymbol =
+    [priceLocale objectForKey:NSLocaleCurrencySymbol];
+    
+    _titleWithPrice =
+    [NSString
+     stringWithFormat:@"%@ %@",
+     [self cleanPrice:_priceString],
+     productInfo[PRODUCT_TiTLE]];
+    
+    _title = productInfo[PRODUCT_TiTLE];
+    
+    NSInteger days   = 0;
+    NSInteger months = 0;
+    NSInteger years  = 0;
+    
+    NSInteger periodCount =
+    [productInfo[PRODUCT_PERiOD_COUNT] integerValue];
+    
+    if (productInfo[PRODUCT_PERiOD_UNiT])
+        switch ([productInfo[PRODUCT_PERiOD_UNiT] integerValue])
+        {
+            case SKProductPeriodUnitDay:
+                days = 1 * periodCount;
+                break;
                 
-                return;
-            }
-
-        NSData *jsonData =
-        [NSData
-         dataWithContentsOfURL:url];
+            case SKProductPeriodUnitWeek:
+                days = 7 * periodCount;
+                break;
+                
+            case SKProductPeriodUnitMonth:
+                months = 1 * periodCount;
+                break;
+                
+            case SKProductPeriodUnitYear:
+                years = 1 * periodCount;
+                break;
+        }
+    
+    if (days > 0 && days < 8)
+        _period = StoreItemPeriodWeek;
+    
+    else if (months > 0)
+        _period = StoreItemPeriodMonth;
+    
+    else if (years > 0)
+        _period = StoreItemPeriodYear;
+    
+    _pricePerWeekString  = nil;
+    _pricePerMonthString = nil;
+    
+    // Считаем в десятичных, период из конфига без subscriptionPeriod это один год или месяц
+    if (_period == StoreItemPeriodYear)
+    {
+        years = MAX(years, 1);
         
-        NSDictionary *jsonObject;
+        _pricePerWeekString =
+        [self
+         priceString:price
+         formatter:numberFormatter
+         multiplier:1
+         divisor:52 * years];
         
-        if (jsonData)
-            jsonObject =
-            [NSJSONSerialization
-             JSONObjectWithData:jsonData
-             options:0
-             error:nil];
+        _pricePerMonthString =
+        [self
+         priceString:price
+         formatter:numberFormatter
+         multiplier:1
+         divisor:12 * years];
+    }
+    
+    // В месяце 52/12 недели, а не 4
+    if (_period == StoreItemPeriodMonth)
+        _pricePerWeekString =
+        [self
+         priceString:price
+         formatter:numberFormatter
+         multiplier:12
+         divisor:52 * MAX(months, 1)];
+    
+    [self
+     updatePurchasedDetail];
+    
+    [Store.current
+     invalidateCatalog];
+    
+    return YES;
+}
 
-        if (!jsonData || !jsonObject)
-        {
-            if (Store.current.sharedSecret.length == 0)
-            {
-                dispatch_async(dispatch_get_main_queue(), ^(void)
-                {
-                    Store.current.setupWithURLCompletion =
-                    completion;
-                    
-                    Store.current.isSetupProgress = NO;
-                    
-                    if (completion)
-                        completion([NSError
-                                    errorWithDomain:@"Store"
-                                    code:-1
-                                    userInfo:@{NSLocalizedDescriptionKey:@"Invalid Store Config, json data is nil or incorrected."}]);
-                });
-            }
-            
-            else
-            {
-                dispatch_async(dispatch_get_main_queue(), ^(void)
-                {
-                    [Store.current
-                     restoreProductsCompletion:^(NSError *error)
-                    {
-                        Store.current.isSetupProgress = NO;
-                        
-                        if (completion)
-                            completion(error);
-                    }];
-                });
-            }
-            
-            return;
-        }
+-(NSString *)priceString:(NSDecimalNumber   *)price
+               formatter:(NSNumberFormatter *)numberFormatter
+              multiplier:(NSInteger          )multiplier
+                 divisor:(NSInteger          )divisor
+{
+    price =
+    [[price
+      decimalNumberByMultiplyingBy:[NSDecimalNumber
+                                    decimalNumberWithMantissa:multiplier
+                                    exponent:0
+                                    isNegative:NO]]
+     decimalNumberByDividingBy:[NSDecimalNumber
+                                decimalNumberWithMantissa:divisor
+                                exponent:0
+                                isNegative:NO]];
+    
+    if ([price compare:NSDecimalNumber.zero] != NSOrderedDescending)
+        return nil;
+    
+    return
+    [self
+     cleanPrice:[numberFormatter
+                 stringFromNumber:price]];
+}
+
+-(NSString *)detail
+{
+    NSString *purchasedDetail =
+    self.purchasedDetail;
+    
+    if (purchasedDetail == nil ||
+        self.isPurchased == NO)
+        return
+        self.productInfo[PRODUCT_DETAiL];
+    
+    return
+    purchasedDetail;
+}
+
+-(void)updatePurchasedDetail
+{
+    if (_startDate == nil)
+    {
+        self.purchasedDetail = nil;
         
-        dispatch_async(dispatch_get_main_queue(), ^(void)
+        return;
+    }
+    
+    NSString *dateString;
+    
+    if (_endDate)
+        dateString =
+        [NSString
+         stringWithFormat:@"%@—%@",
+         [self
+          startDateStringWithFormat:@"dd.MM.yyyy"],
+         [self
+          endDateStringWithFormat:@"dd.MM.yyyy"]];
+    
+    else
+        dateString =
+        [self
+         startDateStringWithFormat:@"dd.MM.yyyy"];
+
+    self.purchasedDetail =
+    [NSString
+     stringWithFormat:@"%@ %@",
+     self.productInfo[PRODUCT_DETAiL],
+     dateString];
+}
+
+-(NSString *)cleanPrice:(NSString *)price
+{
+    price =
+    [price
+     stringByReplacingOccurrencesOfString:@" "
+     withString:@""];
+    
+    price =
+    [price
+     stringByReplacingOccurrencesOfString:@".00"
+     withString:@""];
+    
+    price =
+    [price
+     stringByReplacingOccurrencesOfString:@",00"
+     withString:@""];
+    
+    return price;
+}
+
+-(BOOL)isPurchased
+{
+    NSNumber *expiration =
+    Store.current.currentEntitlements.expirations[_identifier];
+    
+    if (expiration == nil)
+        return NO;
+    
+    return
+    (expiration.doubleValue == 0 ||
+     expiration.doubleValue > CFAbsoluteTimeGetCurrent() + kCFAbsoluteTimeIntervalSince1970);
+}
+
+// Медленная проверка по правилам и сохраненным данным, вызывается только при пересборке
+// снимка StoreEntitlements. В expiration возвращается время окончания или 0 если бессрочно
+-(BOOL)isPurchasedWithExpiration:(NSTimeInterval *)expiration
+{
+    BOOL purchased = NO;
+    
+    *expiration = 0;
+    
+    // Правила уже скомпилированы, первая установка упакована при разборе чека
+    Store *store =
+    Store.current;
+    
+    NSData *days =
+    self.asPurchasedDays;
+    
+    NSData *versions =
+    self.asPurchasedVersions;
+    
+    if ((store.firstInstallDay &&
+         StoreRangesContains(days.bytes, days.length / sizeof(StoreRangesInterval), store.firstInstallDay)) ||
+        (store.isFirstInstallVersionKnown &&
+         StoreRangesContains(versions.bytes, versions.length / sizeof(StoreRangesInterval), store.firstInstallVersion)))
+    {
+        NSDate *firstInstallDate =
+        Store.firstInstallDate;
+        
+        if ([_startDate isEqualToDate:firstInstallDate] == NO)
+            self.startDate = firstInstallDate;
+        
+        purchased = YES;
+    }
+    
+    if (purchased == NO)
+        switch (self.type)
         {
-            if (jsonObject[CONFiG_SHAREDSECRET] && jsonObject[CONFiG_iDENTiFiERS])
+            case StoreItemTypeConsumable:
             {
-                Store.current.sharedSecret =
-                jsonObject[CONFiG_SHAREDSECRET];
+                purchased =
+                self.consumableCount.integerValue > 0;
                 
-                [NSUserDefaults.standardUserDefaults
-                 setObject:jsonObject[CONFiG_SHAREDSECRET]
-                 forKey:STORE_SHAREDSECRET];
+                break;
+            }
 
-                Store.current.storeItems =
-                [self
-                 storeItemsParsedFromArray:jsonObject[CONFiG_iDENTiFiERS]];
-                
-                [NSUserDefaults.standardUserDefaults
-                 setObject:jsonObject[CONFiG_iDENTiFiERS]
-                 forKey:STORE_iTEMS];
+            case StoreItemTypeNonConsumable:
+            {
+                purchased =
+                [StoreState.current
+                 objectForKey:_identifier] != nil;
                 
-                [NSUserDefaults.standardUserDefaults
-                 setObject:fileDate
-                 forKey:STORE_UPDATE];
+                break;
+            }
+
+            case StoreItemTypeNonRenewingSubscription:
+            case StoreItemTypeAutoRenewableSubscription:
+            {
+                purchased =
+                [StoreState.current
+                 objectForKey:_identifier] &&
+                _endDate.timeIntervalSince1970 > NSDate.new.timeIntervalSince1970;
                 
-                [NSUserDefaults.standardUserDefaults
-                 synchronize];
+                if (purchased)
+                    *expiration =
+                    _endDate.timeIntervalSince1970;
                 
-                [Store.current
-                 restoreProductsCompletion:^(NSError *error)
-                {
-                    Store.current.isSetupProgress = NO;
-                    
-                    if (completion)
-                        completion(error);
-                }];
+                break;
             }
-            
-            else
-            {
-                Store.current.isSetupProgress = NO;
                 
-                if (completion)
-                    completion([NSError
-                                errorWithDomain:@"Store"
-                                code:-1
-                                userInfo:@{NSLocalizedDescriptionKey:@"Invalid Store Config"}]);
+            case StoreItemTypeUnknown:
+                break;
+        }
+    
+    return
+    purchased;
+}
+
+//   определенная дата: @"31/12/2020"
+//        диапазон дат: @"1/1/2020-31/12/2020"
+// определенная версия: @"3.0.1"
+//     диапазон версий: @"1.0-3.0.1"
+// Компилируются сразу в отсортированные непересекающиеся интервалы дней (UTC) и упакованных версий
+-(void)setAsPurchasedForRanges:(NSArray <NSString *> *)ranges
+{
+    NSMutableData *days =
+    NSMutableData.new;
+    
+    NSMutableData *versions =
+    NSMutableData.new;
+    
+    NSCharacterSet *charactersToRemove =
+    [[NSCharacterSet
+     characterSetWithCharactersInString:@"0123456789./-"]
+     invertedSet];
+    
+    for (NSString *range in ranges)
+    {
+        NSString *cleanRange =
+        [[range
+          componentsSeparatedByCharactersInSet:charactersToRemove]
+         componentsJoinedByString:@""];
+        
+        if (cleanRange.length < 3)
+            continue;
+        
+        NSArray <NSString *> *period =
+        [cleanRange
+         componentsSeparatedByString:@"-"];
+        
+        if (period.count > 2)
+            [NSException
+             raise:@"Store"
+             format:@"Wrong range: %@", range];
+        
+        NSString *from =
+        period.firstObject;
+        
+        NSString *to =
+        period.lastObject;
+        
+        if (([from
+              containsString:@"/"] &&
+             [from
+              containsString:@"."]) ||
+            ([to
+              containsString:@"/"] &&
+             [to
+              containsString:@"."]))
+            [NSException
+             raise:@"Store"
+             format:@"Wrong range: %@", range];
+        
+        // Одиночное значение это интервал из одной точки
+        StoreRangesInterval interval;
+        
+        const char *fromString = from.UTF8String;
+        const char *toString   = to.UTF8String;
+        
+        if ([from
+             containsString:@"/"] &&
+            [to
+             containsString:@"/"] &&
+            StoreRangesParseDay(fromString, strlen(fromString), &interval.from) &&
+            StoreRangesParseDay(toString,   strlen(toString),   &interval.to))
+            [days
+             appendBytes:&interval
+             length:sizeof(interval)];
+        
+        else if ([from
+                  containsString:@"."] &&
+                 [to
+                  containsString:@"."] &&
+                 StoreRangesParseVersion(fromString, strlen(fromString), &interval.from) &&
+                 StoreRangesParseVersion(toString,   strlen(toString),   &interval.to))
+            [versions
+             appendBytes:&interval
+             length:sizeof(interval)];
+        
+        else
+            [NSException
+             raise:@"Store"
+             format:@"Wrong range: %@", range];
+    }
+    
+    days.length =
+    StoreRangesCompile(days.mutableBytes, days.length / sizeof(StoreRangesInterval)) * sizeof(StoreRangesInterval);
+    
+    versions.length =
+    StoreRangesCompile(versions.mutableBytes, versions.length / sizeof(StoreRangesInterval)) * sizeof(StoreRangesInterval);
+    
+    self.asPurchasedDays     = days.copy;
+    self.asPurchasedVersions = versions.copy;
+    
+    [Store.current
+     rebuildEntitlements];
+}
+
+#pragma mark - Purchase Product
+
+-(void)purchaseWithCompletion:(PurchaseCompletion)completion
+{
+    StoreInfoLog(@"[INFO] Store: Try purchasing product with identifier '%@'...",
+                 _identifier);
+    
+    if (!self.product || !Store.isReady)
+    {
+        NSString *errorMessage =
+        [NSString stringWithFormat:@"[ERROR] Store: Purchase with identifier '%@' failed. Store is not Ready, or product for this identifier not found!",
+              _identifier];
+        
+        [StoreItem
+         addErrorLog:errorMessage];
+        
+        NSError *error =
+        [NSError
+         errorWithDomain:@"Store"
+         code:-1
+         userInfo:@{NSLocalizedDescriptionKey:errorMessage}];
+        
+        if (completion)
+            completion(error);
+        
+        return;
+    }
+    
+    if (completion)
+        [self.purchaseCompletions
+         addObject:completion];
+    
+    if (self.isPurchasing)
+        return;
+    
+    self.isPurchasing = YES;
+    
+    SKMutablePayment *payment =
+    [SKMutablePayment
+     paymentWithProduct:self.product];
+    
+    payment.quantity = 1;
+    
+    [Store.current.paymentQueue
+     addPayment:payment];
+}
+
+-(void)setDefaultConsumableCount:(NSNumber *)defaultConsumableCount
+{
+    [StoreState.current
+     setObject:defaultConsumableCount
+     forKey:[@"defaultConsumableCount:"
+             stringByAppendingString:self.identifier]];
+    
+    [StoreState.current
+     commit];
+}
+
+-(NSNumber *)defaultConsumableCount
+{
+    NSNumber *defaultConsumableCount =
+    [StoreState.current
+     objectForKey:[@"defaultConsumableCount:"
+                   stringByAppendingString:self.identifier]];
+    
+    if (defaultConsumableCount == nil)
+        return @1;
+    
+    return
+    defaultConsumableCount;
+}
+
+#pragma mark - Consumable Balance
+
+// Вызывается под блокировкой баланса
+-(void)loadConsumableBalance
+{
+    if (_consumable.isLoaded)
+        return;
+    
+    _consumable.balance =
+    [[StoreState.current
+      objectForKey:[@"consumableCount:"
+                    stringByAppendingString:self.identifier]] integerValue];
+    
+    _consumable.isLoaded = YES;
+}
+
+-(void)lockConsumable
+{
+    StoreBalanceLock(&_consumable);
+    
+    [self
+     loadConsumableBalance];
+}
+
+-(void)unlockConsumable
+{
+    StoreBalanceUnlock(&_consumable);
+}
+
+// Вызывается под блокировкой баланса
+-(NSInteger)consumableAvailableCountLocked
+{
+    return
+    (NSInteger)StoreBalanceAvailable(&_consumable);
+}
+
+// Вызывается под блокировкой баланса, баланс не опускается ниже зарезервированного
+-(StoreBalanceChange)applyConsumableDelta:(NSInteger)delta
+{
+    return
+    StoreBalanceApply(&_consumable, delta);
+}
+
+// Вызывается после снятия блокировки баланса
+-(void)didChangeConsumable:(StoreBalanceChange)change
+{
+    if (change & StoreBalanceChangeDirty)
+        [Store.current
+         scheduleConsumableFlushForStoreItem:self];
+    
+    if (change & StoreBalanceChangeNotify)
+        [Store.current
+         scheduleChangeNotificationForStoreItem:self];
+    
+    if (change & StoreBalanceChangeCrossedZero)
+    {
+        StoreInfoLog(@"[INFO] Store: Consumable balance with identifier '%@' is %@",
+                     _identifier,
+                     self.consumableCount ? @"refilled" : @"empty");
+        
+        [Store.current
+         rebuildEntitlements];
+    }
+}
+
+// Записывает текущий баланс в StoreState (без commit)
+-(void)persistConsumableBalance
+{
+    [self lockConsumable];
+    
+    NSString *key =
+    [@"consumableCount:"
+     stringByAppendingString:self.identifier];
+    
+    if (_consumable.balance > 0)
+        [StoreState.current
+         setObject:@(_consumable.balance)
+         forKey:key];
+    
+    else
+    {
+        [StoreState.current
+         removeObjectForKey:key];
+        
+        [StoreState.current
+         removeObjectForKey:self.identifier];
+    }
+    
+    _consumable.isDirty = NO;
+    
+    [self unlockConsumable];
+}
+
+// Баланс в памяти относится к папке состояния, после ее смены читается заново
+-(void)resetConsumableBalance
+{
+    StoreBalanceLock(&_consumable);
+    
+    _consumable.balance  = 0;
+    _consumable.isLoaded = NO;
+    _consumable.isDirty  = NO;
+    
+    StoreBalanceUnlock(&_consumable);
+}
+
+// Возвращает баланс до изменений, nil если изменений не было
+-(NSNumber *)clearConsumableNotifyPending
+{
+    [self lockConsumable];
+    
+    NSNumber *balance =
+    _consumable.isNotifyPending ? @(_consumable.notifyBalance) : nil;
+    
+    _consumable.isNotifyPending = NO;
+    
+    [self unlockConsumable];
+    
+    return balance;
+}
+
+-(NSNumber *)consumableCount
+{
+    [self lockConsumable];
+    
+    NSInteger balance =
+    (NSInteger)_consumable.balance;
+    
+    [self unlockConsumable];
+    
+    if (balance <= 0)
+        return nil;
+    
+    return
+    @(balance);
+}
+
+-(NSInteger)consumableAvailableCount
+{
+    [self lockConsumable];
+    
+    NSInteger available =
+    (NSInteger)StoreBalanceAvailable(&_consumable);
+    
+    [self unlockConsumable];
+    
+    return
+    MAX(available, 0);
+}
+
+-(BOOL)consumableSpendCount:(NSInteger)count
+{
+    if (count <= 0)
+        return YES;
+    
+    StoreBalanceChange change;
+    
+    [self lockConsumable];
+    
+    BOOL isEnough =
+    StoreBalanceSpend(&_consumable, count, &change);
+    
+    [self unlockConsumable];
+    
+    [self
+     didChangeConsumable:change];
+    
+    return
+    isEnough;
+}
+
+-(void)consumableGrantCount:(NSInteger)count
+{
+    if (count <= 0)
+        return;
+    
+    [self lockConsumable];
+    
+    StoreBalanceChange change =
+    [self
+     applyConsumableDelta:count];
+    
+    [self unlockConsumable];
+    
+    [self
+     didChangeConsumable:change];
+}
+
+-(StoreConsumableReservation *)consumableReserveCount:(NSInteger)count
+{
+    if (count <= 0)
+        return nil;
+    
+    [self lockConsumable];
+    
+    BOOL isReserved =
+    StoreBalanceReserve(&_consumable, count);
+    
+    [self unlockConsumable];
+    
+    if (isReserved == NO)
+        return nil;
+    
+    return
+    [StoreConsumableReservation.alloc
+     initWithStoreItem:self
+     count:count];
+}
+
+-(void)finishConsumableReservation:(StoreConsumableReservation *)reservation
+                            commit:(BOOL                        )commit
+{
+    StoreBalanceChange change =
+    StoreBalanceChangeNone;
+    
+    [self lockConsumable];
+    
+    if (reservation.isFinished)
+    {
+        [self unlockConsumable];
+        
+        return;
+    }
+    
+    reservation.isFinished = YES;
+    
+    change =
+    StoreBalanceFinish(&_consumable, reservation.count, commit);
+    
+    [self unlockConsumable];
+    
+    [self
+     didChangeConsumable:change];
+}
+
+-(void)consumablePurchaseDecrease
+{
+    [self 
+    consumablePurchaseDecreaseCount:@(1)];
+}
+
+-(void)consumablePurchaseDecreaseCount:(NSNumber *)decreaseCount
+{
+    [self lockConsumable];
+    
+    StoreBalanceChange change =
+    [self
+     applyConsumableDelta:-labs(decreaseCount.integerValue)];
+    
+    [self unlockConsumable];
+    
+    [self
+     didChangeConsumable:change];
+}
+
+-(void)returnCompletionsWithError:(NSError *)error
+{
+    self.isPurchasing = NO;
+    
+    for (PurchaseCompletion completion in self.purchaseCompletions)
+        completion(error);
+    
+    [self.purchaseCompletions removeAllObjects];
+    
+    dispatch_async(dispatch_get_main_queue(), ^(void)
+    {
+        [NSNotificationCenter.defaultCenter
+         postNotificationName:STORE_MANAGER_CHANGED
+         object:error];
+    });
+}
+
+#pragma mark - Transaction
+
+-(void)applyTransaction:(SKPaymentTransaction *)transaction
+{
+    StoreInfoLog(@"[INFO] Store applyTransaction: added identifier %@",
+                 transaction.payment.productIdentifier);
+    
+    _transactionState =
+    transaction.transactionState;
+    
+    [StoreState.current
+     setObject:transaction.transactionDate.description
+     forKey:transaction.payment.productIdentifier];
+    
+    [self
+     consumableGrantCount:self.defaultConsumableCount.integerValue];
+    
+    // Начисление по транзакции уходит в тот же commit, что и флаг покупки
+    [self
+     persistConsumableBalance];
+    
+    _startDate =
+    transaction.transactionDate;
+    
+    _transactionId =
+    transaction.transactionIdentifier;
+    
+    NSDictionary *productInfo =
+    self.productInfo;
+    
+    if (productInfo[PRODUCT_PERiOD_UNiT])
+    {
+        NSDateComponents *dayComponent =
+        NSDateComponents.new;
+        
+        NSInteger periodUnit =
+        [productInfo[PRODUCT_PERiOD_UNiT] integerValue];
+        
+        NSInteger periodCount =
+        [productInfo[PRODUCT_PERiOD_COUNT] integerValue];
+        
+        if (periodUnit == SKProductPeriodUnitDay)
+            dayComponent.day = 1 * periodCount;
+        
+        else if (periodUnit == SKProductPeriodUnitWeek)
+            dayComponent.day = 7 * periodCount;
+        
+        else if (periodUnit == SKProductPeriodUnitMonth)
+            dayComponent.month = 1 * periodCount;
+        
+        else if (periodUnit == SKProductPeriodUnitYear)
+            dayComponent.year = 1 * periodCount;
+        
+        _endDate =
+        [NSCalendar.currentCalendar
+         dateByAddingComponents:dayComponent
+         toDate:_startDate
+         options:0];
+    }
+    
+    else if (_type == StoreItemTypeNonRenewingSubscription)
+    {
+        NSDateComponents *dayComponent =
+        NSDateComponents.new;
+        
+        if (_period == StoreItemPeriodWeek)
+            dayComponent.day = 7;
+        
+        else if (_period == StoreItemPeriodMonth)
+            dayComponent.month = 1;
+        
+        else if (_period == StoreItemPeriodYear)
+            dayComponent.year = 1;
+        
+        _endDate =
+        [NSCalendar.currentCalendar
+         dateByAddingComponents:dayComponent
+         toDate:_startDate
+         options:0];
+    }
+    
+    [self
+     updatePurchasedDetail];
+}
+
+#pragma mark - Store Item Helpers
+
+-(NSString *)startDateStringWithFormat:(NSString *)stringFormat
+{
+    if (!self.startDate)
+        return nil;
+    
+    return
+    [[StoreFormatters
+      dateFormatterWithFormat:stringFormat
+      locale:NSLocale.currentLocale]
+     stringFromDate:self.startDate];
+}
+
+-(NSString *)endDateStringWithFormat:(NSString *)stringFormat
+{
+    if (!self.endDate)
+        return nil;
+    
+    return
+    [[StoreFormatters
+      dateFormatterWithFormat:stringFormat
+      locale:NSLocale.currentLocale]
+     stringFromDate:self.endDate];
+}
+
+-(StoreItem *)consumable
+{
+    self.type =
+    StoreItemTypeConsumable;
+    
+    return self;
+}
+
+-(StoreItem *)nonConsumable
+{
+    self.type =
+    StoreItemTypeNonConsumable;
+    
+    return self;
+}
+
+-(StoreItem *)autoRenewableSubscription
+{
+    self.type =
+    StoreItemTypeAutoRenewableSubscription;
+    
+    return self;
+}
+
+-(StoreItem *)nonRenewingSubscriptionWeek
+{
+    self.type =
+    StoreItemTypeNonRenewingSubscription;
+    
+    _period =
+    StoreItemPeriodWeek;
+    
+    return self;
+}
+
+-(StoreItem *)nonRenewingSubscriptionMonth
+{
+    self.type =
+    StoreItemTypeNonRenewingSubscription;
+    
+    _period =
+    StoreItemPeriodMonth;
+    
+    return self;
+}
+
+-(StoreItem *)nonRenewingSubscriptionYear
+{
+    self.type =
+    StoreItemTypeNonRenewingSubscription;
+    
+    _period =
+    StoreItemPeriodYear;
+    
+    return self;
+}
+
+-(NSString *)description
+{
+    NSString *typeString;
+    
+    switch (self.type)
+    {
+        case StoreItemTypeUnknown:
+            typeString =
+            @"StoreItemTypeUnknown";
+            break;
+            
+        case StoreItemTypeConsumable:
+            typeString =
+            @"StoreItemTypeConsumable";
+            break;
+            
+        case StoreItemTypeNonConsumable:
+            typeString =
+            @"StoreItemTypeNonConsumable";
+            break;
+            
+        case StoreItemTypeAutoRenewableSubscription:
+            typeString =
+            @"StoreItemTypeAutoRenewableSubscription";
+            break;
+            
+        case StoreItemTypeNonRenewingSubscription:
+            typeString =
+            @"StoreItemTypeNonRenewingSubscription";
+            break;
+    }
+    
+    NSString *periodString;
+    
+    switch (self.period)
+    {
+        case StoreItemPeriodNone:
+            periodString =
+            @"StoreItemPeriodNone";
+            break;
+            
+        case StoreItemPeriodWeek:
+            periodString =
+            @"StoreItemPeriodWeek";
+            break;
+            
+        case StoreItemPeriodMonth:
+            periodString =
+            @"StoreItemPeriodMonth";
+            break;
+            
+        case StoreItemPeriodYear:
+            periodString =
+            @"StoreItemPeriodYear";
+            break;
+    }
+    
+    NSString *transactionStateString;
+    
+    switch (self.transactionState)
+    {
+        case SKPaymentTransactionStatePurchasing:
+            transactionStateString =
+            @"SKPaymentTransactionStatePurchasing";
+            break;
+            
+        case SKPaymentTransactionStatePurchased:
+            transactionStateString =
+            @"SKPaymentTransactionStatePurchased";
+            break;
+            
+        case SKPaymentTransactionStateFailed:
+            transactionStateString =
+            @"SKPaymentTransactionStateFailed";
+            break;
+            
+        case SKPaymentTransactionStateRestored:
+            transactionStateString =
+            @"SKPaymentTransactionStateRestored";
+            break;
+            
+        case SKPaymentTransactionStateDeferred:
+            transactionStateString =
+            @"SKPaymentTransactionStateDeferred";
+            break;
+    }
+    
+    NSDictionary *dictionary =
+    @{@"description":super.description,
+      @"identifier":self.identifier,
+      @"type":typeString,
+      @"period":periodString,
+      @"title":self.title ? self.title : @"nil",
+      @"title with price":self.titleWithPrice ? self.titleWithPrice : @"nil",
+      @"detail":self.detail ? self.detail : @"nil",
+      @"price number":self.priceNumber ? self.priceNumber : @"nil",
+      @"price string":self.priceString ? self.priceString : @"nil",
+      @"currency code":self.currencyCode ? self.currencyCode : @"nil",
+      @"currency symbol":self.currencySymbol ? self.currencySymbol : @"nil",
+      @"price per week string":self.pricePerWeekString ? self.pricePerWeekString : @"nil",
+      @"price per month string":self.pricePerMonthString ? self.pricePerMonthString : @"nil",
+      @"is invalid":self.isInvalid ? @"YES" : @"NO",
+      @"is purchased":self.isPurchased ? @"YES" : @"NO",
+      @"transaction id":self.transactionId ? self.transactionId : @"nil",
+      @"transaction state string":transactionStateString,
+      @"default consumable count":self.defaultConsumableCount ? self.defaultConsumableCount : @"nil",
+      @"consumable count":self.consumableCount ? self.consumableCount : @"nil",
+      @"start date":self.startDate ? self.startDate : @"nil",
+      @"end date":self.endDate ? self.endDate : @"nil",
+      @"is trial":self.isTrial ? @"YES" : @"NO"
+    };
+    
+    NSData *jsonData =
+    [NSJSONSerialization
+     dataWithJSONObject:dictionary
+     options:NSJSONWritingPrettyPrinted
+     error:nil];
+    
+    return
+    [NSString.alloc
+     initWithData:jsonData
+     encoding:NSUTF8StringEncoding];
+}
+
++(void)addInfoLog:(NSString *)log
+{
+    if (ENABLE_STORE_iNFO_LOG)
+        NSLog(@"%@",
+              log);
+    
+    [StoreItem
+     addFileLog:log];
+}
+
++(void)addErrorLog:(NSString *)log
+{
+    if (ENABLE_STORE_ERROR_LOG)
+        NSLog(@"%@",
+              log);
+    
+    [StoreItem
+     addFileLog:log];
+}
+
++(void)addFileLog:(NSString *)log
+{
+    if (ENABLE_STORE_LOG_WITH_METHOD)
+        [StoreLog.current
+         addLog:log];
+}
+
+@end
+
+#pragma mark - Store Manager
+
+#define STORE_SHAREDSECRET  @"StoreSharedSecred"
+#define STORE_iTEMS         @"StoreItems"
+#define STORE_UPDATE        @"StoreUpdate"
+#define STORE_ETAG          @"StoreETag"
+#define STORE_MODIFIED      @"StoreLastModified"
+#define STORE_SANDBOX       @"StoreSandbox"
+#define STORE_RECEIPT_CACHE @"StoreReceiptCache"
+
+// Снимок каталога в папке StoreState: @{identifier:productInfo}
+#define STORE_CATALOG_FILE  @"Catalog.plist"
+
+// Ответ verifyReceipt в папке StoreState: @{key:..., response:...}. В самом StoreState
+// под STORE_RECEIPT_CACHE только ключ и срок, чтобы журнал не рос на сотни КБ на каждую проверку
+#define STORE_RECEIPT_FILE  @"Receipt.plist"
+
+#define CONFiG_SHAREDSECRET @"sharedSecred"
+#define CONFiG_iDENTiFiERS  @"identifiers"
+#define CONFiG_iDENTiFiER   @"identifier"
+#define CONFiG_TYPE         @"type"
+#define CONFiG_COUNT        @"count"
+#define CONFiG_NOT_FOR_SELL @"notForSell"
+#define CONFiG_AS_RANGE     @"asPurchasedForRanges"
+
+#define TYPE_CONSUMABLE     @"consumable"
+#define TYPE_NCONSUMABLE    @"nonConsumable"
+#define TYPE_NR_WEEK        @"nonRenewingSubscriptionWeek"
+#define TYPE_NR_MONTH       @"nonRenewingSubscriptionMonth"
+#define TYPE_NR_YEAR        @"nonRenewingSubscriptionYear"
+#define TYPE_RENEWABLE      @"autoRenewableSubscription"
+
+@interface Store () <SKProductsRequestDelegate, SKRequestDelegate, SKPaymentTransactionObserver>
+
+@property (nonatomic, strong) NSString                           *sharedSecret;
+@property (nonatomic, strong) NSArray <StoreItem *>              *storeItems;
+
+@property (nonatomic, strong) NSArray <SKProduct *>              *products;
+
+// Последний загруженный или записанный снимок каталога, пишем только если он изменился.
+// Подменяется целиком, читается в локальную переменную один раз
+@property (atomic,    copy)   NSDictionary <NSString *, NSDictionary *> *catalogSnapshot;
+
+// Поля покупок заполнены из снимка и еще не подтверждены ответом App Store
+@property (atomic,    assign) BOOL                                isCatalogStale;
+
+@property (nonatomic, assign) BOOL                                isRestoring;
+@property (nonatomic, assign) BOOL                                isRestoringFull;
+@property (nonatomic, assign) BOOL                                isSandbox;
+
+@property (nonatomic, strong) SKProductsRequest                  *productsRequest;
+@property (nonatomic, strong) SKReceiptRefreshRequest            *receiptRequest;
+
+// Восстановленные транзакции в текущем полном восстановлении
+@property (nonatomic, assign) NSUInteger                          restoredTransactionsCount;
+
+// Завершенные транзакции покупок, которых еще нет в конфиге. Разбираются повторно,
+// когда setStoreItems: добавит их идентификаторы. Меняется только на main
+@property (nonatomic, strong) NSMutableArray <SKPaymentTransaction *> *pendingTransactions;
+
+// Массивы для хранения блоков
+@property (nonatomic, strong) NSMutableArray <RestoreCompletion> *restoreCompletions;
+@property (nonatomic, strong) NSMutableArray <RestoreCompletion> *restoreFullCompletions;
+
+// Метод для проверки купленности самостоятельно юзером
+@property (nonatomic, strong) RawRecieptHandler                   rawRecieptHandler;
+
+@property (nonatomic, assign) BOOL                                isTrialPeriod;
+
+@property (nonatomic, strong) NSDate                             *purchasedDate;
+@property (nonatomic, strong) NSString                           *purchasedVersion;
+
+@property (atomic,    assign) uint64_t                            firstInstallDay;
+@property (atomic,    assign) uint64_t                            firstInstallVersion;
+@property (atomic,    assign) BOOL                                isFirstInstallVersionKnown;
+
+@property (nonatomic, strong) LockRules                           lockRules;
+
+@property (nonatomic, strong) NSURL                              *url;
+
+@property (nonatomic, assign) BOOL                                isSetupProgress;
+
+@property (nonatomic,   copy) RestoreCompletion                   setupWithURLCompletion;
+
+@property (nonatomic, strong) NSData                             *receiptJSON;
+
+@property (atomic,    strong) id <StoreTransport>                 transport;
+
+// Подмены StoreKit, по умолчанию nil: чек из appStoreReceiptURL и SKProductsRequest
+@property (atomic,    copy)   StoreReceiptProvider                receiptProvider;
+@property (atomic,    strong) Class                               productsRequestClass;
+
+@property (nonatomic, assign) NSUInteger                          receiptCacheHits;
+@property (nonatomic, assign) NSUInteger                          receiptCacheMisses;
+
+@property (atomic,    assign) StoreReceiptVerification            receiptVerification;
+
+// Планировщик обновлений, меняется только на main
+@property (atomic,    strong) NSDate                             *nextRefreshDate;
+@property (nonatomic, strong) NSDate                             *lastRefreshDate;
+@property (nonatomic, assign) NSUInteger                          refreshFailures;
+@property (nonatomic, assign) BOOL                                isRefreshDebouncing;
+
+// Запросы в работе: ключ @[метод, URL, тело], значение ожидающие completion
+@property (nonatomic, strong) NSMutableDictionary <NSArray *, NSMutableArray <StoreTransportCompletion> *> *inFlightRequests;
+
+// Подменяются целиком, атомарно, читаются без блокировок
+@property (atomic,    strong) StoreEntitlements                  *entitlements;
+@property (atomic,    strong) StoreCatalog                       *catalog;
+
+// Растет при каждом invalidateCatalog, меняется под @synchronized (self)
+@property (nonatomic, assign) NSUInteger                          catalogGeneration;
+
+// StoreItem созданные по идентификаторам, которых нет в списке покупок
+@property (nonatomic, strong) NSMutableDictionary <NSString *, StoreItem *> *internedStoreItems;
+
+// Одноразовые покупки, баланс которых еще не записан в StoreState
+@property (nonatomic, strong) NSMutableSet <StoreItem *>         *consumableDirtyItems;
+@property (nonatomic, assign) BOOL                                isConsumableFlushScheduled;
+
+// Покупки, изменения которых еще не разосланы через STORE_MANAGER_CHANGED
+@property (nonatomic, strong) NSMutableSet <StoreItem *>         *changedStoreItems;
+@property (nonatomic, assign) BOOL                                isChangeNotificationScheduled;
+
+// identifier -> (@(StoreChangeKind) -> значение до первого изменения), под @synchronized (changedStoreItems)
+@property (nonatomic, strong) NSMutableDictionary <NSString *, NSMutableDictionary <NSNumber *, id> *> *changedValues;
+
+@property (nonatomic, strong) NSMutableArray <StoreChangeSubscription *> *changeSubscriptions;
+
+@end
+
+#pragma mark - Local Receipt
+
+static NSString *StoreReceiptStringValue(StoreReceiptString string)
+{
+    if (string.length == 0)
+        return nil;
+    
+    return
+    [NSString.alloc
+     initWithBytes:string.bytes
+     length:string.length
+     encoding:NSUTF8StringEncoding];
+}
+
+// В ответе verifyReceipt даты в мс лежат строками, повторяем это
+static NSString *StoreReceiptDateValue(int64_t dateMs)
+{
+    if (dateMs < 0)
+        return nil;
+    
+    return
+    [NSString
+     stringWithFormat:@"%lld", (long long)dateMs];
+}
+
+static int StoreReceiptAddPurchase(const StoreReceiptPurchase *purchase, void *context)
+{
+    // Возвращенные покупки verifyReceipt тоже не считает действующими
+    if (purchase->productId.length == 0 ||
+        purchase->cancellationDateMs >= 0)
+        return 0;
+    
+    NSMutableDictionary *receipt =
+    NSMutableDictionary.new;
+    
+    receipt[@"quantity"]                  = [NSString stringWithFormat:@"%lld", (long long)purchase->quantity];
+    receipt[@"product_id"]                = StoreReceiptStringValue(purchase->productId);
+    receipt[@"transaction_id"]            = StoreReceiptStringValue(purchase->transactionId);
+    receipt[@"original_transaction_id"]   = StoreReceiptStringValue(purchase->originalTransactionId);
+    receipt[@"purchase_date"]             = StoreReceiptStringValue(purchase->purchaseDate);
+    receipt[@"purchase_date_ms"]          = StoreReceiptDateValue(purchase->purchaseDateMs);
+    receipt[@"original_purchase_date_ms"] = StoreReceiptDateValue(purchase->originalPurchaseDateMs);
+    receipt[@"expires_date_ms"]           = StoreReceiptDateValue(purchase->expiresDateMs);
+    receipt[@"is_trial_period"]           = purchase->isTrialPeriod        ? @"true" : @"false";
+    receipt[@"is_in_intro_offer_period"]  = purchase->isInIntroOfferPeriod ? @"true" : @"false";
+    
+    [(__bridge NSMutableArray *)context
+     addObject:receipt.copy];
+    
+    return 0;
+}
+
+@implementation Store
+
+-(BOOL)isSandbox
+{
+    #if DEBUG
+    
+    return
+    YES;
+    
+    #else
+    
+    // Выставляется после ответа 21007, иначе повтор снова ушел бы в production
+    return
+    _isSandbox;
+    
+    #endif
+}
+
++(instancetype)current
+{
+    static Store *_current = nil;
+    static dispatch_once_t oncePredicate;
+    
+    dispatch_once(&oncePredicate, ^
+    {
+        _current = self.new;
+    });
+    
+    return _current;
+}
+
++(void)setupWithURLString:(NSString        *)urlString
+               completion:(RestoreCompletion)completion;
+{
+    if (Store.current.isSetupProgress)
+    {
+        if (completion)
+            completion(nil);
+        
+        return;
+    }
+    
+    Store.current.isSetupProgress = YES;
+    
+    Store.current.setupWithURLCompletion = nil;
+    
+    NSURL *url =
+    [NSURL
+     URLWithString:urlString];
+    
+    if (url == nil)
+        [NSException
+         raise:@"Store"
+         format:@"Url string is not valid: %@",
+         urlString];
+    
+    Store.current.url = url;
+    
+    Store.current.sharedSecret =
+    [StoreState.current
+     objectForKey:STORE_SHAREDSECRET];
+    
+    Store.current.storeItems =
+    [self
+     storeItemsParsedFromArray:[StoreState.current
+                          objectForKey:STORE_iTEMS]];
+    
+    // Пейвол можно показывать сразу, не дожидаясь SKProductsRequest
+    [Store.current
+     loadCatalogSnapshot];
+    
+    NSMutableURLRequest *request =
+    [NSMutableURLRequest
+     requestWithURL:url
+     cachePolicy:NSURLRequestReloadIgnoringLocalCacheData
+     timeoutInterval:STORE_CONFIG_TIMEOUT];
+    
+    // Условный GET: если конфиг не менялся, сервер вернет 304 без тела
+    if (Store.current.sharedSecret.length && Store.current.storeItems.count)
+    {
+        [request
+         setValue:[StoreState.current
+                   objectForKey:STORE_ETAG]
+         forHTTPHeaderField:@"If-None-Match"];
+        
+        [request
+         setValue:[StoreState.current
+                   objectForKey:STORE_MODIFIED]
+         forHTTPHeaderField:@"If-Modified-Since"];
+    }
+    
+    StoreMetricsBegin(StoreMetricsPhaseConfig);
+    
+    [Store.current
+     sendRequest:request
+     completion:^(NSData *jsonData, NSHTTPURLResponse *response, NSError *error)
+    {
+        StoreMetricsEnd(StoreMetricsPhaseConfig, error);
+        StoreMetricsCount(@"config.http.%ld", (long)response.statusCode);
+        StoreMetricsBytes(@"config", jsonData.length);
+        
+        NSDictionary *jsonObject;
+        
+        if (error == nil && response.statusCode == 200 && jsonData)
+            jsonObject =
+            [NSJSONSerialization
+             JSONObjectWithData:jsonData
+             options:0
+             error:nil];
+        
+        if ([jsonObject isKindOfClass:NSDictionary.class] == NO)
+            jsonObject = nil;
+        
+        dispatch_async(dispatch_get_main_queue(), ^(void)
+        {
+            if (error)
+                StoreErrorLog(@"[ERROR] Store: Config request failed: %@",
+                              error.localizedDescription);
+            
+            // Ушли в фон, обновимся при следующем входе
+            if ([error.domain isEqualToString:NSURLErrorDomain] &&
+                error.code == NSURLErrorCancelled)
+            {
+                Store.current.isSetupProgress = NO;
+                
+                if (completion)
+                    completion(error);
+                
+                return;
+            }
+            
+            if (response.statusCode == 304)
+            {
+                [StoreItem
+                 addInfoLog:@"[INFO] Store: Config not modified"];
+                
+                [StoreState.current
+                 setObject:NSDate.date
+                 forKey:STORE_UPDATE];
+                
+                [StoreState.current
+                 commit];
+                
+                [Store.current
+                 restoreProductsCompletion:^(NSError *error)
+                {
+                    Store.current.isSetupProgress = NO;
+                    
+                    if (completion)
+                        completion(error);
+                }];
+                
+                return;
+            }
+            
+            if (!jsonObject)
+            {
+                if (Store.current.sharedSecret.length == 0)
+                {
+                    NSError *configError =
+                    [NSError
+                     errorWithDomain:@"Store"
+                     code:-1
+                     userInfo:@{NSLocalizedDescriptionKey:@"Invalid Store Config, json data is nil or incorrected."}];
+                    
+                    Store.current.setupWithURLCompletion =
+                    completion;
+                    
+                    Store.current.isSetupProgress = NO;
+                    
+                    [Store.current
+                     didRefreshWithError:configError];
+                    
+                    if (completion)
+                        completion(configError);
+                }
+                
+                else
+                    [Store.current
+                     restoreProductsCompletion:^(NSError *error)
+                    {
+                        Store.current.isSetupProgress = NO;
+                        
+                        if (completion)
+                            completion(error);
+                    }];
+                
+                return;
+            }
+            
+            if (jsonObject[CONFiG_SHAREDSECRET] && jsonObject[CONFiG_iDENTiFiERS])
+            {
+                Store.current.sharedSecret =
+                jsonObject[CONFiG_SHAREDSECRET];
+                
+                [StoreState.current
+                 setObject:jsonObject[CONFiG_SHAREDSECRET]
+                 forKey:STORE_SHAREDSECRET];
+
+                Store.current.storeItems =
+                [self
+                 storeItemsParsedFromArray:jsonObject[CONFiG_iDENTiFiERS]];
+                
+                [Store.current
+                 loadCatalogSnapshot];
+                
+                [StoreState.current
+                 setObject:jsonObject[CONFiG_iDENTiFiERS]
+                 forKey:STORE_iTEMS];
+                
+                [StoreState.current
+                 setObject:NSDate.date
+                 forKey:STORE_UPDATE];
+                
+                [StoreState.current
+                 setObject:[response
+                            valueForHTTPHeaderField:@"ETag"]
+                 forKey:STORE_ETAG];
+                
+                [StoreState.current
+                 setObject:[response
+                            valueForHTTPHeaderField:@"Last-Modified"]
+                 forKey:STORE_MODIFIED];
+                
+                [StoreState.current
+                 commit];
+                
+                [Store.current
+                 restoreProductsCompletion:^(NSError *error)
+                {
+                    Store.current.isSetupProgress = NO;
+                    
+                    if (completion)
+                        completion(error);
+                }];
+            }
+            
+            else
+            {
+                NSError *configError =
+                [NSError
+                 errorWithDomain:@"Store"
+                 code:-1
+                 userInfo:@{NSLocalizedDescriptionKey:@"Invalid Store Config"}];
+                
+                Store.current.isSetupProgress = NO;
+                
+                [Store.current
+                 didRefreshWithError:configError];
+                
+                if (completion)
+                    completion(configError);
+            }
+        });
+    }];
+}
+
++(NSArray <StoreItem *> *)storeItemsParsedFromArray:(NSArray <NSDictionary <NSString *, NSString *> *> *)array
+{
+    NSMutableArray *items =
+    NSMutableArray.new;
+    
+    for (NSDictionary <NSString *, NSString *> *dictionary in array)
+    {
+        StoreItem *storeItem =
+        [Store
+         storeItemWithIdentifier:dictionary[CONFiG_iDENTiFiER]];
+        
+        storeItem.identifier =
+        dictionary[CONFiG_iDENTiFiER];
+        
+        if ([dictionary[CONFiG_TYPE]
+             isEqualToString:TYPE_CONSUMABLE])
+        {
+            storeItem.type =
+            StoreItemTypeConsumable;
+            
+            if (dictionary[CONFiG_COUNT])
+                storeItem.defaultConsumableCount =
+                @(dictionary[CONFiG_COUNT].integerValue);
+        }
+
+        else if ([dictionary[CONFiG_TYPE]
+                  isEqualToString:TYPE_NCONSUMABLE])
+            storeItem.type =
+            StoreItemTypeNonConsumable;
+        
+        else if ([dictionary[CONFiG_TYPE]
+                  isEqualToString:TYPE_RENEWABLE])
+            storeItem.type =
+            StoreItemTypeAutoRenewableSubscription;
+        
+        else
+        {
+            storeItem.type =
+            StoreItemTypeNonRenewingSubscription;
+            
+            if ([dictionary[CONFiG_TYPE]
+                 isEqualToString:TYPE_NR_WEEK])
+                storeItem.period =
+                StoreItemPeriodWeek;
+            
+            else if ([dictionary[CONFiG_TYPE]
+                      isEqualToString:TYPE_NR_MONTH])
+                storeItem.period =
+                StoreItemPeriodMonth;
+            
+            else if ([dictionary[CONFiG_TYPE]
+                      isEqualToString:TYPE_NR_YEAR])
+                storeItem.period =
+                StoreItemPeriodYear;
+        }
+        
+        if (dictionary[CONFiG_NOT_FOR_SELL])
+            storeItem.isNotForSell =
+            [dictionary[CONFiG_NOT_FOR_SELL]
+             boolValue];
+        
+        if (dictionary[CONFiG_AS_RANGE])
+            [storeItem
+             setAsPurchasedForRanges:(NSArray *)dictionary[CONFiG_AS_RANGE]];
+        
+        if ([items
+             containsObject:storeItem] == NO)
+            [items
+             addObject:storeItem];
+    }
+    
+    return
+    items.copy;
+}
+
++(void)setupWithSharedSecret:(NSString              *)sharedSecret
+                  storeItems:(NSArray <StoreItem *> *)storeItems
+                  completion:(RestoreCompletion      )completion;
+{
+    Store.current.sharedSecret = sharedSecret;
+    Store.current.storeItems   = storeItems;
+    
+    [Store.current
+     loadCatalogSnapshot];
+    
+    [Store.current
+     restoreProductsCompletion:completion];
+}
+
++(void)checkRawReceipt:(RawRecieptHandler)rawRecieptHandler
+{
+    Store.current.rawRecieptHandler =
+    rawRecieptHandler;
+}
+
++(void)setReceiptVerification:(StoreReceiptVerification)receiptVerification
+{
+    Store.current.receiptVerification =
+    receiptVerification;
+}
+
++(void)restoreWithCompletion:(RestoreCompletion)completion
+{
+    [Store.current
+     restoreProductsFullCompletion:completion];
+}
+
++(StoreItem *)storeItemWithIdentifier:(NSString *)identifier
+{
+    StoreItem *storeItem =
+    Store.current.currentCatalog.storeItemsByIdentifier[identifier];
+    
+    if (storeItem)
+        return storeItem;
+    
+    NSMutableDictionary <NSString *, StoreItem *> *internedStoreItems =
+    Store.current.internedStoreItems;
+    
+    @synchronized (internedStoreItems)
+    {
+        storeItem =
+        internedStoreItems[identifier];
+        
+        if (storeItem == nil)
+        {
+            storeItem =
+            StoreItem.new;
+            
+            storeItem.identifier = identifier;
+            
+            internedStoreItems[identifier] =
+            storeItem;
+        }
+    }
+    
+    return
+    storeItem;
+}
+
++(BOOL)isReady
+{
+    return
+    (Store.current.isSetupComplete &&
+     Store.current.products.count &&
+     !Store.current.isRestoring &&
+     !Store.current.isSetupProgress);
+}
+
++(BOOL)isStale
+{
+    return
+    Store.current.isCatalogStale;
+}
+
++(BOOL)isSandbox
+{
+    return
+    Store.current.isSandbox;
+}
+
++(NSArray<StoreItem *> *)storeItemsAll
+{
+    return
+    Store.current.currentCatalog.storeItemsAll;
+}
+
++(NSArray<StoreItem *> *)storeItems
+{
+    return
+    Store.current.currentCatalog.storeItems;
+}
+
++(NSArray<StoreItem *> *)storeItemsPurchased
+{
+    return
+    Store.current.currentEntitlements.storeItemsPurchased;
+}
+
++(NSArray <StoreItem *> *)storeItemsWithType:(StoreItemType)type
+{
+    NSArray <StoreItem *> *storeItems =
+    Store.current.currentCatalog.storeItemsByType[@(type)];
+    
+    if (storeItems == nil)
+        return @[];
+    
+    return
+    storeItems;
+}
+
++(NSArray <StoreItem *> *)storeItemsPurchasedWithType:(StoreItemType)type
+{
+    NSArray <StoreItem *> *storeItems =
+    Store.current.currentEntitlements.storeItemsPurchasedByType[@(type)];
+    
+    if (storeItems == nil)
+        return @[];
+    
+    return
+    storeItems;
+}
+
++(NSUInteger)entitlementsGeneration
+{
+    return
+    Store.current.currentEntitlements.generation;
+}
+
+// Упаковывается один раз на разбор чека, дальше правила проверяются двоичным поиском
+-(void)setPurchasedDate:(NSDate *)purchasedDate
+{
+    _purchasedDate = purchasedDate;
+    
+    self.firstInstallDay =
+    purchasedDate ? StoreRangesDayWithTime(purchasedDate.timeIntervalSince1970) : 0;
+}
+
+-(void)setPurchasedVersion:(NSString *)purchasedVersion
+{
+    _purchasedVersion = purchasedVersion;
+    
+    const char *string =
+    purchasedVersion.UTF8String;
+    
+    uint64_t version = 0;
+    
+    self.isFirstInstallVersionKnown =
+    string && StoreRangesParseVersion(string, strlen(string), &version);
+    
+    self.firstInstallVersion =
+    version;
+}
+
++(NSDate *)firstInstallDate
+{
+    return
+    Store.current.purchasedDate;
+}
+
++(NSString *)firstInstallAppVersion
+{
+    return
+    Store.current.purchasedVersion;
+}
+
++(BOOL)firstInstallDateIsOlderDate:(NSDate *)date
+{
+    return
+    [Store.current purchasedDateIsOlderDate:date];
+}
+
++(BOOL)firstInstallIsOlderVersion:(NSString *)version
+{
+    return
+    [Store.current purchasedVersionIsOlderVersion:version];
+}
+
+#pragma mark - Store Manager Init zone
+
+-(instancetype)init
+{
+    if (self = [super init])
+    {
+        self.restoreCompletions =
+        NSMutableArray.new;
+        
+        self.restoreFullCompletions =
+        NSMutableArray.new;
+        
+        self.internedStoreItems =
+        NSMutableDictionary.new;
+        
+        self.pendingTransactions =
+        NSMutableArray.new;
+        
+        self.consumableDirtyItems =
+        NSMutableSet.new;
+        
+        self.changedStoreItems =
+        NSMutableSet.new;
+        
+        self.changedValues =
+        NSMutableDictionary.new;
+        
+        self.changeSubscriptions =
+        NSMutableArray.new;
+        
+        self.inFlightRequests =
+        NSMutableDictionary.new;
+        
+        self.transport =
+        StoreURLSessionTransport.new;
+        
+        self.paymentQueue =
+        SKPaymentQueue.defaultQueue;
+        
+        [self.paymentQueue
+         addTransactionObserver:self];
+                
+        [NSNotificationCenter.defaultCenter
+         addObserver:self
+         selector:@selector(willEnterForegroundNotification)
+         name:UIApplicationWillEnterForegroundNotification
+         object:nil];
+        
+        if (@available(iOS 13.0, *))
+            [NSNotificationCenter.defaultCenter
+             addObserver:self
+             selector:@selector(willEnterForegroundNotification)
+             name:UISceneWillEnterForegroundNotification
+             object:nil];
+        
+        [NSNotificationCenter.defaultCenter
+         addObserver:self
+         selector:@selector(didEnterBackgroundNotification)
+         name:UIApplicationDidEnterBackgroundNotification
+         object:nil];
+        
+        [NSNotificationCenter.defaultCenter
+         addObserver:self
+         selector:@selector(willTerminateNotification)
+         name:UIApplicationWillTerminateNotification
+         object:nil];
+        
+        [NSNotificationCenter.defaultCenter
+         addObserver:self
+         selector:@selector(currentLocaleDidChangeNotification)
+         name:NSCurrentLocaleDidChangeNotification
+         object:nil];
+        
+        [Store
+         removeFileLog];
+        
+        [self
+         migrateUserDefaults];
+        
+        // Окружение запоминается после ответа 21007, чтобы не ходить в production каждый раз
+        _isSandbox =
+        [[StoreState.current
+          objectForKey:STORE_SANDBOX] boolValue];
+    }
+    
+    return
+    self;
+}
+
+// Однократный перенос состояния покупок из NSUserDefaults в StoreState
+-(void)migrateUserDefaults
+{
+    [StoreState.current
+     migrateKeys:@[STORE_SHAREDSECRET, STORE_iTEMS, STORE_UPDATE]];
+    
+    if (StoreState.current.isNew)
+        [StoreState.current
+         migrateKeysWithPrefixes:@[@"consumableCount:", @"defaultConsumableCount:"]];
+    
+    NSMutableArray <NSString *> *identifiers =
+    NSMutableArray.new;
+    
+    for (NSDictionary *storeItem in [StoreState.current
+                                     objectForKey:STORE_iTEMS])
+        if (storeItem[CONFiG_iDENTiFiER])
+            [identifiers
+             addObject:storeItem[CONFiG_iDENTiFiER]];
+    
+    [StoreState.current
+     migrateKeys:identifiers];
+}
+
+-(BOOL)isSetupComplete
+{
+    return
+    ((Store.current.sharedSecret || Store.current.rawRecieptHandler) &&
+     Store.current.storeItems.count);
+}
+
+// Даты в detail форматируются по локали устройства
+-(void)currentLocaleDidChangeNotification
+{
+    [StoreFormatters
+     reset];
+    
+    for (StoreItem *storeItem in self.currentCatalog.storeItemsAll)
+    {
+        [storeItem
+         updatePurchasedDetail];
+        
+        [self
+         scheduleChangeNotificationForStoreItem:storeItem];
+    }
+}
+
+-(void)willEnterForegroundNotification
+{
+    [StoreItem
+     addInfoLog:@"[INFO] Store: Application will enter foreground"];
+    
+    // Серия входов (приложение и сцены) дает одну проверку
+    if (self.isRefreshDebouncing)
+        return;
+    
+    self.isRefreshDebouncing = YES;
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(STORE_REFRESH_DEBOUNCE * NSEC_PER_SEC)),
+                   dispatch_get_main_queue(), ^(void)
+    {
+        self.isRefreshDebouncing = NO;
+        
+        [self
+         refreshIfNeeded];
+    });
+}
+
+-(void)didEnterBackgroundNotification
+{
+    [StoreItem
+     addInfoLog:@"[INFO] Store: Application did enter background"];
+    
+    [self
+     flushConsumables];
+    
+    [self
+     cancelRequests];
+    
+    // Буфер лога иначе пропадет, если приложение выгрузят в фоне
+    if (ENABLE_STORE_LOG_WITH_METHOD)
+        [StoreLog.current
+         synchronize];
+}
+
+-(void)willTerminateNotification
+{
+    [self
+     flushConsumables];
+    
+    if (ENABLE_STORE_LOG_WITH_METHOD)
+        [StoreLog.current
+         synchronize];
+}
+
+-(void)returnFullCompletionsWithError:(NSError *)error
+{
+    StoreMetricsBegin(StoreMetricsPhaseCompletion);
+    
+    self.isRestoringFull =
+    NO;
+
+    if (error)
+        [StoreItem
+         addErrorLog:error.description];
+    
+    for (RestoreCompletion restoreCompletion in self.restoreFullCompletions)
+        dispatch_async(dispatch_get_main_queue(), ^(void)
+        {
+            restoreCompletion(error);
+        });
+    
+    [self.restoreFullCompletions
+     removeAllObjects];
+    
+    StoreMetricsEnd(StoreMetricsPhaseCompletion, nil);
+    StoreMetricsEnd(StoreMetricsPhaseRestore, error);
+    
+    dispatch_async(dispatch_get_main_queue(), ^(void)
+    {
+        [NSNotificationCenter.defaultCenter
+         postNotificationName:STORE_MANAGER_CHANGED
+         object:error];
+    });
+}
+
+-(void)returnCompletionsWithError:(NSError *)error
+{
+    StoreMetricsBegin(StoreMetricsPhaseCompletion);
+    
+    self.isRestoring = NO;
+    
+    [self
+     didRefreshWithError:error];
+    
+    if (error)
+        [StoreItem
+         addErrorLog:error.description];
+    
+    for (RestoreCompletion restoreCompletion in self.restoreCompletions)
+        dispatch_async(dispatch_get_main_queue(), ^(void)
+        {
+            restoreCompletion(error);
+        });
+    
+    [self.restoreCompletions
+     removeAllObjects];
+    
+    StoreMetricsEnd(StoreMetricsPhaseCompletion, nil);
+    StoreMetricsEnd(StoreMetricsPhaseRestore, error);
+    
+    dispatch_async(dispatch_get_main_queue(), ^(void)
+    {
+        [NSNotificationCenter.defaultCenter
+         postNotificationName:STORE_MANAGER_CHANGED
+         object:error];
+    });
+}
+
+#pragma mark - Catalog & Entitlements
+
+-(void)setStoreItems:(NSArray<StoreItem *> *)storeItems
+{
+    NSMutableArray <NSString *> *keys =
+    NSMutableArray.new;
+    
+    for (StoreItem *storeItem in storeItems)
+        [keys
+         addObjectsFromArray:@[storeItem.identifier,
+                               [@"consumableCount:"
+                                stringByAppendingString:storeItem.identifier],
+                               [@"defaultConsumableCount:"
+                                stringByAppendingString:storeItem.identifier]]];
+    
+    [StoreState.current
+     migrateKeys:keys];
+    
+    NSMutableArray <StoreItem *> *catalogItems =
+    NSMutableArray.new;
+    
+    // Покупкой в каталоге становится уже выданный экземпляр: кто получил @"id".storeItem
+    // до настройки, держит ту же покупку, что и каталог. Блокировки в том же порядке,
+    // что и при сборке каталога: сначала Store, потом таблица заглушек
+    @synchronized (self)
+    {
+        @synchronized (self.internedStoreItems)
+        {
+            for (StoreItem *storeItem in storeItems)
+            {
+                StoreItem *internedStoreItem =
+                self.internedStoreItems[storeItem.identifier];
+                
+                if (internedStoreItem &&
+                    internedStoreItem != storeItem)
+                {
+                    [internedStoreItem
+                     applyConfigurationFromStoreItem:storeItem];
+                    
+                    [catalogItems
+                     addObject:internedStoreItem];
+                }
+                
+                else
+                    [catalogItems
+                     addObject:storeItem];
             }
-        });
+            
+            // Покупки, которых нет в новом списке, остаются выданными теми же экземплярами
+            for (StoreItem *storeItem in _storeItems)
+                if ([catalogItems
+                     containsObject:storeItem] == NO)
+                    self.internedStoreItems[storeItem.identifier] =
+                    storeItem;
+            
+            _storeItems = catalogItems.copy;
+            
+            // Каталог сбрасывается до того, как заглушки убираются из таблицы,
+            // иначе storeItemWithIdentifier: между этими шагами создал бы новый экземпляр
+            [self
+             invalidateCatalog];
+            
+            for (StoreItem *storeItem in catalogItems)
+                [self.internedStoreItems
+                 removeObjectForKey:storeItem.identifier];
+        }
+    }
+    
+    [self
+     rebuildEntitlements];
+    
+    dispatch_async(dispatch_get_main_queue(), ^(void)
+    {
+        [self
+         replayPendingTransactions];
     });
 }
 
-+(NSArray <StoreItem *> *)storeItemsParsedFromArray:(NSArray <NSDictionary <NSString *, NSString *> *> *)array
+// Транзакции, для которых в новом списке появились покупки, проходят через роутер еще раз
+-(void)replayPendingTransactions
 {
-    NSMutableArray *items =
+    if (self.pendingTransactions.count == 0)
+        return;
+    
+    NSDictionary <NSString *, StoreItem *> *storeItems =
+    self.currentCatalog.storeItemsByIdentifier;
+    
+    NSMutableArray <SKPaymentTransaction *> *transactions =
     NSMutableArray.new;
     
-    for (NSDictionary <NSString *, NSString *> *dictionary in array)
+    for (SKPaymentTransaction *transaction in self.pendingTransactions)
+        if (storeItems[transaction.payment.productIdentifier])
+            [transactions
+             addObject:transaction];
+    
+    if (transactions.count == 0)
+        return;
+    
+    StoreInfoLog(@"[INFO] Store: Replay %lu transactions waiting for config",
+                 (unsigned long)transactions.count);
+    
+    [self
+     paymentQueue:self.paymentQueue
+     updatedTransactions:transactions];
+}
+
+-(StoreCatalog *)currentCatalog
+{
+    StoreCatalog *catalog =
+    self.catalog;
+    
+    if (catalog)
+        return catalog;
+    
+    NSUInteger generation;
+    
+    NSArray <StoreItem *> *storeItems;
+    
+    @synchronized (self)
     {
-        StoreItem *storeItem =
-        [Store
-         storeItemWithIdentifier:dictionary[CONFiG_iDENTiFiER]];
-        
-        storeItem.identifier =
-        dictionary[CONFiG_iDENTiFiER];
+        generation =
+        self.catalogGeneration;
         
-        if ([dictionary[CONFiG_TYPE]
-             isEqualToString:TYPE_CONSUMABLE])
+        storeItems =
+        self.storeItems;
+    }
+    
+    // Строится без блокировки, публикуется только если за это время не было invalidateCatalog,
+    // иначе каталог из устаревших покупок остался бы навсегда
+    catalog =
+    [StoreCatalog.alloc
+     initWithStoreItems:storeItems];
+    
+    @synchronized (self)
+    {
+        if (self.catalogGeneration == generation)
         {
-            storeItem.type =
-            StoreItemTypeConsumable;
+            if (self.catalog)
+                return self.catalog;
             
-            if (dictionary[CONFiG_COUNT])
-                storeItem.defaultConsumableCount =
-                @(dictionary[CONFiG_COUNT].integerValue);
+            self.catalog =
+            catalog;
         }
+    }
+    
+    return
+    catalog;
+}
 
-        else if ([dictionary[CONFiG_TYPE]
-                  isEqualToString:TYPE_NCONSUMABLE])
-            storeItem.type =
-            StoreItemTypeNonConsumable;
+-(void)invalidateCatalog
+{
+    @synchronized (self)
+    {
+        self.catalogGeneration ++;
         
-        else if ([dictionary[CONFiG_TYPE]
-                  isEqualToString:TYPE_RENEWABLE])
-            storeItem.type =
-            StoreItemTypeAutoRenewableSubscription;
+        self.catalog =
+        nil;
+    }
+}
+
+-(BOOL)isValidEntitlements:(StoreEntitlements *)entitlements
+{
+    return
+    entitlements &&
+    entitlements.validUntil > CFAbsoluteTimeGetCurrent() + kCFAbsoluteTimeIntervalSince1970;
+}
+
+-(StoreEntitlements *)currentEntitlements
+{
+    StoreEntitlements *entitlements =
+    self.entitlements;
+    
+    if ([self
+         isValidEntitlements:entitlements])
+        return entitlements;
+    
+    // Истекший снимок перестраивает первый поток, ждавшие на блокировке берут уже готовый
+    @synchronized (self)
+    {
+        if (![self
+              isValidEntitlements:self.entitlements])
+            [self
+             rebuildEntitlements];
         
-        else
+        return
+        self.entitlements;
+    }
+}
+
+-(void)rebuildEntitlements
+{
+    @synchronized (self)
+    {
+        NSArray <StoreItem *> *storeItems =
+        self.storeItems;
+        
+        NSMutableDictionary <NSString *, NSNumber *> *expirations =
+        [NSMutableDictionary
+         dictionaryWithCapacity:storeItems.count];
+        
+        NSTimeInterval validUntil =
+        DBL_MAX;
+        
+        for (StoreItem *storeItem in storeItems)
         {
-            storeItem.type =
-            StoreItemTypeNonRenewingSubscription;
+            NSTimeInterval expiration = 0;
             
-            if ([dictionary[CONFiG_TYPE]
-                 isEqualToString:TYPE_NR_WEEK])
-                storeItem.period =
-                StoreItemPeriodWeek;
+            if ([storeItem
+                 isPurchasedWithExpiration:&expiration] == NO)
+                continue;
             
-            else if ([dictionary[CONFiG_TYPE]
-                      isEqualToString:TYPE_NR_MONTH])
-                storeItem.period =
-                StoreItemPeriodMonth;
+            expirations[storeItem.identifier] =
+            @(expiration);
             
-            else if ([dictionary[CONFiG_TYPE]
-                      isEqualToString:TYPE_NR_YEAR])
-                storeItem.period =
-                StoreItemPeriodYear;
+            if (expiration > 0)
+                validUntil =
+                MIN(validUntil, expiration);
         }
         
-        if (dictionary[CONFiG_NOT_FOR_SELL])
-            storeItem.isNotForSell =
-            [dictionary[CONFiG_NOT_FOR_SELL]
-             boolValue];
+        NSMutableArray <StoreItem *> *storeItemsPurchased =
+        NSMutableArray.new;
         
-        if (dictionary[CONFiG_AS_RANGE])
-            [storeItem
-             setAsPurchasedForRanges:(NSArray *)dictionary[CONFiG_AS_RANGE]];
+        NSMutableDictionary <NSNumber *, NSMutableArray <StoreItem *> *> *storeItemsPurchasedByType =
+        NSMutableDictionary.new;
         
-        if ([items
-             containsObject:storeItem] == NO)
-            [items
+        // Каталог уже отсортирован по типу и цене
+        for (StoreItem *storeItem in self.currentCatalog.storeItemsAll)
+        {
+            if (expirations[storeItem.identifier] == nil)
+                continue;
+            
+            NSMutableArray <StoreItem *> *typed =
+            storeItemsPurchasedByType[@(storeItem.type)];
+            
+            if (typed == nil)
+                storeItemsPurchasedByType[@(storeItem.type)] =
+                typed =
+                NSMutableArray.new;
+            
+            [typed
              addObject:storeItem];
+            
+            if (storeItem.isInvalid == NO)
+                [storeItemsPurchased
+                 addObject:storeItem];
+        }
+        
+        for (NSNumber *type in storeItemsPurchasedByType.allKeys)
+            storeItemsPurchasedByType[type] =
+            storeItemsPurchasedByType[type].copy;
+        
+        StoreEntitlements *previous =
+        self.entitlements;
+        
+        NSUInteger generation =
+        previous.generation;
+        
+        if (previous == nil ||
+            ![previous.expirations
+              isEqualToDictionary:expirations])
+        {
+            generation ++;
+            
+            NSMutableSet <NSString *> *identifiers =
+            [NSMutableSet
+             setWithArray:expirations.allKeys];
+            
+            [identifiers
+             addObjectsFromArray:previous.expirations.allKeys];
+            
+            NSDictionary <NSString *, StoreItem *> *storeItemsByIdentifier =
+            self.currentCatalog.storeItemsByIdentifier;
+            
+            for (NSString *identifier in identifiers)
+                if ([expirations[identifier] isEqual:previous.expirations[identifier]] == NO &&
+                    storeItemsByIdentifier[identifier])
+                    [self
+                     scheduleChange:StoreChangeKindEntitlement
+                     forStoreItem:storeItemsByIdentifier[identifier]
+                     oldValue:previous.expirations[identifier]];
+            
+            StoreInfoLog(@"[INFO] Store entitlements: generation %lu, purchased %@",
+                         (unsigned long)generation,
+                         expirations.allKeys);
+        }
+        
+        self.entitlements =
+        [StoreEntitlements.alloc
+         initWithGeneration:generation
+         expirations:expirations
+         storeItemsPurchased:storeItemsPurchased
+         storeItemsPurchasedByType:storeItemsPurchasedByType
+         validUntil:validUntil];
     }
-    
+}
+
+#pragma mark - Consumables
+
++(BOOL)consumableSpendCounts:(NSDictionary <NSString *, NSNumber *> *)counts
+{
     return
-    items.copy;
+    [Store
+     consumableChangeCounts:counts
+     spend:YES];
 }
 
-+(NSDate *)lastModificationDateOfFileAtURL:(NSURL *)url
++(void)consumableGrantCounts:(NSDictionary <NSString *, NSNumber *> *)counts
 {
-    NSMutableURLRequest *request =
-    [NSMutableURLRequest.alloc
-     initWithURL:url];
+    [Store
+     consumableChangeCounts:counts
+     spend:NO];
+}
+
+// Блокирует все покупки в порядке идентификаторов, проверяет балансы
+// и меняет их разом, либо не меняет ни один
++(BOOL)consumableChangeCounts:(NSDictionary <NSString *, NSNumber *> *)counts
+                        spend:(BOOL                                  )spend
+{
+    NSArray <NSString *> *identifiers =
+    [counts.allKeys
+     sortedArrayUsingSelector:@selector(compare:)];
     
-    request.HTTPMethod = @"HEAD";
+    NSMutableArray <StoreItem *> *storeItems =
+    [NSMutableArray
+     arrayWithCapacity:identifiers.count];
     
-    NSHTTPURLResponse *response = nil;
-    NSError *error = nil;
+    for (NSString *identifier in identifiers)
+        [storeItems
+         addObject:[Store
+                    storeItemWithIdentifier:identifier]];
     
-    [NSURLConnection
-     sendSynchronousRequest:request
-     returningResponse:&response
-     error:&error];
+    for (StoreItem *storeItem in storeItems)
+        [storeItem lockConsumable];
     
-    if (error)
+    BOOL isEnough = YES;
+    
+    if (spend)
+        for (NSUInteger index = 0; index < identifiers.count; index ++)
+            if (storeItems[index].consumableAvailableCountLocked < counts[identifiers[index]].integerValue)
+                isEnough = NO;
+    
+    NSMutableArray <NSNumber *> *changes =
+    [NSMutableArray
+     arrayWithCapacity:identifiers.count];
+    
+    for (NSUInteger index = 0; index < identifiers.count; index ++)
     {
-        [StoreItem
-         addErrorLog:[NSString
-                      stringWithFormat:@"Error: %@",
-                      error.localizedDescription]];
+        NSInteger count =
+        MAX(counts[identifiers[index]].integerValue, 0);
         
-        return
-        nil;
+        [changes
+         addObject:@(isEnough ? [storeItems[index]
+                                 applyConsumableDelta:spend ? -count : count] : StoreBalanceChangeNone)];
     }
     
-    else if([response
-             respondsToSelector:@selector(allHeaderFields)])
+    for (StoreItem *storeItem in storeItems)
+        [storeItem unlockConsumable];
+    
+    for (NSUInteger index = 0; index < identifiers.count; index ++)
+        [storeItems[index]
+         didChangeConsumable:(StoreBalanceChange)changes[index].intValue];
+    
+    return
+    isEnough;
+}
+
+-(void)scheduleConsumableFlushForStoreItem:(StoreItem *)storeItem
+{
+    @synchronized (self.consumableDirtyItems)
     {
-        NSDictionary *headerFields =
-        response.allHeaderFields;
-        
-        NSString *lastModification =
-        headerFields[@"Last-Modified"];
+        [self.consumableDirtyItems
+         addObject:storeItem];
         
-        NSDateFormatter *formatter =
-        NSDateFormatter.new;
-        
-        formatter.dateFormat =
-        @"EEE, dd MMM yyyy HH:mm:ss zzz";
+        if (self.isConsumableFlushScheduled)
+            return;
         
-        return
-        [formatter
-         dateFromString:lastModification];
+        self.isConsumableFlushScheduled = YES;
     }
     
-    return nil;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(STORE_CONSUMABLE_FLUSH_INTERVAL * NSEC_PER_SEC)), dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^(void)
+    {
+        [self
+         flushConsumables];
+    });
 }
 
-+(void)setupWithSharedSecret:(NSString              *)sharedSecret
-                  storeItems:(NSArray <StoreItem *> *)storeItems
-                  completion:(RestoreCompletion      )completion;
+// Отложенная запись балансов одноразовых покупок одним commit
+-(void)flushConsumables
 {
-    Store.current.sharedSecret = sharedSecret;
-    Store.current.storeItems   = storeItems;
+    NSArray <StoreItem *> *storeItems;
     
-    [Store.current
-     restoreProductsCompletion:completion];
+    @synchronized (self.consumableDirtyItems)
+    {
+        storeItems =
+        self.consumableDirtyItems.allObjects;
+        
+        [self.consumableDirtyItems
+         removeAllObjects];
+        
+        self.isConsumableFlushScheduled = NO;
+    }
+    
+    if (storeItems.count == 0)
+        return;
+    
+    for (StoreItem *storeItem in storeItems)
+        [storeItem
+         persistConsumableBalance];
+    
+    [StoreState.current
+     commit];
 }
 
-+(void)checkRawReceipt:(RawRecieptHandler)rawRecieptHandler
+// Изменения за один проход main run loop рассылаются одним STORE_MANAGER_CHANGED
+// и одной пачкой StoreChange подписчикам
+-(void)scheduleChangeNotificationForStoreItem:(StoreItem *)storeItem
 {
-    Store.current.rawRecieptHandler =
-    rawRecieptHandler;
+    [self
+     scheduleChange:0
+     forStoreItem:storeItem
+     oldValue:nil];
 }
 
-+(void)restoreWithCompletion:(RestoreCompletion)completion
+-(void)scheduleChange:(StoreChangeKind)kind
+         forStoreItem:(StoreItem     *)storeItem
+             oldValue:(id             )oldValue
 {
-    [Store.current
-     restoreProductsFullCompletion:completion];
+    if (storeItem.identifier == nil)
+        return;
+    
+    @synchronized (self.changedStoreItems)
+    {
+        [self.changedStoreItems
+         addObject:storeItem];
+        
+        if (kind)
+        {
+            NSMutableDictionary <NSNumber *, id> *oldValues =
+            self.changedValues[storeItem.identifier];
+            
+            if (oldValues == nil)
+                self.changedValues[storeItem.identifier] =
+                oldValues =
+                NSMutableDictionary.new;
+            
+            if (oldValues[@(kind)] == nil)
+                oldValues[@(kind)] =
+                oldValue ?: NSNull.null;
+        }
+        
+        if (self.isChangeNotificationScheduled)
+            return;
+        
+        self.isChangeNotificationScheduled = YES;
+    }
+    
+    dispatch_async(dispatch_get_main_queue(), ^(void)
+    {
+        [self
+         postChangeNotification];
+    });
 }
 
-+(StoreItem *)storeItemWithIdentifier:(NSString *)identifier
+-(void)postChangeNotification
 {
-    NSArray *storeItems =
-    Store.storeItems;
+    NSArray <StoreItem *> *storeItems;
+    
+    NSDictionary <NSString *, NSDictionary <NSNumber *, id> *> *changedValues;
+    
+    @synchronized (self.changedStoreItems)
+    {
+        storeItems =
+        self.changedStoreItems.allObjects;
+        
+        changedValues =
+        self.changedValues.copy;
+        
+        [self.changedStoreItems
+         removeAllObjects];
+        
+        [self.changedValues
+         removeAllObjects];
+        
+        self.isChangeNotificationScheduled = NO;
+    }
+    
+    NSMutableSet <NSString *> *identifiers =
+    NSMutableSet.new;
+    
+    NSMutableArray <StoreChange *> *changes =
+    NSMutableArray.new;
     
     for (StoreItem *storeItem in storeItems)
-        if ([storeItem.identifier isEqualToString:identifier])
-            return storeItem;
+    {
+        NSMutableDictionary <NSNumber *, id> *oldValues =
+        [changedValues[storeItem.identifier] mutableCopy] ?: NSMutableDictionary.new;
+        
+        NSNumber *balance =
+        [storeItem
+         clearConsumableNotifyPending];
+        
+        if (balance && oldValues[@(StoreChangeKindBalance)] == nil)
+            oldValues[@(StoreChangeKindBalance)] =
+            balance;
+        
+        [identifiers
+         addObject:storeItem.identifier];
+        
+        StoreChange *change =
+        [StoreChange.alloc
+         initWithStoreItem:storeItem
+         oldValues:oldValues];
+        
+        if (change)
+            [changes
+             addObject:change];
+    }
     
-    StoreItem *storeItem =
-    StoreItem.new;
+    // Для совместимости, без подробностей
+    [NSNotificationCenter.defaultCenter
+     postNotificationName:STORE_MANAGER_CHANGED
+     object:nil
+     userInfo:@{STORE_CHANGED_IDENTIFIERS:identifiers.copy}];
     
-    storeItem.identifier = identifier;
+    if (changes.count == 0)
+        return;
     
-    return
-    storeItem;
+    NSArray <StoreChangeSubscription *> *subscriptions;
+    
+    @synchronized (self.changeSubscriptions)
+    {
+        subscriptions =
+        self.changeSubscriptions.copy;
+    }
+    
+    for (StoreChangeSubscription *subscription in subscriptions)
+    {
+        NSArray <StoreChange *> *filtered =
+        [subscription
+         filteredChanges:changes];
+        
+        if (filtered.count == 0)
+            continue;
+        
+        StoreChangesHandler handler =
+        subscription.handler;
+        
+        dispatch_async(subscription.queue, ^(void)
+        {
+            handler(filtered);
+        });
+    }
 }
 
-+(BOOL)isReady
++(id)subscribeToChangesWithIdentifiers:(NSSet <NSString *> *)identifiers
+                                 types:(NSSet <NSNumber *> *)types
+                                 kinds:(StoreChangeKind     )kinds
+                                 queue:(dispatch_queue_t    )queue
+                               handler:(StoreChangesHandler )handler
 {
-    return
-    (Store.current.isSetupComplete &&
-     Store.current.products.count &&
-     !Store.current.isRestoring &&
-     !Store.current.isSetupProgress);
+    if (handler == nil)
+        return nil;
+    
+    StoreChangeSubscription *subscription =
+    StoreChangeSubscription.new;
+    
+    subscription.identifiers = identifiers.copy;
+    subscription.types       = types.copy;
+    subscription.kinds       = kinds;
+    subscription.queue       = queue ?: dispatch_get_main_queue();
+    subscription.handler     = handler;
+    
+    @synchronized (Store.current.changeSubscriptions)
+    {
+        [Store.current.changeSubscriptions
+         addObject:subscription];
+    }
+    
+    return subscription;
 }
 
-+(BOOL)isSandbox
++(void)unsubscribeFromChanges:(id)subscription
 {
-    return
-    Store.current.isSandbox;
+    if (subscription == nil)
+        return;
+    
+    @synchronized (Store.current.changeSubscriptions)
+    {
+        [Store.current.changeSubscriptions
+         removeObjectIdenticalTo:subscription];
+    }
 }
 
-+(NSArray<StoreItem *> *)storeItemsAll
+#pragma mark - Network
+
++(void)setTransport:(id <StoreTransport>)transport
 {
-    NSSortDescriptor *sortDescriptorType =
-    [NSSortDescriptor.alloc
-     initWithKey:@"type"
-     ascending:YES];
+    [Store.current.transport
+     cancelAllRequests];
     
-    NSSortDescriptor *sortDescriptorPrice =
-    [NSSortDescriptor.alloc
-     initWithKey:@"priceNumber"
-     ascending:YES];
-    
-    return
-    [Store.current.storeItems
-     sortedArrayUsingDescriptors:@[sortDescriptorType, sortDescriptorPrice]];
+    Store.current.transport =
+    transport ?: StoreURLSessionTransport.new;
 }
 
-+(NSArray<StoreItem *> *)storeItems
+// Одинаковые запросы (метод, URL, тело) объединяются в один, ответ получают все.
+// По истечении timeoutInterval запрос завершается с NSURLErrorTimedOut,
+// даже если транспорт так и не ответил
+-(void)sendRequest:(NSURLRequest            *)request
+        completion:(StoreTransportCompletion )completion
 {
-    NSSortDescriptor *sortDescriptorType =
-    [NSSortDescriptor.alloc
-     initWithKey:@"type"
-     ascending:YES];
-    
-    NSSortDescriptor *sortDescriptorPrice =
-    [NSSortDescriptor.alloc
-     initWithKey:@"priceNumber"
-     ascending:YES];
+    NSArray *key =
+    @[request.HTTPMethod ?: @"GET",
+      request.URL.absoluteString ?: @"",
+      request.HTTPBody ?: NSData.data];
     
-    NSArray *items =
-    [Store.current.storeItems
-     sortedArrayUsingDescriptors:@[sortDescriptorType,
-                                   sortDescriptorPrice]];
+    NSMutableArray <StoreTransportCompletion> *completions;
     
-    NSMutableArray *mItems =
-    items.mutableCopy;
-    
-    for (StoreItem *item in items)
-        if (item.isInvalid)
-            [mItems
-             removeObject:item];
+    @synchronized (self.inFlightRequests)
+    {
+        completions =
+        self.inFlightRequests[key];
         
-    return
-    mItems.copy;
-}
-
-+(NSArray<StoreItem *> *)storeItemsPurchased
-{
-    NSMutableArray *storeItems =
-    NSMutableArray.new;
+        if (completions)
+        {
+            [completions
+             addObject:completion];
+            
+            StoreInfoLog(@"[INFO] Store: Request joined to in-flight %@ %@",
+                         key[0],
+                         request.URL);
+            
+            return;
+        }
+        
+        completions =
+        [NSMutableArray
+         arrayWithObject:completion];
+        
+        self.inFlightRequests[key] =
+        completions;
+    }
     
-    for (StoreItem *storeItem in self.storeItems)
-        if (storeItem.isPurchased == YES)
-            [storeItems
-             addObject:storeItem];
+    // Срабатывает один раз: ответ транспорта, таймаут или отмена
+    StoreTransportCompletion finish =
+    ^(NSData *data, NSHTTPURLResponse *response, NSError *error)
+    {
+        NSArray <StoreTransportCompletion> *pending;
         
-    return
-    storeItems.copy;
-}
-
-+(NSArray <StoreItem *> *)storeItemsWithType:(StoreItemType)type
-{
-    NSMutableArray *storeItems =
-    NSMutableArray.new;
+        @synchronized (self.inFlightRequests)
+        {
+            if (self.inFlightRequests[key] == completions)
+                [self.inFlightRequests
+                 removeObjectForKey:key];
+            
+            pending =
+            completions.copy;
+            
+            [completions
+             removeAllObjects];
+        }
+        
+        for (StoreTransportCompletion completion in pending)
+            completion(data, response, error);
+    };
     
-    for (StoreItem *storeItem in Store.current.storeItems)
-        if (storeItem.type == type &&
-            storeItem.title.length)
-            [storeItems
-             addObject:storeItem];
+    id <StoreTransport> transport =
+    self.transport;
     
-    NSSortDescriptor *sortDescriptor =
-    [NSSortDescriptor.alloc
-     initWithKey:@"priceNumber"
-     ascending:YES];
+    if (request.timeoutInterval > 0)
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(request.timeoutInterval * NSEC_PER_SEC)),
+                       dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^(void)
+        {
+            BOOL isPending;
+            
+            @synchronized (self.inFlightRequests)
+            {
+                isPending =
+                completions.count > 0;
+            }
+            
+            if (isPending == NO)
+                return;
+            
+            finish(nil, nil, [NSError
+                              errorWithDomain:NSURLErrorDomain
+                              code:NSURLErrorTimedOut
+                              userInfo:@{NSLocalizedDescriptionKey:@"Request timed out."}]);
+            
+            // Иначе запрос так и висит в транспорте, его ответ уже никому не нужен
+            if ([transport
+                 respondsToSelector:@selector(cancelRequest:)])
+                [transport
+                 cancelRequest:request];
+        });
     
-    return
-    [storeItems
-     sortedArrayUsingDescriptors:@[sortDescriptor]];
+    [transport
+     sendRequest:request
+     completion:finish];
 }
 
-+(NSArray <StoreItem *> *)storeItemsPurchasedWithType:(StoreItemType)type
+// Завершает все ожидающие запросы с NSURLErrorCancelled
+-(void)cancelRequests
 {
-    NSMutableArray *storeItems =
-    NSMutableArray.new;
+    NSArray <NSMutableArray <StoreTransportCompletion> *> *requests;
     
-    for (StoreItem *storeItem in Store.current.storeItems)
-        if (storeItem.type        == type &&
-            storeItem.isPurchased == YES)
-            [storeItems
-             addObject:storeItem];
+    @synchronized (self.inFlightRequests)
+    {
+        requests =
+        self.inFlightRequests.allValues;
+        
+        [self.inFlightRequests
+         removeAllObjects];
+    }
     
-    NSSortDescriptor *sortDescriptor =
-    [NSSortDescriptor.alloc
-     initWithKey:@"priceNumber"
-     ascending:YES];
+    [self.transport
+     cancelAllRequests];
     
-    return
-    [storeItems
-     sortedArrayUsingDescriptors:@[sortDescriptor]];
+    NSError *error =
+    [NSError
+     errorWithDomain:NSURLErrorDomain
+     code:NSURLErrorCancelled
+     userInfo:@{NSLocalizedDescriptionKey:@"Request cancelled."}];
+    
+    for (NSMutableArray <StoreTransportCompletion> *completions in requests)
+    {
+        NSArray <StoreTransportCompletion> *pending;
+        
+        @synchronized (self.inFlightRequests)
+        {
+            pending =
+            completions.copy;
+            
+            [completions
+             removeAllObjects];
+        }
+        
+        for (StoreTransportCompletion completion in pending)
+            completion(nil, nil, error);
+    }
 }
 
-+(NSDate *)firstInstallDate
-{
-    return
-    Store.current.purchasedDate;
-}
+#pragma mark - Metrics
 
-+(NSString *)firstInstallAppVersion
++(void)setMetricsEnabled:(BOOL)metricsEnabled
 {
-    return
-    Store.current.purchasedVersion;
+    StoreMetricsEnabled =
+    metricsEnabled;
 }
 
-+(BOOL)firstInstallDateIsOlderDate:(NSDate *)date
++(NSDictionary <NSString *, id> *)metrics
 {
     return
-    [Store.current purchasedDateIsOlderDate:date];
+    StoreMetrics.current.snapshot;
 }
 
-+(BOOL)firstInstallIsOlderVersion:(NSString *)version
++(void)resetMetrics
 {
-    return
-    [Store.current purchasedVersionIsOlderVersion:version];
+    [StoreMetrics.current
+     reset];
 }
 
-#pragma mark - Store Manager Init zone
-
--(instancetype)init
++(void)setMetricsHandler:(StoreMetricsHandler)handler
+                interval:(NSTimeInterval     )interval
 {
-    if (self = [super init])
+    StoreMetrics *metrics =
+    StoreMetrics.current;
+    
+    @synchronized (metrics)
     {
-        self.restoreCompletions =
-        NSMutableArray.new;
+        if (metrics.timer)
+            dispatch_source_cancel(metrics.timer);
         
-        self.restoreFullCompletions =
-        NSMutableArray.new;
+        metrics.timer = nil;
         
-        self.restoreQueue =
-        SKPaymentQueue.new;
+        if (handler == nil || interval <= 0)
+            return;
         
-        [self.restoreQueue
-         addTransactionObserver:self];
-                
-        [NSNotificationCenter.defaultCenter
-         addObserver:self
-         selector:@selector(willEnterForegroundNotification)
-         name:UIApplicationWillEnterForegroundNotification
-         object:nil];
+        metrics.timer =
+        dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
         
-        if (@available(iOS 13.0, *))
-            [NSNotificationCenter.defaultCenter
-             addObserver:self
-             selector:@selector(willEnterForegroundNotification)
-             name:UISceneWillEnterForegroundNotification
-             object:nil];
+        dispatch_source_set_timer(metrics.timer,
+                                  dispatch_time(DISPATCH_TIME_NOW, (int64_t)(interval * NSEC_PER_SEC)),
+                                  (uint64_t)(interval * NSEC_PER_SEC),
+                                  (uint64_t)(interval * NSEC_PER_SEC / 10));
         
-        [Store
-         removeFileLog];
+        dispatch_source_set_event_handler(metrics.timer, ^(void)
+        {
+            handler(metrics.snapshot);
+        });
+        
+        dispatch_resume(metrics.timer);
     }
-    
-    return
-    self;
 }
 
--(BOOL)isSetupComplete
+#pragma mark - Refresh
+
++(NSDate *)nextRefreshDate
 {
     return
-    ((Store.current.sharedSecret || Store.current.rawRecieptHandler) &&
-     Store.current.storeItems.count);
+    Store.current.nextRefreshDate;
 }
 
--(void)willEnterForegroundNotification
++(void)refresh
+{
+    dispatch_async(dispatch_get_main_queue(), ^(void)
+    {
+        [Store.current
+         performRefresh];
+    });
+}
+
+-(void)refreshIfNeeded
+{
+    if (self.nextRefreshDate &&
+        self.nextRefreshDate.timeIntervalSinceNow > 0)
+    {
+        StoreInfoLog(@"[INFO] Store: Refresh skipped, next at %@",
+                     self.nextRefreshDate);
+        
+        return;
+    }
+    
+    [self
+     performRefresh];
+}
+
+-(void)performRefresh
 {
+    [NSObject
+     cancelPreviousPerformRequestsWithTarget:self
+     selector:@selector(refreshIfNeeded)
+     object:nil];
+    
     [StoreItem
-     addInfoLog:@"[INFO] Store: Application will enter foreground"];
+     addInfoLog:@"[INFO] Store: Refresh"];
     
     if (self.url)
         [Store
@@ -1846,55 +4554,86 @@ updatedTransactions:(NSArray        *)transactions
          restoreProductsCompletion:nil];
 }
 
--(void)returnFullCompletionsWithError:(NSError *)error
+// Итог очередной проверки, по нему планируется следующая
+-(void)didRefreshWithError:(NSError *)error
 {
-    self.isRestoringFull =
-    NO;
-
-    if (error)
-        [StoreItem
-         addErrorLog:error.description];
-    
-    for (RestoreCompletion restoreCompletion in self.restoreFullCompletions)
-        dispatch_async(dispatch_get_main_queue(), ^(void)
-        {
-            restoreCompletion(error);
-        });
-    
-    [self.restoreFullCompletions
-     removeAllObjects];
-    
     dispatch_async(dispatch_get_main_queue(), ^(void)
     {
-        [NSNotificationCenter.defaultCenter
-         postNotificationName:STORE_MANAGER_CHANGED
-         object:error];
+        // Отмена при уходе в фон не ошибка, проверим при следующем входе
+        if ([error.domain isEqualToString:NSURLErrorDomain] &&
+            error.code == NSURLErrorCancelled)
+            return;
+        
+        if (error)
+            self.refreshFailures ++;
+        
+        else
+        {
+            self.refreshFailures = 0;
+            
+            self.lastRefreshDate =
+            NSDate.date;
+        }
+        
+        [self
+         planRefresh];
     });
 }
 
--(void)returnCompletionsWithError:(NSError *)error
+// Ближайшее из: возраст конфига и чека, окончание подписки, повтор после ошибки
+-(void)planRefresh
 {
-    self.isRestoring = NO;
+    NSTimeInterval now =
+    NSDate.date.timeIntervalSince1970;
     
-    if (error)
-        [StoreItem
-         addErrorLog:error.description];
+    NSDate *lastRefreshDate =
+    self.lastRefreshDate ?: [StoreState.current
+                             objectForKey:STORE_UPDATE];
     
-    for (RestoreCompletion restoreCompletion in self.restoreCompletions)
-        dispatch_async(dispatch_get_main_queue(), ^(void)
-        {
-            restoreCompletion(error);
-        });
+    NSTimeInterval next =
+    (lastRefreshDate ? lastRefreshDate.timeIntervalSince1970 : now) + STORE_REFRESH_INTERVAL;
     
-    [self.restoreCompletions
-     removeAllObjects];
+    for (NSNumber *expiration in self.currentEntitlements.expirations.allValues)
+        if (expiration.doubleValue > now)
+            next =
+            MIN(next, expiration.doubleValue + 1.);
     
-    dispatch_async(dispatch_get_main_queue(), ^(void)
+    if (self.refreshFailures)
     {
-        [NSNotificationCenter.defaultCenter
-         postNotificationName:STORE_MANAGER_CHANGED
-         object:error];
-    });
+        NSTimeInterval backoff =
+        MIN(STORE_REFRESH_BACKOFF_MIN * pow(2., MIN(self.refreshFailures - 1, 16)),
+            STORE_REFRESH_BACKOFF_MAX);
+        
+        // Половина задержки случайна, чтобы клиенты не повторяли хором
+        backoff *=
+        .5 + arc4random_uniform(1001) / 2000.;
+        
+        // lastRefreshDate после ошибки не сдвигается, плановое время может быть уже в прошлом
+        next =
+        now + backoff;
+    }
+    
+    else
+        next =
+        MAX(next, now);
+    
+    self.nextRefreshDate =
+    [NSDate
+     dateWithTimeIntervalSince1970:next];
+    
+    StoreInfoLog(@"[INFO] Store: Next refresh at %@ (failures %lu)",
+                 self.nextRefreshDate,
+                 (unsigned long)self.refreshFailures);
+    
+    [NSObject
+     cancelPreviousPerformRequestsWithTarget:self
+     selector:@selector(refreshIfNeeded)
+     object:nil];
+    
+    [self
+     performSelector:@selector(refreshIfNeeded)
+     withObject:nil
+     afterDelay:MAX(next - now, 0.)];
 }
 
 #pragma mark - Product Restore
@@ -1927,6 +4666,8 @@ updatedTransactions:(NSArray        *)transactions
     
     self.isRestoringFull =
     YES;
+    
+    StoreMetricsBegin(StoreMetricsPhaseRestore);
 
     // Убираем все параллельные восстановления
     [self.restoreCompletions
@@ -1944,12 +4685,14 @@ updatedTransactions:(NSArray        *)transactions
          addObject:s.identifier];
     
     self.productsRequest =
-    [SKProductsRequest.alloc
-     initWithProductIdentifiers:productIdentifiers];
+    [self
+     productsRequestWithIdentifiers:productIdentifiers];
     
     self.productsRequest.delegate =
     self;
     
+    StoreMetricsBegin(StoreMetricsPhaseProducts);
+    
     [self.productsRequest
      start];
 }
@@ -1985,6 +4728,8 @@ updatedTransactions:(NSArray        *)transactions
     
     self.isRestoring = YES;
     
+    StoreMetricsBegin(StoreMetricsPhaseRestore);
+    
     NSMutableSet <NSString *> *productIdentifiers =
     NSMutableSet.new;
     
@@ -2002,38 +4747,156 @@ updatedTransactions:(NSArray        *)transactions
         NSMutableArray.new;
 
         for (SKProduct *product in self.products)
-            for (NSString *identifier in productIdentifiers)
-                if ([product.productIdentifier
-                     isEqualToString:identifier])
-                    [searched
-                     addObject:identifier];
+            if ([productIdentifiers
+                 containsObject:product.productIdentifier])
+                [searched
+                 addObject:product.productIdentifier];
 
         if (searched.count == self.storeItems.count)
         {
+            NSDictionary <NSString *, StoreItem *> *storeItems =
+            self.currentCatalog.storeItemsByIdentifier;
+            
             for (SKProduct *product in self.products)
-                for (StoreItem *s in self.storeItems)
-                    if ([s.identifier
-                         isEqualToString:product.productIdentifier])
-                        s.product =
-                        product;
+                storeItems[product.productIdentifier].product =
+                product;
 
+            [self
+             rebuildEntitlements];
+            
             return
             [self
              refreshReceipt];
         }
 
-        self.products = nil;
-    }
+        self.products = nil;
+    }
+    
+    self.productsRequest =
+    [self
+     productsRequestWithIdentifiers:productIdentifiers];
+
+    self.productsRequest.delegate =
+    self;
+    
+    StoreMetricsBegin(StoreMetricsPhaseProducts);
+
+    [self.productsRequest
+     start];
+}
+
+#pragma mark - Catalog Snapshot
+
+-(NSString *)catalogSnapshotPath
+{
+    return
+    [StoreState.current.directory
+     stringByAppendingPathComponent:STORE_CATALOG_FILE];
+}
+
+// Синхронно: файл маленький, а поля нужны до первого кадра пейвола
+-(void)loadCatalogSnapshot
+{
+    NSDictionary <NSString *, NSDictionary *> *catalogSnapshot =
+    self.catalogSnapshot;
+    
+    if (catalogSnapshot == nil)
+    {
+        NSData *data =
+        [NSData
+         dataWithContentsOfFile:self.catalogSnapshotPath];
+        
+        NSDictionary *snapshot =
+        data ? [NSPropertyListSerialization
+                propertyListWithData:data
+                options:NSPropertyListImmutable
+                format:nil
+                error:nil] : nil;
+        
+        self.catalogSnapshot =
+        catalogSnapshot =
+        [snapshot isKindOfClass:NSDictionary.class] ? snapshot : @{};
+    }
+    
+    NSDictionary <NSString *, StoreItem *> *storeItems =
+    self.currentCatalog.storeItemsByIdentifier;
+    
+    BOOL isLoaded = NO;
+    
+    for (NSString *identifier in catalogSnapshot)
+    {
+        NSDictionary *productInfo =
+        catalogSnapshot[identifier];
+        
+        StoreItem *storeItem =
+        storeItems[identifier];
+        
+        // Уже заполненные из App Store и отклоненные App Store не трогаем
+        if (storeItem == nil ||
+            storeItem.isInvalid ||
+            storeItem.productInfo ||
+            [StoreItem isValidProductInfo:productInfo] == NO)
+            continue;
+        
+        [storeItem
+         applyProductInfo:productInfo];
+        
+        [self
+         scheduleChange:StoreChangeKindPrice
+         forStoreItem:storeItem
+         oldValue:nil];
+        
+        isLoaded = YES;
+    }
+    
+    if (isLoaded && self.products.count == 0)
+        self.isCatalogStale = YES;
+}
+
+-(void)saveCatalogSnapshot
+{
+    NSMutableDictionary <NSString *, NSDictionary *> *snapshot =
+    NSMutableDictionary.new;
+    
+    // Только подтвержденные App Store, invalid выпадают из снимка
+    for (StoreItem *storeItem in self.currentCatalog.storeItemsAll)
+        if (storeItem.product && storeItem.productInfo)
+            snapshot[storeItem.identifier] =
+            storeItem.productInfo;
+    
+    if ([self.catalogSnapshot
+         isEqualToDictionary:snapshot])
+        return;
+    
+    self.catalogSnapshot =
+    snapshot;
+    
+    NSData *data =
+    [NSPropertyListSerialization
+     dataWithPropertyList:snapshot
+     format:NSPropertyListBinaryFormat_v1_0
+     options:0
+     error:nil];
+    
+    NSString *path =
+    self.catalogSnapshotPath;
+    
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^(void)
+    {
+        [data
+         writeToFile:path
+         atomically:YES];
+    });
+}
+
+-(SKProductsRequest *)productsRequestWithIdentifiers:(NSSet <NSString *> *)productIdentifiers
+{
+    Class productsRequestClass =
+    self.productsRequestClass ?: SKProductsRequest.class;
     
-    self.productsRequest =
-    [SKProductsRequest.alloc
+    return
+    [[productsRequestClass alloc]
      initWithProductIdentifiers:productIdentifiers];
-
-    self.productsRequest.delegate =
-    self;
-
-    [self.productsRequest
-     start];
 }
 
 #pragma mark - Product Restore Delegate
@@ -2041,36 +4904,59 @@ updatedTransactions:(NSArray        *)transactions
 -(void)productsRequest:(SKProductsRequest  *)request
     didReceiveResponse:(SKProductsResponse *)response
 {
+    StoreMetricsEnd(StoreMetricsPhaseProducts, nil);
+    
     [StoreItem
      addInfoLog:@"[INFO] Store: Product list loading finished"];
     
     if (response.invalidProductIdentifiers.count)
+        StoreErrorLog(@"[ERROR] Store: Ignore invalid identifiers: %@",
+                      response.invalidProductIdentifiers);
+
+    NSDictionary <NSString *, StoreItem *> *storeItems =
+    self.currentCatalog.storeItemsByIdentifier;
+    
+    for (NSString *invalidProductIdentifier in response.invalidProductIdentifiers)
     {
-        [StoreItem
-         addInfoLog:[NSString
-                     stringWithFormat:@"[ERROR] Store: Ignore invalid identifiers: %@",
-                     response.invalidProductIdentifiers]];
+        StoreItem *storeItem =
+        storeItems[invalidProductIdentifier];
         
-        for (NSString *invalidProductIdentifier in response.invalidProductIdentifiers)
-            for (StoreItem *s in self.storeItems)
-                if ([s.identifier
-                     isEqualToString:invalidProductIdentifier])
-                    s.isInvalid =
-                    YES;
+        storeItem.isInvalid =
+        YES;
+        
+        // Название и цена могли остаться из снимка, у отклоненной покупки их быть не должно
+        NSString *priceString =
+        storeItem.priceString;
+        
+        if ([storeItem
+             clearProductInfo])
+            [self
+             scheduleChange:StoreChangeKindPrice
+             forStoreItem:storeItem
+             oldValue:priceString];
     }
-
+    
     self.products =
     response.products;
     
+    // Меняются только покупки, у которых описание отличается от снимка
     for (SKProduct *product in self.products)
-        for (StoreItem *s in self.storeItems)
-            if ([s.identifier
-                 isEqualToString:product.productIdentifier])
-                s.product = product;
+        storeItems[product.productIdentifier].product =
+        product;
+    
+    self.isCatalogStale = NO;
+    
+    [self
+     saveCatalogSnapshot];
+    
+    [self
+     rebuildEntitlements];
     
     if (self.isRestoringFull)
     {
-        [self.restoreQueue
+        self.restoredTransactionsCount = 0;
+        
+        [self.paymentQueue
          restoreCompletedTransactions];
         
         return;
@@ -2080,79 +4966,188 @@ updatedTransactions:(NSArray        *)transactions
      refreshReceipt];
 }
 
--(void)paymentQueueRestoreCompletedTransactionsFinished:(SKPaymentQueue *)queue
+#pragma mark - Transaction Router
+
++(void)setPaymentQueue:(SKPaymentQueue *)paymentQueue
 {
-    if (queue.transactions.count == 0)
+    dispatch_async(dispatch_get_main_queue(), ^(void)
     {
-        NSError *transactionsError =
-        [NSError
-         errorWithDomain:@"Store"
-         code:-1
-         userInfo:@{NSLocalizedDescriptionKey:@"Restoration of purchases was successful, but no purchases were found."}];
+        [Store.current.paymentQueue
+         removeTransactionObserver:Store.current];
         
-        if (self.isRestoringFull)
-            [self
-             returnFullCompletionsWithError:transactionsError];
+        Store.current.paymentQueue =
+        paymentQueue ?: SKPaymentQueue.defaultQueue;
         
-        return;
+        [Store.current.paymentQueue
+         addTransactionObserver:Store.current];
+    });
+}
+
++(void)setProductsRequestClass:(Class)productsRequestClass
+{
+    if (productsRequestClass &&
+        [productsRequestClass isSubclassOfClass:SKProductsRequest.class] == NO)
+        [NSException
+         raise:@"Store"
+         format:@"%@ is not a subclass of SKProductsRequest",
+         NSStringFromClass(productsRequestClass)];
+    
+    Store.current.productsRequestClass =
+    productsRequestClass;
+}
+
++(void)setReceiptProvider:(StoreReceiptProvider)receiptProvider
+{
+    Store.current.receiptProvider =
+    receiptProvider;
+}
+
++(void)setStateDirectory:(NSString *)directory
+{
+    Store *store =
+    Store.current;
+    
+    // Отложенные балансы и изменения дописываются в старую папку
+    [store
+     flushConsumables];
+    
+    [StoreState.current
+     commit];
+    
+    [StoreState.current
+     switchToDirectory:directory ?: StoreState.defaultDirectory];
+    
+    // Балансы в памяти читались из старой папки
+    for (StoreItem *storeItem in store.storeItems)
+        [storeItem
+         resetConsumableBalance];
+    
+    @synchronized (store.internedStoreItems)
+    {
+        for (StoreItem *storeItem in store.internedStoreItems.allValues)
+            [storeItem
+             resetConsumableBalance];
     }
     
-//    NSMutableDictionary <NSString *, NSNumber *> *manualRestored =
-//    [[NSUserDefaults.standardUserDefaults
-//      objectForKey:MANUAL_RESTORED] mutableCopy];
-//
-//    if (manualRestored == nil)
-//        manualRestored =
-//        NSMutableDictionary.new;
-//
-//    NSNumber *timestamp =
-//    @(NSDate.new.timeIntervalSince1970);
+    store.isSandbox =
+    [[StoreState.current
+      objectForKey:STORE_SANDBOX] boolValue];
+    
+    store.sharedSecret =
+    [StoreState.current
+     objectForKey:STORE_SHAREDSECRET];
+    
+    store.lastRefreshDate = nil;
+    
+    // Конфиг, снимок каталога и покупки из новой папки, setStoreItems: сбросит каталог и entitlements
+    store.catalogSnapshot = nil;
     
-    for (SKPaymentTransaction *transaction in queue.transactions)
+    store.storeItems =
+    [Store
+     storeItemsParsedFromArray:[StoreState.current
+                                objectForKey:STORE_iTEMS]];
+    
+    [store
+     loadCatalogSnapshot];
+}
+
+// Каждая пачка приходит один раз: покупки находятся по идентификатору,
+// состояние пишется одним commit, транзакции закрываются вместе
+-(void)paymentQueue:(SKPaymentQueue                   *)queue
+updatedTransactions:(NSArray <SKPaymentTransaction *> *)transactions
+{
+    StoreInfoLog(@"[INFO] Store: Update transactions fired (%lu)",
+                 (unsigned long)transactions.count);
+    
+    NSDictionary <NSString *, StoreItem *> *storeItems =
+    self.currentCatalog.storeItemsByIdentifier;
+    
+    NSMutableArray <SKPaymentTransaction *> *finished =
+    NSMutableArray.new;
+    
+    NSMapTable <StoreItem *, NSError *> *results =
+    NSMapTable.strongToStrongObjectsMapTable;
+    
+    for (SKPaymentTransaction *transaction in transactions)
     {
+        NSString *identifier =
+        transaction.payment.productIdentifier;
+        
+        StoreItem *storeItem =
+        storeItems[identifier];
+        
+        StoreInfoLog(@"[INFO] Store: Transaction is [%@] state %ld",
+                     identifier,
+                     (long)transaction.transactionState);
+        
+        // Покупки еще нет в конфиге, транзакция не закрывается и разбирается
+        // повторно после setStoreItems:, иначе пришла бы только при следующем запуске.
+        // Неудачная ничего не меняет, ее нечего повторять, поэтому она закрывается сразу
+        if (storeItem == nil)
+        {
+            if (transaction.transactionState == SKPaymentTransactionStateFailed)
+            {
+                StoreErrorLog(@"[ERROR] Store: Transaction [%@] failed: %@",
+                              identifier,
+                              transaction.error);
+                
+                [queue
+                 finishTransaction:transaction];
+            }
+            
+            else if ((transaction.transactionState == SKPaymentTransactionStatePurchased ||
+                      transaction.transactionState == SKPaymentTransactionStateRestored) &&
+                     [self.pendingTransactions
+                      indexOfObjectIdenticalTo:transaction] == NSNotFound)
+            {
+                StoreInfoLog(@"[INFO] Store: Transaction [%@] is waiting for config",
+                             identifier);
+                
+                [self.pendingTransactions
+                 addObject:transaction];
+            }
+            
+            continue;
+        }
+        
+        [self.pendingTransactions
+         removeObjectIdenticalTo:transaction];
+        
         switch (transaction.transactionState)
         {
             case SKPaymentTransactionStateFailed:
+            {
+                StoreErrorLog(@"[ERROR] Store: %@",
+                              transaction.error);
+                
+                [results
+                 setObject:transaction.error ?: (id)NSNull.null
+                 forKey:storeItem];
+                
+                [finished
+                 addObject:transaction];
+                
                 break;
+            }
                 
             case SKPaymentTransactionStateRestored:
+            case SKPaymentTransactionStatePurchased:
             {
-                SKPaymentTransaction *originalTransaction =
-                transaction.originalTransaction;
-                
-                [StoreItem
-                 addInfoLog:[NSString
-                             stringWithFormat:@"[INFO] Store: restore found identifier %@",
-                             originalTransaction.payment.productIdentifier]];
-
-                
-                StoreItem *storeItem =
-                [Store
-                 storeItemWithIdentifier:originalTransaction.payment.productIdentifier];
+                if (transaction.transactionState == SKPaymentTransactionStateRestored)
+                    self.restoredTransactionsCount ++;
                 
                 [storeItem
-                 restoreWithTransaction:originalTransaction];
-                                
-//                if (storeItem.type == StoreItemTypeNonConsumable &&
-//                    storeItem.isPurchased)
-//                {
-//                    manualRestored[originalTransaction.payment.productIdentifier] =
-//                    timestamp;
-//
-//                    [StoreItem
-//                     addInfoLog:[NSString
-//                                 stringWithFormat:@"[INFO] Store: added manualRestored identifier %@",
-//                                 transaction.payment.productIdentifier]];
-//                }
+                 applyTransaction:transaction];
                 
-                [queue
-                 finishTransaction:transaction];
+                [results
+                 setObject:NSNull.null
+                 forKey:storeItem];
                 
-                break;
-            }
+                [finished
+                 addObject:transaction];
                 
-            case SKPaymentTransactionStatePurchased:
                 break;
+            }
                 
             case SKPaymentTransactionStatePurchasing:
             case SKPaymentTransactionStateDeferred:
@@ -2161,32 +5156,63 @@ updatedTransactions:(NSArray        *)transactions
         }
     }
     
-//    [NSUserDefaults.standardUserDefaults
-//     setObject:manualRestored.copy
-//     forKey:MANUAL_RESTORED];
-//
-//    [StoreItem
-//     addInfoLog:[NSString
-//                 stringWithFormat:@"[INFO] Store: manualRestored is %@",
-//                 manualRestored]];
-//
-//    [NSUserDefaults.standardUserDefaults
-//     synchronize];
+    if (finished.count == 0)
+        return;
     
-    if (self.isRestoringFull)
+    [StoreState.current
+     commit];
+    
+    [self
+     rebuildEntitlements];
+    
+    for (SKPaymentTransaction *transaction in finished)
+        [queue
+         finishTransaction:transaction];
+    
+    dispatch_async(dispatch_get_main_queue(), ^(void)
+    {
+        for (StoreItem *storeItem in results)
+        {
+            NSError *error =
+            [results objectForKey:storeItem];
+            
+            [storeItem
+             returnCompletionsWithError:[error isKindOfClass:NSError.class] ? error : nil];
+        }
+    });
+}
+
+-(void)paymentQueueRestoreCompletedTransactionsFinished:(SKPaymentQueue *)queue
+{
+    if (self.isRestoringFull == NO)
+        return;
+    
+    if (self.restoredTransactionsCount == 0)
+        [self
+         returnFullCompletionsWithError:[NSError
+                                         errorWithDomain:@"Store"
+                                         code:-1
+                                         userInfo:@{NSLocalizedDescriptionKey:@"Restoration of purchases was successful, but no purchases were found."}]];
+    
+    else
         [self
          returnFullCompletionsWithError:nil];
 }
 
+-(void)paymentQueue:(SKPaymentQueue *)queue
+restoreCompletedTransactionsFailedWithError:(NSError *)error
+{
+    if (self.isRestoringFull)
+        [self
+         returnFullCompletionsWithError:error];
+}
+
 -(void)refreshReceipt
 {
     [StoreItem
      addInfoLog:@"[INFO] Store: Check receipt..."];
     
-    if (![NSFileManager.defaultManager
-          fileExistsAtPath:NSBundle.mainBundle.appStoreReceiptURL.path] ||
-        ![NSData
-         dataWithContentsOfURL:NSBundle.mainBundle.appStoreReceiptURL])
+    if (self.receiptData.length == 0)
     {
         [StoreItem
          addInfoLog:@"[INFO] Store: Receipt not found, try refresh receipt..."];
@@ -2198,6 +5224,9 @@ updatedTransactions:(NSArray        *)transactions
         self.receiptRequest.delegate =
         self;
         
+        StoreMetricsCount(@"receipt.missing");
+        StoreMetricsBegin(StoreMetricsPhaseReceiptRefresh);
+        
         [self.receiptRequest
          start];
         
@@ -2217,18 +5246,21 @@ didFailWithError:(NSError   *)error
     if (![request
           isKindOfClass:SKReceiptRefreshRequest.class])
     {
+        StoreMetricsEnd(StoreMetricsPhaseProducts, error);
+        
         [self
          returnCompletionsWithError:error];
         
         return;
     }
     
+    StoreMetricsEnd(StoreMetricsPhaseReceiptRefresh, error);
+    
     [StoreItem
      addErrorLog:@"[ERROR] Store: Receipt refresh failed..."];
     
-    [StoreItem
-     addErrorLog:[NSString stringWithFormat:@"[ERROR] Store: %@",
-                  error.localizedDescription]];
+    StoreErrorLog(@"[ERROR] Store: %@",
+                  error.localizedDescription);
     
     [self
      returnCompletionsWithError:error];
@@ -2240,11 +5272,12 @@ didFailWithError:(NSError   *)error
           isKindOfClass:SKReceiptRefreshRequest.class])
         return;
     
+    StoreMetricsEnd(StoreMetricsPhaseReceiptRefresh, nil);
+    
     [StoreItem
      addInfoLog:@"[INFO] Store: Receipt refreshed..."];
     
-    if (![NSFileManager.defaultManager
-          fileExistsAtPath:NSBundle.mainBundle.appStoreReceiptURL.path])
+    if (self.receiptData.length == 0)
     {
         NSError *receiptError =
         [NSError
@@ -2252,10 +5285,8 @@ didFailWithError:(NSError   *)error
          code:-1
          userInfo:@{NSLocalizedDescriptionKey:@"Receipt is nil, checking products is failed."}];
         
-        [StoreItem
-         addErrorLog:[NSString
-                      stringWithFormat:@"[ERROR] Store: %@",
-                      receiptError.localizedDescription]];
+        StoreErrorLog(@"[ERROR] Store: %@",
+                      receiptError.localizedDescription);
         
         [self
          returnCompletionsWithError:receiptError];
@@ -2269,6 +5300,19 @@ didFailWithError:(NSError   *)error
 
 +(NSData *)receipt
 {
+    return
+    Store.current.receiptData;
+}
+
+-(NSData *)receiptData
+{
+    StoreReceiptProvider receiptProvider =
+    self.receiptProvider;
+    
+    if (receiptProvider)
+        return
+        receiptProvider();
+    
     return
     [NSData
      dataWithContentsOfURL:NSBundle.mainBundle.appStoreReceiptURL];
@@ -2286,56 +5330,193 @@ didFailWithError:(NSError   *)error
      addInfoLog:@"[INFO] Store: Try receipt encrypt..."];
     
     NSData *receipt =
-    [NSData
-     dataWithContentsOfURL:NSBundle.mainBundle.appStoreReceiptURL];
+    self.receiptData;
     
-    [StoreItem
-     addInfoLog:[NSString
-                 stringWithFormat:@"[INFO] Store: Receipt setup (receipt.length = %lu)",
-                 (unsigned long)receipt.length]];
+    StoreInfoLog(@"[INFO] Store: Receipt setup (receipt.length = %lu)",
+                 (unsigned long)receipt.length);
 
     BOOL sandbox =
     Store.current.isSandbox;
     
-    [StoreItem
-     addInfoLog:[NSString
-                 stringWithFormat:@"[INFO] Store: Receipt setup (sandbox = %@)",
-                 sandbox ? @"YES" : @"NO"]];
+    StoreInfoLog(@"[INFO] Store: Receipt setup (sandbox = %@)",
+                 sandbox ? @"YES" : @"NO");
+    
+    // If raw json getted from self server
+    if (self.rawRecieptHandler)
+    {
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(void)
+        {
+            NSDictionary *jsonResponse =
+            self.rawRecieptHandler(sandbox);
+            
+            if (jsonResponse)
+                Store.current.receiptJSON =
+                [NSJSONSerialization
+                 dataWithJSONObject:jsonResponse
+                 options:NSJSONWritingPrettyPrinted
+                 error:nil];
+            
+            if (jsonResponse == nil)
+            {
+                NSError *error =
+                [NSError
+                 errorWithDomain:@"Store"
+                 code:-1
+                 userInfo:@{NSLocalizedDescriptionKey:@"RawJSON is nil."}];
+                
+                StoreErrorLog(@"[ERROR] Store: %@",
+                              error.localizedDescription);
+                
+                [self
+                 returnCompletionsWithError:error];
+                
+                return;
+            }
+            
+            [self
+             parseRawJSON:jsonResponse];
+            
+            dispatch_async(dispatch_get_main_queue(), ^(void)
+            {
+                [StoreItem
+                 addInfoLog:@"[INFO] Store: Finish parsing reciept"];
+                
+                [self
+                 returnCompletionsWithError:nil];
+            });
+        });
+        
+        return;
+    }
+    
+    // Чек разбирается на устройстве, сервер Apple при необходимости подтверждает его в фоне
+    if (self.receiptVerification != StoreReceiptVerificationServer)
+    {
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(void)
+        {
+            NSDictionary *jsonResponse =
+            [Store
+             receiptJSONWithLocalReceipt:receipt];
+            
+            StoreMetricsCount(@"verify.local.%@", jsonResponse ? @"decoded" : @"failed");
+            
+            // Не разобрали, проверяем как обычно через сервер
+            if (jsonResponse == nil)
+            {
+                [StoreItem
+                 addErrorLog:@"[ERROR] Store: Local receipt decoding failed, verify on server"];
+                
+                dispatch_async(dispatch_get_main_queue(), ^(void)
+                {
+                    [self
+                     verifyReceipt:receipt
+                     sandbox:sandbox
+                     confirmation:NO];
+                });
+                
+                return;
+            }
+            
+            [self
+             parseRawJSON:jsonResponse];
+            
+            dispatch_async(dispatch_get_main_queue(), ^(void)
+            {
+                [StoreItem
+                 addInfoLog:@"[INFO] Store: Finish parsing local reciept"];
+                
+                [self
+                 returnCompletionsWithError:nil];
+                
+                if (self.receiptVerification == StoreReceiptVerificationLocalAndServer)
+                    [self
+                     verifyReceipt:receipt
+                     sandbox:sandbox
+                     confirmation:YES];
+            });
+        });
+        
+        return;
+    }
+    
+    [self
+     verifyReceipt:receipt
+     sandbox:sandbox
+     confirmation:NO];
+}
+
+// If raw json getted from apple server, from application
+// При подтверждении (confirmation) ожидающие completion уже вызваны, рассылается только STORE_MANAGER_CHANGED
+-(void)verifyReceipt:(NSData *)receipt
+             sandbox:(BOOL    )sandbox
+        confirmation:(BOOL    )confirmation
+{
+    // Чек не менялся и активные подписки не истекли, используем прошлый ответ сервера
+    NSString *receiptCacheKey =
+    [Store
+     receiptCacheKeyWithReceipt:receipt
+     sandbox:sandbox];
+    
+    NSDictionary *receiptCache =
+    [StoreState.current
+     objectForKey:STORE_RECEIPT_CACHE];
+    
+    BOOL isReceiptCacheHit =
+    receiptCacheKey &&
+    [receiptCache[@"key"] isEqualToString:receiptCacheKey] &&
+    [receiptCache[@"validUntil"] doubleValue] > NSDate.date.timeIntervalSince1970 * 1000.;
+    
+    @synchronized (self)
+    {
+        if (isReceiptCacheHit)
+            self.receiptCacheHits ++;
+        
+        else
+            self.receiptCacheMisses ++;
+    }
+    
+    StoreMetricsCount(@"verify.cache.%@", isReceiptCacheHit ? @"hit" : @"miss");
     
-    // If raw json getted from self server
-    if (self.rawRecieptHandler)
+    if (isReceiptCacheHit && confirmation)
+        return;
+    
+    if (isReceiptCacheHit)
     {
+        [StoreItem
+         addInfoLog:@"[INFO] Store: Receipt not changed, use cached verification"];
+        
         dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(void)
         {
-            NSDictionary *jsonResponse =
-            self.rawRecieptHandler(sandbox);
+            NSData *response =
+            [self
+             receiptCacheResponseWithKey:receiptCacheKey];
             
-            if (jsonResponse)
-                Store.current.receiptJSON =
-                [NSJSONSerialization
-                 dataWithJSONObject:jsonResponse
-                 options:NSJSONWritingPrettyPrinted
-                 error:nil];
+            NSDictionary *jsonResponse = response ?
+            [NSJSONSerialization
+             JSONObjectWithData:response
+             options:0
+             error:nil] : nil;
             
-            if (jsonResponse == nil)
+            // Файла нет или он от другого чека (сбой между записью файла и commit), проверяем заново
+            if ([jsonResponse isKindOfClass:NSDictionary.class] == NO)
             {
-                NSError *error =
-                [NSError
-                 errorWithDomain:@"Store"
-                 code:-1
-                 userInfo:@{NSLocalizedDescriptionKey:@"RawJSON is nil."}];
-                
-                [StoreItem
-                 addErrorLog:[NSString
-                              stringWithFormat:@"[ERROR] Store: %@",
-                              error.localizedDescription]];
+                [StoreState.current
+                 removeObjectForKey:STORE_RECEIPT_CACHE];
                 
-                [self
-                 returnCompletionsWithError:error];
+                dispatch_async(dispatch_get_main_queue(), ^(void)
+                {
+                    [self
+                     verifyReceipt:receipt
+                     sandbox:sandbox
+                     confirmation:confirmation];
+                });
                 
                 return;
             }
             
+            Store.current.receiptJSON =
+            response;
+            
             [self
              parseRawJSON:jsonResponse];
             
@@ -2352,8 +5533,6 @@ didFailWithError:(NSError   *)error
         return;
     }
     
-    // If raw json getted from apple server, from application
-    
     // create the JSON object that describes the request
     NSDictionary *requestContents =
     @{@"receipt-data":[receipt
@@ -2370,13 +5549,12 @@ didFailWithError:(NSError   *)error
     
     if (error || !requestData)
     {
-        [StoreItem
-         addErrorLog:[NSString
-                      stringWithFormat:@"[ERROR] Store: %@",
-                      error.localizedDescription]];
+        StoreErrorLog(@"[ERROR] Store: %@",
+                      error.localizedDescription);
         
         [self
-         returnCompletionsWithError:error];
+         finishVerificationWithError:error
+         confirmation:confirmation];
         
         return;
     }
@@ -2391,36 +5569,45 @@ didFailWithError:(NSError   *)error
         [NSURL
          URLWithString:@"https://sandbox.itunes.apple.com/verifyReceipt"];
     
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(void)
+    NSMutableURLRequest *storeRequest =
+    [NSMutableURLRequest
+     requestWithURL:storeURL
+     cachePolicy:NSURLRequestReloadIgnoringLocalCacheData
+     timeoutInterval:STORE_RECEIPT_TIMEOUT];
+    
+    storeRequest.HTTPMethod = @"POST";
+    storeRequest.HTTPBody   = requestData;
+    
+    StoreMetricsBytes(@"receipt", receipt.length);
+    StoreMetricsBytes(@"verifyRequest", requestData.length);
+    StoreMetricsBegin(StoreMetricsPhaseVerify);
+    
+    // Ответ приходит на фоновой очереди, разбор чека остается там же
+    [self
+     sendRequest:storeRequest
+     completion:^(NSData *resData, NSHTTPURLResponse *response, NSError *error)
     {
-        NSError *error = nil;
-        
-        NSMutableURLRequest *storeRequest =
-        [NSMutableURLRequest
-         requestWithURL:storeURL];
-        
-        storeRequest.HTTPMethod = @"POST";
-        storeRequest.HTTPBody   = requestData;
-        
-        NSURLResponse *response = nil;
+        if (error == nil && resData == nil)
+            error =
+            [NSError
+             errorWithDomain:@"Store"
+             code:-1
+             userInfo:@{NSLocalizedDescriptionKey:@"Receipt response is empty."}];
         
-        NSData *resData =
-        [self
-         sendSynchronousRequest:storeRequest
-         returningResponse:&response
-         error:&error];
+        StoreMetricsEnd(StoreMetricsPhaseVerify, error);
+        StoreMetricsCount(@"verify.http.%ld", (long)response.statusCode);
+        StoreMetricsBytes(@"verifyResponse", resData.length);
         
         if (error)
         {
             dispatch_async(dispatch_get_main_queue(), ^(void)
             {
-                [StoreItem
-                 addErrorLog:[NSString
-                              stringWithFormat:@"[ERROR] Store: %@",
-                              error.localizedDescription]];
+                StoreErrorLog(@"[ERROR] Store: %@",
+                              error.localizedDescription);
                 
                 [self
-                 returnCompletionsWithError:error];
+                 finishVerificationWithError:error
+                 confirmation:confirmation];
             });
             
             return;
@@ -2439,22 +5626,21 @@ didFailWithError:(NSError   *)error
         {
             dispatch_async(dispatch_get_main_queue(), ^(void)
             {
-                [StoreItem
-                 addErrorLog:[NSString
-                             stringWithFormat:@"[ERROR] Store: %@",
-                             error.localizedDescription]];
+                StoreErrorLog(@"[ERROR] Store: %@",
+                              error.localizedDescription);
                 
                 [self
-                 returnCompletionsWithError:error];
+                 finishVerificationWithError:error
+                 confirmation:confirmation];
             });
             
             return;
         }
         
-        [StoreItem
-         addInfoLog:[NSString
-                     stringWithFormat:@"[INFO] Store: jsonResponse:%@",
-                     jsonResponse]];
+        StoreInfoLog(@"[INFO] Store: jsonResponse:%@",
+                     jsonResponse);
+        
+        StoreMetricsCount(@"verify.status.%ld", (long)[jsonResponse[@"status"] integerValue]);
         
         /*
          {
@@ -2531,11 +5717,45 @@ didFailWithError:(NSError   *)error
         
         if ([jsonResponse[@"status"] integerValue] == 21007)
         {
+            StoreMetricsCount(@"verify.retry.21007");
+            
             Store.current.isSandbox = YES;
             
+            [StoreState.current
+             setObject:@YES
+             forKey:STORE_SANDBOX];
+            
+            [StoreState.current
+             commit];
+            
             // Resend receipt to sandbox with no error
             [self
-             encryptReceipt];
+             verifyReceipt:receipt
+             sandbox:Store.current.isSandbox
+             confirmation:confirmation];
+            
+            return;
+        }
+        
+        // Запомненное окружение устарело (например, вместо TestFlight сборка из App Store)
+        if ([jsonResponse[@"status"] integerValue] == 21008 &&
+            [StoreState.current
+             objectForKey:STORE_SANDBOX])
+        {
+            StoreMetricsCount(@"verify.retry.21008");
+            
+            Store.current.isSandbox = NO;
+            
+            [StoreState.current
+             removeObjectForKey:STORE_SANDBOX];
+            
+            [StoreState.current
+             commit];
+            
+            [self
+             verifyReceipt:receipt
+             sandbox:Store.current.isSandbox
+             confirmation:confirmation];
             
             return;
         }
@@ -2570,26 +5790,61 @@ didFailWithError:(NSError   *)error
              code:-1
              userInfo:@{NSLocalizedDescriptionKey:@"Bundle is incorrected."}];
         
+        // Локально разобранный чек не прошел проверку подлинности, отзываем выданные по нему покупки
+        // на той же очереди, что и обычный разбор
+        if (confirmation &&
+            ([jsonResponse[@"status"] integerValue] == 21003 ||
+             [jsonResponse[@"status"] integerValue] == 21010))
+        {
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(void)
+            {
+                [self
+                 revokeLocalReceipt:receipt];
+                
+                dispatch_async(dispatch_get_main_queue(), ^(void)
+                {
+                    StoreErrorLog(@"[ERROR] Store: %@",
+                                  receiptError.localizedDescription);
+                    
+                    [self
+                     finishVerificationWithError:receiptError
+                     confirmation:confirmation];
+                });
+            });
+            
+            return;
+        }
+        
         if (receiptError)
         {
             dispatch_async(dispatch_get_main_queue(), ^(void)
             {
-                [StoreItem
-                 addErrorLog:[NSString
-                             stringWithFormat:@"[ERROR] Store: %@",
-                              receiptError.localizedDescription]];
+                StoreErrorLog(@"[ERROR] Store: %@",
+                              receiptError.localizedDescription);
                 
                 [self
-                 returnCompletionsWithError:receiptError];
+                 finishVerificationWithError:receiptError
+                 confirmation:confirmation];
                 
-                [NSException
-                 raise:@"Store"
-                 format:@"%@", receiptError.localizedDescription];
+                if (confirmation == NO)
+                    [NSException
+                     raise:@"Store"
+                     format:@"%@", receiptError.localizedDescription];
             });
             
             return;
         }
         
+        // Файл пишется до ключа, ключ записывается вместе с результатом разбора, commit в parseRawJSON:
+        if (receiptCacheKey &&
+            [self
+             saveReceiptCacheResponse:resData
+             key:receiptCacheKey])
+            [StoreState.current
+             setObject:@{@"key":receiptCacheKey,
+                         @"validUntil":@([Store receiptCacheValidUntilWithJSON:jsonResponse])}
+             forKey:STORE_RECEIPT_CACHE];
+        
         [self
          parseRawJSON:jsonResponse];
                 
@@ -2599,63 +5854,310 @@ didFailWithError:(NSError   *)error
              addInfoLog:@"[INFO] Store: Finish parsing reciept"];
             
             [self
-             returnCompletionsWithError:nil];
+             finishVerificationWithError:nil
+             confirmation:confirmation];
         });
+    }];
+}
+
+-(void)finishVerificationWithError:(NSError *)error
+                      confirmation:(BOOL     )confirmation
+{
+    if (confirmation == NO)
+        return
+        [self
+         returnCompletionsWithError:error];
+    
+    if (error)
+        StoreErrorLog(@"[ERROR] Store: Receipt confirmation failed: %@",
+                      error.localizedDescription);
+    
+    else
+        [StoreItem
+         addInfoLog:@"[INFO] Store: Receipt confirmed by server"];
+    
+    dispatch_async(dispatch_get_main_queue(), ^(void)
+    {
+        [NSNotificationCenter.defaultCenter
+         postNotificationName:STORE_MANAGER_CHANGED
+         object:error];
     });
 }
 
+// Снимает только покупки из in_app локально разобранного чека. Версия и дата первой
+// установки остаются: без них пропали бы покупки по setAsPurchasedForRanges:
+-(void)revokeLocalReceipt:(NSData *)receipt
+{
+    NSDictionary <NSString *, StoreItem *> *storeItems =
+    self.currentCatalog.storeItemsByIdentifier;
+    
+    NSArray *receiptInApp =
+    [Store
+     receiptJSONWithLocalReceipt:receipt][@"receipt"][@"in_app"];
+    
+    for (NSDictionary *reciept in receiptInApp)
+    {
+        StoreItem *storeItem =
+        storeItems[reciept[@"product_id"]];
+        
+        // Как и в parseRawJSON:, балансы одноразовых покупок чек не выдает
+        if (storeItem == nil ||
+            storeItem.type == StoreItemTypeConsumable)
+            continue;
+        
+        StoreInfoLog(@"[INFO] Store: Revoke identifier %@ from unconfirmed receipt",
+                     storeItem.identifier);
+        
+        [StoreState.current
+         removeObjectForKey:storeItem.identifier];
+    }
+    
+    [StoreState.current
+     commit];
+    
+    [self
+     rebuildEntitlements];
+}
+
+// Содержимое чека с диска в том же виде, что отдает verifyReceipt, nil если не разобрать
++(NSDictionary *)receiptJSONWithLocalReceipt:(NSData *)receipt
+{
+    NSMutableArray <NSDictionary *> *inApp =
+    NSMutableArray.new;
+    
+    StoreReceiptInfo info;
+    
+    StoreReceiptResult result =
+    StoreReceiptDecode(receipt.bytes, receipt.length, &info, StoreReceiptAddPurchase, (__bridge void *)inApp);
+    
+    if (result != StoreReceiptResultOK)
+    {
+        StoreErrorLog(@"[ERROR] Store: Local receipt decoding result %d",
+                      (int)result);
+        
+        return nil;
+    }
+    
+    NSString *bundleId =
+    StoreReceiptStringValue(info.bundleId);
+    
+    if (![bundleId isEqualToString:NSBundle.mainBundle.bundleIdentifier])
+    {
+        StoreErrorLog(@"[ERROR] Store: Local receipt bundle is incorrected: %@",
+                      bundleId);
+        
+        return nil;
+    }
+    
+    NSMutableDictionary *receiptInfo =
+    NSMutableDictionary.new;
+    
+    receiptInfo[@"bundle_id"]                    = bundleId;
+    receiptInfo[@"application_version"]          = StoreReceiptStringValue(info.applicationVersion);
+    receiptInfo[@"original_application_version"] = StoreReceiptStringValue(info.originalApplicationVersion);
+    receiptInfo[@"original_purchase_date_ms"]    = StoreReceiptDateValue(info.originalPurchaseDateMs);
+    receiptInfo[@"receipt_creation_date_ms"]     = StoreReceiptDateValue(info.creationDateMs);
+    receiptInfo[@"request_date_ms"]              = StoreReceiptDateValue((int64_t)(NSDate.date.timeIntervalSince1970 * 1000.));
+    receiptInfo[@"in_app"]                       = inApp.copy;
+    
+    return
+    @{@"status":@0,
+      @"environment":@"Local",
+      @"receipt":receiptInfo.copy};
+}
+
+// SHA-256 чека с диска плюс окружение, в котором он проверялся
++(NSString *)receiptCacheKeyWithReceipt:(NSData *)receipt
+                                sandbox:(BOOL    )sandbox
+{
+    if (receipt.length == 0)
+        return nil;
+    
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    
+    CC_SHA256(receipt.bytes, (CC_LONG)receipt.length, digest);
+    
+    NSMutableString *key =
+    [NSMutableString
+     stringWithCapacity:CC_SHA256_DIGEST_LENGTH * 2 + 11];
+    
+    for (NSUInteger index = 0; index < CC_SHA256_DIGEST_LENGTH; index ++)
+        [key
+         appendFormat:@"%02x", digest[index]];
+    
+    [key
+     appendString:sandbox ? @":sandbox" : @":production"];
+    
+    return
+    key;
+}
+
+-(NSString *)receiptCachePath
+{
+    return
+    [StoreState.current.directory
+     stringByAppendingPathComponent:STORE_RECEIPT_FILE];
+}
+
+// Ответ сервера из файла, nil если файла нет или он записан для другого ключа
+-(NSData *)receiptCacheResponseWithKey:(NSString *)key
+{
+    NSData *data =
+    [NSData
+     dataWithContentsOfFile:self.receiptCachePath];
+    
+    NSDictionary *receiptCache = data ?
+    [NSPropertyListSerialization
+     propertyListWithData:data
+     options:NSPropertyListImmutable
+     format:nil
+     error:nil] : nil;
+    
+    if ([receiptCache isKindOfClass:NSDictionary.class] == NO ||
+        [receiptCache[@"key"] isEqual:key] == NO ||
+        [receiptCache[@"response"] isKindOfClass:NSData.class] == NO)
+        return nil;
+    
+    return
+    receiptCache[@"response"];
+}
+
+-(BOOL)saveReceiptCacheResponse:(NSData   *)response
+                            key:(NSString *)key
+{
+    NSData *data =
+    [NSPropertyListSerialization
+     dataWithPropertyList:@{@"key":key,
+                            @"response":response}
+     format:NSPropertyListBinaryFormat_v1_0
+     options:0
+     error:nil];
+    
+    return
+    [data
+     writeToFile:self.receiptCachePath
+     options:NSDataWritingAtomic
+     error:nil];
+}
+
+// Ближайшее окончание активной подписки в мс, но не позже STORE_RECEIPT_CACHE_MAX_AGE от текущего момента
++(double)receiptCacheValidUntilWithJSON:(NSDictionary *)jsonResponse
+{
+    double now =
+    NSDate.date.timeIntervalSince1970 * 1000.;
+    
+    double validUntil =
+    now + STORE_RECEIPT_CACHE_MAX_AGE * 1000.;
+    
+    NSMutableArray <NSDictionary *> *purchases =
+    NSMutableArray.new;
+    
+    if ([jsonResponse[@"latest_receipt_info"] isKindOfClass:NSArray.class])
+        [purchases
+         addObjectsFromArray:jsonResponse[@"latest_receipt_info"]];
+    
+    if ([jsonResponse[@"receipt"][@"in_app"] isKindOfClass:NSArray.class])
+        [purchases
+         addObjectsFromArray:jsonResponse[@"receipt"][@"in_app"]];
+    
+    for (NSDictionary *purchase in purchases)
+    {
+        if ([purchase isKindOfClass:NSDictionary.class] == NO)
+            continue;
+        
+        double expires =
+        [purchase[@"expires_date_ms"] doubleValue];
+        
+        if (expires > now && expires < validUntil)
+            validUntil = expires;
+    }
+    
+    return
+    validUntil;
+}
+
++(NSUInteger)receiptCacheHits
+{
+    @synchronized (Store.current)
+    {
+        return
+        Store.current.receiptCacheHits;
+    }
+}
+
++(NSUInteger)receiptCacheMisses
+{
+    @synchronized (Store.current)
+    {
+        return
+        Store.current.receiptCacheMisses;
+    }
+}
+
 -(void)parseRawJSON:(NSDictionary *)jsonResponse
 {
-    self.purchasedVersion =
-    jsonResponse[@"receipt"][@"original_application_version"];
+    StoreMetricsBegin(StoreMetricsPhaseParse);
+    
+    NSDictionary *receiptInfo =
+    jsonResponse[@"receipt"];
     
-    NSDateFormatter *formatter =
-    NSDateFormatter.new;
+    self.purchasedVersion =
+    receiptInfo[@"original_application_version"];
     
-    formatter.dateFormat = @"yyyy-MM-dd HH:mm:ss VV";
+    // Даты берем из *_ms полей, форматтер нужен только если их нет
+    if (receiptInfo[@"original_purchase_date_ms"])
+        self.purchasedDate =
+        [NSDate
+         dateWithTimeIntervalSince1970:[receiptInfo[@"original_purchase_date_ms"] longLongValue] / 1000.];
     
-    self.purchasedDate =
-    [formatter
-     dateFromString:jsonResponse[@"receipt"][@"original_purchase_date"]];
+    // Формат фиксированный, поэтому en_US_POSIX, а не локаль устройства
+    else
+        self.purchasedDate =
+        [[StoreFormatters
+          dateFormatterWithFormat:@"yyyy-MM-dd HH:mm:ss VV"
+          locale:[NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"]]
+         dateFromString:receiptInfo[@"original_purchase_date"]];
     
     NSTimeInterval requestDateMs =
-    [jsonResponse[@"receipt"][@"request_date_ms"]
-     integerValue];
+    [receiptInfo[@"request_date_ms"]
+     longLongValue];
     
     //NSLog(@"jsonRECEIPTResponse:%@", jsonResponse[@"receipt"]);
     
+    NSDictionary <NSString *, StoreItem *> *storeItems =
+    self.currentCatalog.storeItemsByIdentifier;
+    
+    // Индекс product_id -> последняя покупка, строится за один проход по in_app
     NSMutableDictionary <NSString *, NSDictionary *> *receipts =
     NSMutableDictionary.new;
     
+    NSMutableDictionary <NSString *, NSNumber *> *receiptDates =
+    NSMutableDictionary.new;
+    
     NSArray *receiptInApp =
-    jsonResponse[@"receipt"][@"in_app"];
+    receiptInfo[@"in_app"];
     
-    for (StoreItem *storeItem in self.storeItems)
+    for (NSDictionary *receipt in receiptInApp)
     {
-        NSDictionary *lastReceipt = nil;
+        NSString *productId =
+        receipt[@"product_id"];
         
-        for (NSDictionary *receipt in receiptInApp)
-        {
-            if ([receipt[@"product_id"] isEqualToString:storeItem.identifier] == NO)
-                continue;
-            
-            if (lastReceipt == nil)
-            {
-                lastReceipt = receipt;
-                
-                continue;
-            }
-            
-            if ([lastReceipt[@"purchase_date_ms"] longLongValue] > [receipt[@"purchase_date_ms"] longLongValue])
-                continue;
-            
-            lastReceipt = receipt;
-        }
+        if (productId == nil ||
+            storeItems[productId] == nil)
+            continue;
+        
+        long long purchaseDateMs =
+        [receipt[@"purchase_date_ms"] longLongValue];
+        
+        NSNumber *lastDateMs =
+        receiptDates[productId];
         
-        if (lastReceipt == nil)
+        if (lastDateMs &&
+            lastDateMs.longLongValue > purchaseDateMs)
             continue;
         
-        receipts[storeItem.identifier] = lastReceipt;
+        receipts[productId]     = receipt;
+        receiptDates[productId] = @(purchaseDateMs);
     }
     
     // В приложении есть ручное восстановление покупок, которое получает
@@ -2730,7 +6232,7 @@ didFailWithError:(NSError   *)error
     // Удалим сохраненные данные о покупках
     for (StoreItem *s in self.storeItems)
         if (s.type != StoreItemTypeConsumable)
-            [NSUserDefaults.standardUserDefaults
+            [StoreState.current
              removeObjectForKey:s.identifier];
     
     for (NSDictionary *reciept in receipts.allValues)
@@ -2755,17 +6257,16 @@ didFailWithError:(NSError   *)error
          */
         
         StoreItem *storeItem =
-        [Store
-         storeItemWithIdentifier:reciept[@"product_id"]];
+        storeItems[reciept[@"product_id"]];
         
         storeItem.startDate =
         [NSDate
-         dateWithTimeIntervalSince1970:[reciept[@"purchase_date_ms"] integerValue] / 1000.];
+         dateWithTimeIntervalSince1970:[reciept[@"purchase_date_ms"] longLongValue] / 1000.];
         
         if (reciept[@"expires_date_ms"])
             storeItem.endDate =
             [NSDate
-             dateWithTimeIntervalSince1970:[reciept[@"expires_date_ms"] integerValue] / 1000.];
+             dateWithTimeIntervalSince1970:[reciept[@"expires_date_ms"] longLongValue] / 1000.];
         
         storeItem.isTrial   =
         [reciept[@"is_trial_period"] isEqualToString:@"true"];
@@ -2775,13 +6276,11 @@ didFailWithError:(NSError   *)error
             case StoreItemTypeNonConsumable:
             case StoreItemTypeConsumable:
             {
-                [StoreItem
-                 addInfoLog:[NSString
-                             stringWithFormat:@"[INFO] Store parseRawJSON: found and added identifier %@, date: %@",
+                StoreInfoLog(@"[INFO] Store parseRawJSON: found and added identifier %@, date: %@",
                              reciept[@"product_id"],
-                             reciept[@"purchase_date"]]];
+                             reciept[@"purchase_date"]);
                 
-                [NSUserDefaults.standardUserDefaults
+                [StoreState.current
                  setObject:reciept[@"purchase_date"]
                  forKey:reciept[@"product_id"]];
 
@@ -2810,13 +6309,11 @@ didFailWithError:(NSError   *)error
                 
                 if (storeItem.endDate.timeIntervalSince1970 > requestDateMs / 1000.)
                 {
-                    [StoreItem
-                     addInfoLog:[NSString
-                                 stringWithFormat:@"[INFO] Store parseRawJSON: found and added identifier %@, date: %@",
+                    StoreInfoLog(@"[INFO] Store parseRawJSON: found and added identifier %@, date: %@",
                                  reciept[@"product_id"],
-                                 reciept[@"purchase_date"]]];
+                                 reciept[@"purchase_date"]);
                     
-                    [NSUserDefaults.standardUserDefaults
+                    [StoreState.current
                      setObject:reciept[@"purchase_date"]
                      forKey:reciept[@"product_id"]];
                 }
@@ -2828,13 +6325,11 @@ didFailWithError:(NSError   *)error
             {
                 if (storeItem.endDate.timeIntervalSince1970 > requestDateMs / 1000.)
                 {
-                    [StoreItem
-                     addInfoLog:[NSString
-                                 stringWithFormat:@"[INFO] Store parseRawJSON: found and added identifier %@, date: %@",
+                    StoreInfoLog(@"[INFO] Store parseRawJSON: found and added identifier %@, date: %@",
                                  reciept[@"product_id"],
-                                 reciept[@"purchase_date"]]];
+                                 reciept[@"purchase_date"]);
                     
-                    [NSUserDefaults.standardUserDefaults
+                    [StoreState.current
                      setObject:reciept[@"purchase_date"]
                      forKey:reciept[@"product_id"]];
                 }
@@ -2847,8 +6342,13 @@ didFailWithError:(NSError   *)error
         }
     }
     
-    [NSUserDefaults.standardUserDefaults
-     synchronize];
+    [StoreState.current
+     commit];
+    
+    [self
+     rebuildEntitlements];
+    
+    StoreMetricsEnd(StoreMetricsPhaseParse, nil);
 }
 
 -(NSInteger)daysBetweenDate:(NSDate *)fromDateTime
@@ -2922,38 +6422,6 @@ didFailWithError:(NSError   *)error
     return NO;
 }
 
--(NSData *)sendSynchronousRequest:(NSURLRequest *)request
-                returningResponse:(NSURLResponse **)response
-                            error:(NSError **)error
-{
-    dispatch_group_t group = dispatch_group_create();
-    dispatch_group_enter(group);
-    
-    NSError __block *err = NULL;
-    NSData __block *data;
-    NSURLResponse __block *resp;
-    
-    [[NSURLSession.sharedSession
-      dataTaskWithRequest:request
-      completionHandler:^(NSData* _data, NSURLResponse* _response, NSError* _error)
-      {
-          resp = _response;
-          err = _error;
-          data = _data;
-          dispatch_group_leave(group);
-      }] resume];
-    
-    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
-    
-    if (response)
-        *response = resp;
-    
-    if (error)
-        *error = err;
-    
-    return data;
-}
-
 +(void)setLockRules:(LockRules)lockRules
 {
     Store.current.lockRules = lockRules;
@@ -2984,31 +6452,57 @@ didFailWithError:(NSError   *)error
     Store.current.receiptJSON =
     nil;
     
-    [NSUserDefaults.standardUserDefaults
+    [StoreState.current
      removeObjectForKey:STORE_SHAREDSECRET];
     
     NSArray <StoreItem *> *storeItems =
-    [[NSUserDefaults.standardUserDefaults
+    [[StoreState.current
       objectForKey:STORE_iTEMS] copy];
     
     for (NSDictionary *storeItem in storeItems)
-        [NSUserDefaults.standardUserDefaults
+        [StoreState.current
          removeObjectForKey:storeItem[@"identifier"]];
 
-    [NSUserDefaults.standardUserDefaults
+    [StoreState.current
      removeObjectForKey:STORE_iTEMS];
 
-    [NSUserDefaults.standardUserDefaults
+    [StoreState.current
      removeObjectForKey:STORE_UPDATE];
     
-    [NSUserDefaults.standardUserDefaults
+    [StoreState.current
+     removeObjectForKey:STORE_ETAG];
+    
+    [StoreState.current
+     removeObjectForKey:STORE_MODIFIED];
+    
+    [StoreState.current
+     removeObjectForKey:STORE_SANDBOX];
+    
+    [StoreState.current
+     removeObjectForKey:STORE_RECEIPT_CACHE];
+    
+    [StoreState.current
      removeObjectForKey:CONFiG_SHAREDSECRET];
+    
+    Store.current.catalogSnapshot = @{};
+    Store.current.isCatalogStale  = NO;
+    
+    [NSFileManager.defaultManager
+     removeItemAtPath:Store.current.catalogSnapshotPath
+     error:nil];
+    
+    [NSFileManager.defaultManager
+     removeItemAtPath:Store.current.receiptCachePath
+     error:nil];
         
 //    [NSUserDefaults.standardUserDefaults
 //     removeObjectForKey:MANUAL_RESTORED];
 
-    [NSUserDefaults.standardUserDefaults
-     synchronize];
+    [StoreState.current
+     commit];
+    
+    [Store.current
+     rebuildEntitlements];
     
     [StoreItem
      addInfoLog:@"[INFO] Store reset: finish"];
@@ -3016,34 +6510,14 @@ didFailWithError:(NSError   *)error
 
 +(void)removeFileLog
 {
-    NSString *directory =
-    NSSearchPathForDirectoriesInDomains(NSCachesDirectory,
-                                        NSUserDomainMask,
-                                        YES).firstObject;
-    
-    NSString *logPath =
-    [directory
-     stringByAppendingPathComponent:@"Store.log"];
-    
-    [NSFileManager.defaultManager
-     removeItemAtPath:logPath
-     error:nil];
+    [StoreLog.current
+     remove];
 }
 
 +(NSData *)logs
 {
-    NSString *directory =
-    NSSearchPathForDirectoriesInDomains(NSCachesDirectory,
-                                        NSUserDomainMask,
-                                        YES).firstObject;
-    
-    NSString *logPath =
-    [directory
-     stringByAppendingPathComponent:@"Store.log"];
-    
     return
-    [NSData
-     dataWithContentsOfFile:logPath];
+    StoreLog.current.data;
 }
 
 @end
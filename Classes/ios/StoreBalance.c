@@ -0,0 +1,129 @@
+//
+//  StoreBalance.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#include "StoreBalance.h"
+
+#include <string.h>
+
+#pragma mark - Lock
+
+void StoreBalanceInit(StoreBalance *balance)
+{
+    memset(balance, 0, sizeof(StoreBalance));
+
+#if defined(__APPLE__)
+    balance->lock = OS_UNFAIR_LOCK_INIT;
+#else
+    pthread_mutex_init(&balance->lock, NULL);
+#endif
+}
+
+void StoreBalanceDestroy(StoreBalance *balance)
+{
+#if defined(__APPLE__)
+    (void)balance;
+#else
+    pthread_mutex_destroy(&balance->lock);
+#endif
+}
+
+void StoreBalanceLock(StoreBalance *balance)
+{
+#if defined(__APPLE__)
+    os_unfair_lock_lock(&balance->lock);
+#else
+    pthread_mutex_lock(&balance->lock);
+#endif
+}
+
+void StoreBalanceUnlock(StoreBalance *balance)
+{
+#if defined(__APPLE__)
+    os_unfair_lock_unlock(&balance->lock);
+#else
+    pthread_mutex_unlock(&balance->lock);
+#endif
+}
+
+#pragma mark - Balance
+
+int64_t StoreBalanceAvailable(const StoreBalance *balance)
+{
+    return balance->balance - balance->reserved;
+}
+
+StoreBalanceChange StoreBalanceApply(StoreBalance *balance,
+                                     int64_t       delta)
+{
+    int64_t previous = balance->balance;
+
+    balance->balance = previous + delta;
+
+    if (balance->balance < balance->reserved)
+        balance->balance = balance->reserved;
+
+    if (balance->balance == previous)
+        return StoreBalanceChangeNone;
+
+    StoreBalanceChange change = StoreBalanceChangeNone;
+
+    if ((previous > 0) != (balance->balance > 0))
+        change |= StoreBalanceChangeCrossedZero;
+
+    if (balance->isDirty == 0)
+    {
+        balance->isDirty = 1;
+
+        change |= StoreBalanceChangeDirty;
+    }
+
+    if (balance->isNotifyPending == 0)
+    {
+        balance->isNotifyPending = 1;
+        balance->notifyBalance   = previous;
+
+        change |= StoreBalanceChangeNotify;
+    }
+
+    return change;
+}
+
+int StoreBalanceSpend(StoreBalance       *balance,
+                      int64_t             count,
+                      StoreBalanceChange *change)
+{
+    *change = StoreBalanceChangeNone;
+
+    if (StoreBalanceAvailable(balance) < count)
+        return 0;
+
+    *change = StoreBalanceApply(balance, -count);
+
+    return 1;
+}
+
+int StoreBalanceReserve(StoreBalance *balance,
+                        int64_t       count)
+{
+    if (StoreBalanceAvailable(balance) < count)
+        return 0;
+
+    balance->reserved += count;
+
+    return 1;
+}
+
+StoreBalanceChange StoreBalanceFinish(StoreBalance *balance,
+                                      int64_t       count,
+                                      int           commit)
+{
+    balance->reserved -= count;
+
+    if (commit == 0)
+        return StoreBalanceChangeNone;
+
+    return StoreBalanceApply(balance, -count);
+}
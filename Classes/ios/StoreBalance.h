@@ -0,0 +1,101 @@
+//
+//  StoreBalance.h
+//
+//  Created by agent on 10/18/26.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+/*///////////////////////////////////////////////////////////////////
+
+ Баланс одноразовой (consumable) покупки в памяти, на чистом C.
+
+ Баланс не опускается ниже зарезервированного: резерв можно только
+ подтвердить (списать) или вернуть. Все функции, кроме Init, Destroy,
+ Lock и Unlock, вызываются под блокировкой баланса.
+
+ Изменение возвращает маску StoreBalanceChange: что нужно сделать после
+ снятия блокировки. Dirty и Notify выставляются только первым изменением,
+ пока вызывающий не сбросит isDirty и isNotifyPending (записав баланс
+ и разослав уведомление), поэтому серия изменений дает одну запись.
+
+ ////////////////////////////////////////////////////////////////////*/
+
+#ifndef StoreBalance_h
+#define StoreBalance_h
+
+#include <stdint.h>
+
+#if defined(__APPLE__)
+#include <os/lock.h>
+typedef os_unfair_lock StoreBalanceLockType;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t StoreBalanceLockType;
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+    StoreBalanceChangeNone        = 0,
+    StoreBalanceChangeDirty       = 1 << 0, // Баланс нужно записать
+    StoreBalanceChangeNotify      = 1 << 1, // Нужно разослать изменение
+    StoreBalanceChangeCrossedZero = 1 << 2  // Баланс стал нулевым или перестал им быть
+}StoreBalanceChange;
+
+typedef struct
+{
+    StoreBalanceLockType lock;
+    int64_t              balance;
+    int64_t              reserved;
+    int                  isLoaded;        // Баланс прочитан из сохраненного состояния
+    int                  isDirty;
+    int                  isNotifyPending;
+    int64_t              notifyBalance;   // Баланс до первого неразосланного изменения
+}StoreBalance;
+
+void StoreBalanceInit(StoreBalance *balance);
+void StoreBalanceDestroy(StoreBalance *balance);
+
+void StoreBalanceLock(StoreBalance *balance);
+void StoreBalanceUnlock(StoreBalance *balance);
+
+// Сколько можно списать или зарезервировать
+int64_t StoreBalanceAvailable(const StoreBalance *balance);
+
+// Начисление (delta > 0) или списание без проверки, результат не ниже резерва
+StoreBalanceChange StoreBalanceApply(StoreBalance *balance,
+                                     int64_t       delta);
+
+// Списывает, только если хватает свободного баланса, иначе 0 и ничего не меняет
+int StoreBalanceSpend(StoreBalance       *balance,
+                      int64_t             count,
+                      StoreBalanceChange *change);
+
+// Резервирует, только если хватает свободного баланса, иначе 0
+int StoreBalanceReserve(StoreBalance *balance,
+                        int64_t       count);
+
+// Снимает резерв и при commit списывает его
+StoreBalanceChange StoreBalanceFinish(StoreBalance *balance,
+                                      int64_t       count,
+                                      int           commit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,78 @@
+//
+//  StoreJournal.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#include "StoreJournal.h"
+
+static uint32_t StoreJournalReadUInt32(const uint8_t *bytes)
+{
+    return
+    (uint32_t)bytes[0]       |
+    (uint32_t)bytes[1] << 8  |
+    (uint32_t)bytes[2] << 16 |
+    (uint32_t)bytes[3] << 24;
+}
+
+static void StoreJournalWriteUInt32(uint8_t *bytes, uint32_t value)
+{
+    bytes[0] = (uint8_t)(value);
+    bytes[1] = (uint8_t)(value >> 8);
+    bytes[2] = (uint8_t)(value >> 16);
+    bytes[3] = (uint8_t)(value >> 24);
+}
+
+uint32_t StoreJournalChecksum(const uint8_t *bytes,
+                              size_t         length)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t index = 0; index < length; index ++)
+    {
+        hash ^= bytes[index];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+void StoreJournalHeader(uint8_t        header[STORE_JOURNAL_HEADER_SIZE],
+                        const uint8_t *payload,
+                        uint32_t       length)
+{
+    StoreJournalWriteUInt32(header,     length);
+    StoreJournalWriteUInt32(header + 4, StoreJournalChecksum(payload, length));
+}
+
+size_t StoreJournalScan(const uint8_t             *bytes,
+                        size_t                     length,
+                        StoreJournalRecordHandler  handler,
+                        void                      *context)
+{
+    size_t offset = 0;
+
+    while (length - offset >= STORE_JOURNAL_HEADER_SIZE)
+    {
+        const uint8_t *header = bytes + offset;
+
+        uint32_t recordLength   = StoreJournalReadUInt32(header);
+        uint32_t recordChecksum = StoreJournalReadUInt32(header + 4);
+
+        // Длина из недописанного заголовка может указывать за конец файла
+        if (recordLength > length - offset - STORE_JOURNAL_HEADER_SIZE)
+            break;
+
+        const uint8_t *payload = header + STORE_JOURNAL_HEADER_SIZE;
+
+        if (StoreJournalChecksum(payload, recordLength) != recordChecksum)
+            break;
+
+        if (handler && handler(payload, recordLength, context))
+            break;
+
+        offset += STORE_JOURNAL_HEADER_SIZE + recordLength;
+    }
+
+    return offset;
+}
@@ -0,0 +1,69 @@
+//
+//  StoreJournal.h
+//
+//  Created by agent on 10/18/26.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+/*///////////////////////////////////////////////////////////////////
+
+ Формат журнала StoreState (Store.journal), на чистом C.
+
+ Запись: [длина payload, 4 байта LE][FNV-1a от payload, 4 байта LE][payload].
+ Что лежит в payload (binary plist изменений), журналу неважно.
+
+ Записи дописываются в конец файла. Если приложение упало посреди записи,
+ в конце остается недописанная запись: ее длина выходит за конец файла
+ или не сходится контрольная сумма. Такой хвост отбрасывается при загрузке,
+ все записи до него остаются.
+
+ ////////////////////////////////////////////////////////////////////*/
+
+#ifndef StoreJournal_h
+#define StoreJournal_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STORE_JOURNAL_HEADER_SIZE 8
+
+// FNV-1a, 32 бита
+uint32_t StoreJournalChecksum(const uint8_t *bytes,
+                              size_t         length);
+
+// Заголовок записи для payload, пишется в файл перед ним
+void StoreJournalHeader(uint8_t        header[STORE_JOURNAL_HEADER_SIZE],
+                        const uint8_t *payload,
+                        uint32_t       length);
+
+// Вызывается для каждой целой записи по порядку, ненулевой результат прекращает проход
+typedef int (*StoreJournalRecordHandler)(const uint8_t *payload, size_t length, void *context);
+
+// Проходит записи до первой недописанной или поврежденной (или до отказа handler).
+// Возвращает длину целой части журнала, с этого места хвост нужно обрезать.
+// handler может быть NULL
+size_t StoreJournalScan(const uint8_t             *bytes,
+                        size_t                     length,
+                        StoreJournalRecordHandler  handler,
+                        void                      *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+//
+//  StoreLogFile.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "StoreLogFile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void StoreLogFileInit(StoreLogFile *file,
+                      const char   *directory,
+                      uint64_t      maxSize,
+                      unsigned      maxSegments)
+{
+    memset(file, 0, sizeof(StoreLogFile));
+
+    snprintf(file->directory, sizeof(file->directory), "%s", directory);
+
+    file->maxSize     = maxSize;
+    file->maxSegments = maxSegments;
+    file->descriptor  = -1;
+}
+
+int StoreLogFileSegmentPath(const StoreLogFile *file,
+                            unsigned            segment,
+                            char               *path,
+                            size_t              size)
+{
+    int length;
+
+    if (segment == 0)
+        length = snprintf(path, size, "%s/Store.log", file->directory);
+
+    else
+        length = snprintf(path, size, "%s/Store.%u.log", file->directory, segment);
+
+    return length > 0 && (size_t)length < size;
+}
+
+static int StoreLogFileOpen(StoreLogFile *file)
+{
+    char path[STORE_LOG_FILE_PATH_SIZE + 32];
+
+    if (!StoreLogFileSegmentPath(file, 0, path, sizeof(path)))
+        return 0;
+
+    file->descriptor = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+    if (file->descriptor < 0)
+        return 0;
+
+    // Размер читается один раз при открытии, дальше считается по записанному
+    off_t offset = lseek(file->descriptor, 0, SEEK_END);
+
+    file->size = offset > 0 ? (uint64_t)offset : 0;
+
+    return 1;
+}
+
+static void StoreLogFileRotate(StoreLogFile *file)
+{
+    char from[STORE_LOG_FILE_PATH_SIZE + 32];
+    char to[STORE_LOG_FILE_PATH_SIZE + 32];
+
+    StoreLogFileClose(file);
+
+    if (file->maxSegments == 0)
+        return;
+
+    if (StoreLogFileSegmentPath(file, file->maxSegments - 1, to, sizeof(to)))
+        unlink(to);
+
+    for (unsigned segment = file->maxSegments - 1; segment > 0; segment --)
+        if (StoreLogFileSegmentPath(file, segment - 1, from, sizeof(from)) &&
+            StoreLogFileSegmentPath(file, segment,     to,   sizeof(to)))
+            rename(from, to);
+}
+
+int StoreLogFileWrite(StoreLogFile  *file,
+                      const uint8_t *bytes,
+                      size_t         length)
+{
+    if (length == 0)
+        return 1;
+
+    if (file->descriptor < 0 &&
+        !StoreLogFileOpen(file))
+        return 0;
+
+    if (file->size > 0 &&
+        file->size + length > file->maxSize)
+    {
+        StoreLogFileRotate(file);
+
+        if (!StoreLogFileOpen(file))
+            return 0;
+    }
+
+    while (length > 0)
+    {
+        ssize_t written = write(file->descriptor, bytes, length);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return 0;
+        }
+
+        bytes      += written;
+        length     -= (size_t)written;
+        file->size += (uint64_t)written;
+    }
+
+    return 1;
+}
+
+void StoreLogFileClose(StoreLogFile *file)
+{
+    if (file->descriptor >= 0)
+        close(file->descriptor);
+
+    file->descriptor = -1;
+    file->size       = 0;
+}
+
+void StoreLogFileRemove(StoreLogFile *file)
+{
+    char path[STORE_LOG_FILE_PATH_SIZE + 32];
+
+    StoreLogFileClose(file);
+
+    for (unsigned segment = 0; segment < file->maxSegments; segment ++)
+        if (StoreLogFileSegmentPath(file, segment, path, sizeof(path)))
+            unlink(path);
+}
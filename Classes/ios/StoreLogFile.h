@@ -0,0 +1,79 @@
+//
+//  StoreLogFile.h
+//
+//  Created by agent on 10/18/26.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+/*///////////////////////////////////////////////////////////////////
+
+ Файл лога [Store logs] с ротацией, на чистом C.
+
+ Пачка строк дописывается в конец открытого Store.log. Если с ней файл
+ превысит maxSize, он становится архивным: Store.log -> Store.1.log -> ...,
+ самый старый из maxSegments удаляется. Размер файла хранится в памяти,
+ поэтому запись не зависит от длины уже накопленного лога.
+
+ Буферизация и очередь остаются на вызывающем, файл не потокобезопасен.
+
+ ////////////////////////////////////////////////////////////////////*/
+
+#ifndef StoreLogFile_h
+#define StoreLogFile_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STORE_LOG_FILE_PATH_SIZE 1024
+
+typedef struct
+{
+    char     directory[STORE_LOG_FILE_PATH_SIZE];
+    uint64_t maxSize;
+    unsigned maxSegments;
+
+    int      descriptor; // -1 пока файл не открыт
+    uint64_t size;
+}StoreLogFile;
+
+void StoreLogFileInit(StoreLogFile *file,
+                      const char   *directory,
+                      uint64_t      maxSize,
+                      unsigned      maxSegments);
+
+// Путь сегмента: 0 это текущий Store.log, дальше архивные. 0 если путь не помещается
+int StoreLogFileSegmentPath(const StoreLogFile *file,
+                            unsigned            segment,
+                            char               *path,
+                            size_t              size);
+
+// Дописывает пачку целиком, при необходимости сначала ротирует. 0 при ошибке записи
+int StoreLogFileWrite(StoreLogFile  *file,
+                      const uint8_t *bytes,
+                      size_t         length);
+
+void StoreLogFileClose(StoreLogFile *file);
+
+// Закрывает файл и удаляет все сегменты
+void StoreLogFileRemove(StoreLogFile *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
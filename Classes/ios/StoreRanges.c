@@ -0,0 +1,208 @@
+//
+//  StoreRanges.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#include "StoreRanges.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#pragma mark - Intervals
+
+static int StoreRangesCompare(const void *first, const void *second)
+{
+    const StoreRangesInterval *interval1 = first;
+    const StoreRangesInterval *interval2 = second;
+
+    if (interval1->from != interval2->from)
+        return interval1->from < interval2->from ? -1 : 1;
+
+    if (interval1->to != interval2->to)
+        return interval1->to < interval2->to ? -1 : 1;
+
+    return 0;
+}
+
+size_t StoreRangesCompile(StoreRangesInterval *intervals,
+                          size_t               count)
+{
+    size_t valid = 0;
+
+    for (size_t index = 0; index < count; index ++)
+        if (intervals[index].from <= intervals[index].to)
+            intervals[valid ++] = intervals[index];
+
+    if (valid == 0)
+        return 0;
+
+    qsort(intervals, valid, sizeof(StoreRangesInterval), StoreRangesCompare);
+
+    size_t merged = 0;
+
+    for (size_t index = 1; index < valid; index ++)
+    {
+        StoreRangesInterval *last = &intervals[merged];
+
+        // Смежные тоже сливаем, значения целые
+        if (intervals[index].from <= last->to ||
+            intervals[index].from - 1 == last->to)
+        {
+            if (intervals[index].to > last->to)
+                last->to = intervals[index].to;
+        }
+
+        else
+            intervals[++ merged] = intervals[index];
+    }
+
+    return merged + 1;
+}
+
+int StoreRangesContains(const StoreRangesInterval *intervals,
+                        size_t                     count,
+                        uint64_t                   value)
+{
+    size_t low  = 0;
+    size_t high = count;
+
+    // Первый интервал, у которого to >= value
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+
+        if (intervals[middle].to < value)
+            low = middle + 1;
+
+        else
+            high = middle;
+    }
+
+    return
+    low < count && intervals[low].from <= value;
+}
+
+#pragma mark - Days
+
+int64_t StoreRangesDaysFromCivil(int64_t year,
+                                 int64_t month,
+                                 int64_t day)
+{
+    year -= month <= 2;
+
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yoe = year - era * 400;
+    int64_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + doe;
+}
+
+// Число из 1...maxDigits цифр до разделителя или конца строки
+static int StoreRangesNumber(const char **cursor,
+                             const char  *end,
+                             size_t       maxDigits,
+                             int64_t     *value)
+{
+    size_t digits = 0;
+
+    *value = 0;
+
+    while (*cursor < end && **cursor >= '0' && **cursor <= '9')
+    {
+        if (++ digits > maxDigits)
+            return 0;
+
+        *value = *value * 10 + (**cursor - '0');
+
+        (*cursor) ++;
+    }
+
+    return digits > 0;
+}
+
+int StoreRangesParseDay(const char *string,
+                        size_t      length,
+                        uint64_t   *day)
+{
+    static const int64_t monthDays[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    const char *cursor = string;
+    const char *end    = string + length;
+
+    int64_t dayValue, month, year;
+
+    if (string == NULL ||
+        !StoreRangesNumber(&cursor, end, 2, &dayValue) || cursor >= end || *cursor ++ != '/' ||
+        !StoreRangesNumber(&cursor, end, 2, &month)    || cursor >= end || *cursor ++ != '/' ||
+        !StoreRangesNumber(&cursor, end, 4, &year)     || cursor != end)
+        return 0;
+
+    if (month < 1 || month > 12 || dayValue < 1 || dayValue > monthDays[month - 1])
+        return 0;
+
+    int isLeap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+
+    if (month == 2 && dayValue == 29 && isLeap == 0)
+        return 0;
+
+    *day = (uint64_t)StoreRangesDaysFromCivil(year, month, dayValue);
+
+    return 1;
+}
+
+uint64_t StoreRangesDayWithTime(double seconds)
+{
+    int64_t day = (int64_t)floor(seconds / 86400.) + STORE_RANGES_DAY_1970;
+
+    return day < 0 ? 0 : (uint64_t)day;
+}
+
+#pragma mark - Versions
+
+int StoreRangesParseVersion(const char *string,
+                            size_t      length,
+                            uint64_t   *version)
+{
+    if (string == NULL || length == 0)
+        return 0;
+
+    uint64_t components[4] = {0, 0, 0, 0};
+    size_t   component     = 0;
+    int      isSkipping    = 0;
+
+    for (size_t index = 0; index < length; index ++)
+    {
+        char character = string[index];
+
+        if (character == '.')
+        {
+            component ++;
+
+            isSkipping = 0;
+
+            continue;
+        }
+
+        // Как intValue: после первой не цифры остаток компонента игнорируется ("0b3" -> 0)
+        if (character < '0' || character > '9')
+            isSkipping = 1;
+
+        if (isSkipping)
+            continue;
+
+        if (component < 4 && components[component] < 0xFFFF)
+        {
+            components[component] = components[component] * 10 + (uint64_t)(character - '0');
+
+            if (components[component] > 0xFFFF)
+                components[component] = 0xFFFF;
+        }
+    }
+
+    *version =
+    components[0] << 48 | components[1] << 32 | components[2] << 16 | components[3];
+
+    return 1;
+}
@@ -0,0 +1,84 @@
+//
+//  StoreRanges.h
+//
+//  Created by agent on 10/18/26.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+/*///////////////////////////////////////////////////////////////////
+
+ Правила setAsPurchasedForRanges: в упакованном целочисленном виде, на чистом C.
+
+ Даты хранятся номером дня по UTC (от 1 марта 0000 года, поэтому не отрицательные),
+ версии упаковываются по 16 бит на компонент: "3.0.1" -> 0x0003'0000'0001'0000.
+ Учитываются первые четыре компонента, значения больше 65535 обрезаются.
+
+ Интервалы включительные, после компиляции отсортированы и не пересекаются,
+ поэтому проверка это двоичный поиск.
+
+ ////////////////////////////////////////////////////////////////////*/
+
+#ifndef StoreRanges_h
+#define StoreRanges_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct
+{
+    uint64_t from;
+    uint64_t to;
+}StoreRangesInterval;
+
+// Сортирует, отбрасывает перевернутые (from > to), сливает пересекающиеся и смежные.
+// Работает на месте, возвращает новое количество интервалов
+size_t StoreRangesCompile(StoreRangesInterval *intervals,
+                          size_t               count);
+
+// Попадает ли значение в один из скомпилированных интервалов
+int StoreRangesContains(const StoreRangesInterval *intervals,
+                        size_t                     count,
+                        uint64_t                   value);
+
+// "31/12/2020" (день/месяц/год) в номер дня, 0 если дата неверна
+int StoreRangesParseDay(const char *string,
+                        size_t      length,
+                        uint64_t   *day);
+
+// Секунды с 1970 в номер дня по UTC
+uint64_t StoreRangesDayWithTime(double seconds);
+
+// Номер дня по григорианскому календарю (алгоритм days_from_civil, от 1 марта 0000 года).
+// Общий для дат правил и дат чека, 1970-01-01 это STORE_RANGES_DAY_1970
+int64_t StoreRangesDaysFromCivil(int64_t year,
+                                 int64_t month,
+                                 int64_t day);
+
+#define STORE_RANGES_DAY_1970 719468
+
+// "3.0.1" в упакованную версию, 0 если строка пустая.
+// Компонент читается как intValue: "1.0b3" -> 1.0
+int StoreRangesParseVersion(const char *string,
+                            size_t      length,
+                            uint64_t   *version);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,592 @@
+//
+//  StoreReceipt.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#include "StoreReceipt.h"
+#include "StoreRanges.h"
+
+#include <string.h>
+
+// Первый октет идентификатора: класс, признак составного типа, номер
+#define ASN1_INTEGER      0x02
+#define ASN1_OCTET_STRING 0x04
+#define ASN1_OID          0x06
+#define ASN1_UTF8_STRING  0x0C
+#define ASN1_IA5_STRING   0x16
+#define ASN1_SEQUENCE     0x30
+#define ASN1_SET          0x31
+#define ASN1_CONTEXT_0    0xA0
+
+#define ASN1_CONSTRUCTED  0x20
+
+// 1.2.840.113549.1.7.2 и 1.2.840.113549.1.7.1
+static const uint8_t StoreReceiptSignedDataOID[] = {0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x02};
+static const uint8_t StoreReceiptDataOID[]       = {0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x01};
+
+typedef struct
+{
+    uint8_t        identifier; // Первый октет, для длинных номеров тегов не используется
+    uint32_t       number;
+    int            isConstructed;
+
+    const uint8_t *content;
+    size_t         length;     // Для неопределенной длины без завершающих 00 00
+
+    const uint8_t *next;       // Следующий элемент за этим
+}StoreReceiptElement;
+
+#pragma mark - ASN.1
+
+static StoreReceiptResult StoreReceiptReadElement(const uint8_t       *bytes,
+                                                  const uint8_t       *end,
+                                                  int                  depth,
+                                                  StoreReceiptElement *element)
+{
+    if (depth > STORE_RECEIPT_MAX_DEPTH)
+        return StoreReceiptResultTooDeep;
+
+    if (bytes >= end)
+        return StoreReceiptResultTruncated;
+
+    uint8_t identifier = *bytes ++;
+
+    element->identifier    = identifier;
+    element->isConstructed = (identifier & ASN1_CONSTRUCTED) != 0;
+    element->number        = identifier & 0x1F;
+
+    // Длинная форма номера тега
+    if (element->number == 0x1F)
+    {
+        uint8_t octet;
+
+        element->number = 0;
+
+        do
+        {
+            if (bytes >= end)
+                return StoreReceiptResultTruncated;
+
+            if (element->number > (UINT32_MAX >> 7))
+                return StoreReceiptResultMalformed;
+
+            octet = *bytes ++;
+
+            element->number = (element->number << 7) | (octet & 0x7F);
+        }
+        while (octet & 0x80);
+    }
+
+    if (bytes >= end)
+        return StoreReceiptResultTruncated;
+
+    uint8_t lengthOctet = *bytes ++;
+
+    // Неопределенная длина (BER): содержимое идет до 00 00, ищем его, пропуская вложенные элементы
+    if (lengthOctet == 0x80)
+    {
+        if (element->isConstructed == 0)
+            return StoreReceiptResultMalformed;
+
+        const uint8_t *cursor = bytes;
+
+        for (;;)
+        {
+            if (end - cursor < 2)
+                return StoreReceiptResultTruncated;
+
+            if (cursor[0] == 0x00 && cursor[1] == 0x00)
+                break;
+
+            StoreReceiptElement child;
+
+            StoreReceiptResult result =
+            StoreReceiptReadElement(cursor, end, depth + 1, &child);
+
+            if (result != StoreReceiptResultOK)
+                return result;
+
+            cursor = child.next;
+        }
+
+        element->content = bytes;
+        element->length  = (size_t)(cursor - bytes);
+        element->next    = cursor + 2;
+
+        return StoreReceiptResultOK;
+    }
+
+    size_t length = lengthOctet;
+
+    // Длинная форма длины
+    if (lengthOctet & 0x80)
+    {
+        size_t count = lengthOctet & 0x7F;
+
+        if (count == 0x7F || count > sizeof(size_t))
+            return StoreReceiptResultMalformed;
+
+        length = 0;
+
+        for (size_t index = 0; index < count; index ++)
+        {
+            if (bytes >= end)
+                return StoreReceiptResultTruncated;
+
+            length = (length << 8) | *bytes ++;
+        }
+    }
+
+    if (length > (size_t)(end - bytes))
+        return StoreReceiptResultTruncated;
+
+    element->content = bytes;
+    element->length  = length;
+    element->next    = bytes + length;
+
+    return StoreReceiptResultOK;
+}
+
+// Читает единственный элемент, занимающий весь буфер
+static StoreReceiptResult StoreReceiptReadValue(const uint8_t       *bytes,
+                                                size_t               length,
+                                                int                  depth,
+                                                StoreReceiptElement *element)
+{
+    StoreReceiptResult result =
+    StoreReceiptReadElement(bytes, bytes + length, depth, element);
+
+    if (result == StoreReceiptResultOK && element->next != bytes + length)
+        return StoreReceiptResultMalformed;
+
+    return result;
+}
+
+static StoreReceiptResult StoreReceiptReadInteger(const StoreReceiptElement *element,
+                                                  int64_t                   *value)
+{
+    if (element->identifier != ASN1_INTEGER || element->length == 0 || element->length > 8)
+        return StoreReceiptResultMalformed;
+
+    // Дополнительный код, старший бит первого октета это знак
+    uint64_t result = (element->content[0] & 0x80) ? UINT64_MAX : 0;
+
+    for (size_t index = 0; index < element->length; index ++)
+        result = (result << 8) | element->content[index];
+
+    *value = (int64_t)result;
+
+    return StoreReceiptResultOK;
+}
+
+#pragma mark - Values
+
+// Значение атрибута само закодировано в ASN.1: строка, дата строкой или число
+static void StoreReceiptValueString(const StoreReceiptElement *value,
+                                    int                        depth,
+                                    StoreReceiptString        *string)
+{
+    StoreReceiptElement element;
+
+    if (StoreReceiptReadValue(value->content, value->length, depth, &element) != StoreReceiptResultOK)
+        return;
+
+    if (element.identifier != ASN1_UTF8_STRING && element.identifier != ASN1_IA5_STRING)
+        return;
+
+    string->bytes  = element.content;
+    string->length = element.length;
+}
+
+static void StoreReceiptValueDate(const StoreReceiptElement *value,
+                                  int                        depth,
+                                  int64_t                   *dateMs)
+{
+    StoreReceiptString string = {NULL, 0};
+
+    StoreReceiptValueString(value, depth, &string);
+
+    *dateMs =
+    StoreReceiptDateMs(string.bytes, string.length);
+}
+
+static void StoreReceiptValueInteger(const StoreReceiptElement *value,
+                                     int                        depth,
+                                     int64_t                   *integer)
+{
+    StoreReceiptElement element;
+
+    if (StoreReceiptReadValue(value->content, value->length, depth, &element) != StoreReceiptResultOK)
+        return;
+
+    StoreReceiptReadInteger(&element, integer);
+}
+
+#pragma mark - Attributes
+
+typedef StoreReceiptResult (*StoreReceiptAttributeHandler)(int64_t                    type,
+                                                           const StoreReceiptElement *value,
+                                                           int                        depth,
+                                                           void                      *context);
+
+// SET OF SEQUENCE {type INTEGER, version INTEGER, value OCTET STRING}
+static StoreReceiptResult StoreReceiptReadAttributes(const uint8_t                *bytes,
+                                                     size_t                        length,
+                                                     int                           depth,
+                                                     StoreReceiptAttributeHandler  handler,
+                                                     void                         *context)
+{
+    StoreReceiptElement set;
+
+    StoreReceiptResult result =
+    StoreReceiptReadValue(bytes, length, depth, &set);
+
+    if (result != StoreReceiptResultOK)
+        return result;
+
+    if (set.identifier != ASN1_SET)
+        return StoreReceiptResultMalformed;
+
+    const uint8_t *cursor = set.content;
+    const uint8_t *end    = set.content + set.length;
+
+    while (cursor < end)
+    {
+        StoreReceiptElement attribute, type, version, value;
+
+        result = StoreReceiptReadElement(cursor, end, depth + 1, &attribute);
+
+        if (result != StoreReceiptResultOK)
+            return result;
+
+        cursor = attribute.next;
+
+        if (attribute.identifier != ASN1_SEQUENCE)
+            return StoreReceiptResultMalformed;
+
+        const uint8_t *attributeEnd = attribute.content + attribute.length;
+
+        if ((result = StoreReceiptReadElement(attribute.content, attributeEnd, depth + 2, &type))    != StoreReceiptResultOK ||
+            (result = StoreReceiptReadElement(type.next,         attributeEnd, depth + 2, &version)) != StoreReceiptResultOK ||
+            (result = StoreReceiptReadElement(version.next,      attributeEnd, depth + 2, &value))   != StoreReceiptResultOK)
+            return result;
+
+        if (value.identifier != ASN1_OCTET_STRING)
+            return StoreReceiptResultMalformed;
+
+        int64_t typeValue;
+
+        // Атрибуты с огромными номерами не наши, пропускаем
+        if (StoreReceiptReadInteger(&type, &typeValue) != StoreReceiptResultOK)
+            continue;
+
+        result = handler(typeValue, &value, depth + 2, context);
+
+        if (result != StoreReceiptResultOK)
+            return result;
+    }
+
+    return StoreReceiptResultOK;
+}
+
+static StoreReceiptResult StoreReceiptPurchaseAttribute(int64_t                    type,
+                                                        const StoreReceiptElement *value,
+                                                        int                        depth,
+                                                        void                      *context)
+{
+    StoreReceiptPurchase *purchase = context;
+
+    switch (type)
+    {
+        case 1701: StoreReceiptValueInteger(value, depth, &purchase->quantity);                    break;
+        case 1702: StoreReceiptValueString (value, depth, &purchase->productId);                   break;
+        case 1703: StoreReceiptValueString (value, depth, &purchase->transactionId);               break;
+        case 1705: StoreReceiptValueString (value, depth, &purchase->originalTransactionId);       break;
+        case 1706: StoreReceiptValueDate   (value, depth, &purchase->originalPurchaseDateMs);      break;
+        case 1708: StoreReceiptValueDate   (value, depth, &purchase->expiresDateMs);               break;
+        case 1712: StoreReceiptValueDate   (value, depth, &purchase->cancellationDateMs);          break;
+
+        case 1704:
+        {
+            StoreReceiptValueString(value, depth, &purchase->purchaseDate);
+
+            purchase->purchaseDateMs =
+            StoreReceiptDateMs(purchase->purchaseDate.bytes, purchase->purchaseDate.length);
+
+            break;
+        }
+
+        case 1713:
+        case 1719:
+        {
+            int64_t flag = 0;
+
+            StoreReceiptValueInteger(value, depth, &flag);
+
+            if (type == 1713)
+                purchase->isTrialPeriod = flag != 0;
+
+            else
+                purchase->isInIntroOfferPeriod = flag != 0;
+
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return StoreReceiptResultOK;
+}
+
+typedef struct
+{
+    StoreReceiptInfo            *info;
+    StoreReceiptPurchaseHandler  handler;
+    void                        *context;
+}StoreReceiptContext;
+
+static StoreReceiptResult StoreReceiptAttribute(int64_t                    type,
+                                                const StoreReceiptElement *value,
+                                                int                        depth,
+                                                void                      *context)
+{
+    StoreReceiptContext *receipt = context;
+    StoreReceiptInfo    *info    = receipt->info;
+
+    switch (type)
+    {
+        case 2:  StoreReceiptValueString(value, depth, &info->bundleId);                   break;
+        case 3:  StoreReceiptValueString(value, depth, &info->applicationVersion);         break;
+        case 19: StoreReceiptValueString(value, depth, &info->originalApplicationVersion); break;
+        case 12: StoreReceiptValueDate  (value, depth, &info->creationDateMs);             break;
+        case 18: StoreReceiptValueDate  (value, depth, &info->originalPurchaseDateMs);     break;
+        case 21: StoreReceiptValueDate  (value, depth, &info->expirationDateMs);           break;
+
+        case 17:
+        {
+            if (receipt->handler == NULL)
+                break;
+
+            StoreReceiptPurchase purchase =
+            {
+                .quantity               =  0,
+                .purchaseDateMs         = -1,
+                .originalPurchaseDateMs = -1,
+                .expiresDateMs          = -1,
+                .cancellationDateMs     = -1
+            };
+
+            StoreReceiptResult result =
+            StoreReceiptReadAttributes(value->content, value->length, depth + 1, StoreReceiptPurchaseAttribute, &purchase);
+
+            if (result != StoreReceiptResultOK)
+                return result;
+
+            if (receipt->handler(&purchase, receipt->context))
+                return StoreReceiptResultStopped;
+
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return StoreReceiptResultOK;
+}
+
+#pragma mark - PKCS#7
+
+// Первый вложенный элемент с нужным идентификатором
+static StoreReceiptResult StoreReceiptReadChild(const StoreReceiptElement *parent,
+                                                const uint8_t             *from,
+                                                int                        depth,
+                                                uint8_t                    identifier,
+                                                StoreReceiptElement       *element)
+{
+    StoreReceiptResult result =
+    StoreReceiptReadElement(from, parent->content + parent->length, depth, element);
+
+    if (result == StoreReceiptResultOK && element->identifier != identifier)
+        return StoreReceiptResultMalformed;
+
+    return result;
+}
+
+StoreReceiptResult StoreReceiptDecode(const uint8_t               *bytes,
+                                      size_t                       length,
+                                      StoreReceiptInfo            *info,
+                                      StoreReceiptPurchaseHandler  handler,
+                                      void                        *context)
+{
+    StoreReceiptInfo unused;
+
+    if (info == NULL)
+        info = &unused;
+
+    memset(info, 0, sizeof(*info));
+
+    info->creationDateMs         = -1;
+    info->originalPurchaseDateMs = -1;
+    info->expirationDateMs       = -1;
+
+    if (bytes == NULL)
+        return StoreReceiptResultTruncated;
+
+    StoreReceiptElement contentInfo, contentType, content, signedData, version, digestAlgorithms;
+    StoreReceiptElement encapContentInfo, encapContentType, encapContent, payload;
+
+    StoreReceiptResult result;
+
+    // ContentInfo ::= SEQUENCE {contentType OID, [0] EXPLICIT SignedData}
+    if ((result = StoreReceiptReadElement(bytes, bytes + length, 0, &contentInfo))                        != StoreReceiptResultOK)
+        return result;
+
+    if (contentInfo.identifier != ASN1_SEQUENCE)
+        return StoreReceiptResultMalformed;
+
+    if ((result = StoreReceiptReadChild(&contentInfo, contentInfo.content, 1, ASN1_OID,        &contentType)) != StoreReceiptResultOK ||
+        (result = StoreReceiptReadChild(&contentInfo, contentType.next,    1, ASN1_CONTEXT_0,  &content))     != StoreReceiptResultOK)
+        return result;
+
+    if (contentType.length != sizeof(StoreReceiptSignedDataOID) ||
+        memcmp(contentType.content, StoreReceiptSignedDataOID, sizeof(StoreReceiptSignedDataOID)) != 0)
+        return StoreReceiptResultMalformed;
+
+    // SignedData ::= SEQUENCE {version, digestAlgorithms SET, encapContentInfo SEQUENCE, ...}
+    if ((result = StoreReceiptReadChild(&content,    content.content,    2, ASN1_SEQUENCE, &signedData))       != StoreReceiptResultOK ||
+        (result = StoreReceiptReadChild(&signedData, signedData.content, 3, ASN1_INTEGER,  &version))          != StoreReceiptResultOK ||
+        (result = StoreReceiptReadChild(&signedData, version.next,       3, ASN1_SET,      &digestAlgorithms)) != StoreReceiptResultOK ||
+        (result = StoreReceiptReadChild(&signedData, digestAlgorithms.next, 3, ASN1_SEQUENCE, &encapContentInfo)) != StoreReceiptResultOK)
+        return result;
+
+    // EncapsulatedContentInfo ::= SEQUENCE {eContentType OID, [0] EXPLICIT OCTET STRING}
+    if ((result = StoreReceiptReadChild(&encapContentInfo, encapContentInfo.content, 4, ASN1_OID,       &encapContentType)) != StoreReceiptResultOK ||
+        (result = StoreReceiptReadChild(&encapContentInfo, encapContentType.next,    4, ASN1_CONTEXT_0, &encapContent))     != StoreReceiptResultOK)
+        return result;
+
+    if (encapContentType.length != sizeof(StoreReceiptDataOID) ||
+        memcmp(encapContentType.content, StoreReceiptDataOID, sizeof(StoreReceiptDataOID)) != 0)
+        return StoreReceiptResultMalformed;
+
+    if ((result = StoreReceiptReadElement(encapContent.content, encapContent.content + encapContent.length, 5, &payload)) != StoreReceiptResultOK)
+        return result;
+
+    // Склеивать части пришлось бы копированием
+    if (payload.identifier == (ASN1_OCTET_STRING | ASN1_CONSTRUCTED))
+        return StoreReceiptResultUnsupported;
+
+    if (payload.identifier != ASN1_OCTET_STRING)
+        return StoreReceiptResultMalformed;
+
+    StoreReceiptContext receipt =
+    {
+        .info    = info,
+        .handler = handler,
+        .context = context
+    };
+
+    return
+    StoreReceiptReadAttributes(payload.content, payload.length, 6, StoreReceiptAttribute, &receipt);
+}
+
+#pragma mark - Dates
+
+static int StoreReceiptDigits(const uint8_t *bytes,
+                              size_t         count,
+                              int           *value)
+{
+    *value = 0;
+
+    for (size_t index = 0; index < count; index ++)
+    {
+        if (bytes[index] < '0' || bytes[index] > '9')
+            return 0;
+
+        *value = *value * 10 + (bytes[index] - '0');
+    }
+
+    return 1;
+}
+
+int64_t StoreReceiptDateMs(const uint8_t *bytes,
+                           size_t         length)
+{
+    // YYYY-MM-DDTHH:MM:SS
+    if (bytes == NULL || length < 20)
+        return -1;
+
+    int year, month, day, hour, minute, second;
+
+    if (!StoreReceiptDigits(bytes,      4, &year)   || bytes[4]  != '-' ||
+        !StoreReceiptDigits(bytes + 5,  2, &month)  || bytes[7]  != '-' ||
+        !StoreReceiptDigits(bytes + 8,  2, &day)    || (bytes[10] != 'T' && bytes[10] != 't') ||
+        !StoreReceiptDigits(bytes + 11, 2, &hour)   || bytes[13] != ':' ||
+        !StoreReceiptDigits(bytes + 14, 2, &minute) || bytes[16] != ':' ||
+        !StoreReceiptDigits(bytes + 17, 2, &second))
+        return -1;
+
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+        return -1;
+
+    size_t  index        = 19;
+    int64_t milliseconds = 0;
+
+    // Доли секунды, берем первые три знака
+    if (bytes[index] == '.')
+    {
+        int64_t scale = 100;
+
+        index ++;
+
+        if (index >= length || bytes[index] < '0' || bytes[index] > '9')
+            return -1;
+
+        for (; index < length && bytes[index] >= '0' && bytes[index] <= '9'; index ++)
+        {
+            milliseconds += (bytes[index] - '0') * scale;
+
+            scale /= 10;
+        }
+    }
+
+    if (index >= length)
+        return -1;
+
+    int64_t offset = 0;
+
+    if (bytes[index] == 'Z' || bytes[index] == 'z')
+        index ++;
+
+    else if (bytes[index] == '+' || bytes[index] == '-')
+    {
+        int offsetHour, offsetMinute;
+
+        if (length - index < 6 ||
+            !StoreReceiptDigits(bytes + index + 1, 2, &offsetHour) || bytes[index + 3] != ':' ||
+            !StoreReceiptDigits(bytes + index + 4, 2, &offsetMinute) ||
+            offsetHour > 23 || offsetMinute > 59)
+            return -1;
+
+        offset = (offsetHour * 60 + offsetMinute) * 60;
+
+        if (bytes[index] == '-')
+            offset = -offset;
+
+        index += 6;
+    }
+
+    else
+        return -1;
+
+    if (index != length)
+        return -1;
+
+    int64_t seconds =
+    (StoreRangesDaysFromCivil(year, month, day) - STORE_RANGES_DAY_1970) * 86400 + hour * 3600 + minute * 60 + second - offset;
+
+    return
+    seconds * 1000 + milliseconds;
+}
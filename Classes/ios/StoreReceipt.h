@@ -0,0 +1,110 @@
+//
+//  StoreReceipt.h
+//
+//  Created by agent on 10/18/26.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+/*///////////////////////////////////////////////////////////////////
+
+ Разбор чека App Store (PKCS#7 / ASN.1) на устройстве, на чистом C.
+
+ Чек не копируется: строки в результате указывают прямо в буфер чека,
+ поэтому буфер должен жить, пока используются результаты разбора.
+ Поддерживаются DER и BER с неопределенной длиной (так подписаны новые чеки).
+
+ Подпись чека НЕ проверяется, это только разбор содержимого.
+ Для подтверждения подлинности чек по-прежнему отправляется на сервер Apple.
+
+ ////////////////////////////////////////////////////////////////////*/
+
+#ifndef StoreReceipt_h
+#define StoreReceipt_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Максимальная вложенность ASN.1, глубже разбор прекращается
+#define STORE_RECEIPT_MAX_DEPTH 32
+
+typedef enum
+{
+    StoreReceiptResultOK,
+    StoreReceiptResultTruncated,   // Данные обрываются раньше, чем заявлено в длинах
+    StoreReceiptResultMalformed,   // Нарушена структура ASN.1 или PKCS#7
+    StoreReceiptResultTooDeep,     // Превышена STORE_RECEIPT_MAX_DEPTH
+    StoreReceiptResultUnsupported, // Например, содержимое разбито на части (BER constructed OCTET STRING)
+    StoreReceiptResultStopped      // Обработчик покупок попросил остановиться
+}StoreReceiptResult;
+
+// Строка внутри буфера чека, не заканчивается нулем
+typedef struct
+{
+    const uint8_t *bytes;
+    size_t         length;
+}StoreReceiptString;
+
+// Поля, которых нет в чеке, имеют length == 0 для строк и -1 для дат
+typedef struct
+{
+    StoreReceiptString bundleId;                   // 2
+    StoreReceiptString applicationVersion;         // 3
+    StoreReceiptString originalApplicationVersion; // 19
+
+    int64_t            creationDateMs;             // 12
+    int64_t            originalPurchaseDateMs;     // 18
+    int64_t            expirationDateMs;           // 21
+}StoreReceiptInfo;
+
+typedef struct
+{
+    int64_t            quantity;                   // 1701
+
+    StoreReceiptString productId;                  // 1702
+    StoreReceiptString transactionId;              // 1703
+    StoreReceiptString originalTransactionId;      // 1705
+    StoreReceiptString purchaseDate;               // 1704, RFC 3339 как в чеке
+
+    int64_t            purchaseDateMs;             // 1704
+    int64_t            originalPurchaseDateMs;     // 1706
+    int64_t            expiresDateMs;              // 1708
+    int64_t            cancellationDateMs;         // 1712
+
+    int                isTrialPeriod;              // 1713
+    int                isInIntroOfferPeriod;       // 1719
+}StoreReceiptPurchase;
+
+// Вызывается для каждой покупки (in_app) по порядку, ненулевой результат прекращает разбор
+typedef int (*StoreReceiptPurchaseHandler)(const StoreReceiptPurchase *purchase, void *context);
+
+// Разбирает чек целиком, info и handler могут быть NULL
+StoreReceiptResult StoreReceiptDecode(const uint8_t               *bytes,
+                                      size_t                       length,
+                                      StoreReceiptInfo            *info,
+                                      StoreReceiptPurchaseHandler  handler,
+                                      void                        *context);
+
+// Дата RFC 3339 ("2020-12-31T23:59:59Z", допускаются доли секунды и смещение) в мс с 1970, -1 если не разобрать
+int64_t StoreReceiptDateMs(const uint8_t *bytes,
+                           size_t         length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+# Генерирует фикстуры чеков для StoreReceiptTests: python3 make_receipts.py
+# Подпись не нужна, декодер ее не проверяет, поэтому SignedData без сертификатов
+#
+# Чеки для бенчмарка (10, 1000 и 50000 покупок) большие и в репозиторий не кладутся,
+# make -C Tests bench собирает их сам: python3 make_receipts.py --bench <папка>
+
+import datetime
+import os
+import sys
+
+
+def length(n):
+    if n < 128:
+        return bytes([n])
+    b = n.to_bytes((n.bit_length() + 7) // 8, 'big')
+    return bytes([0x80 | len(b)]) + b
+
+
+def tlv(tag, content, indefinite=False):
+    if indefinite:
+        return bytes([tag, 0x80]) + content + b'\0\0'
+    return bytes([tag]) + length(len(content)) + content
+
+
+def integer(value):
+    return tlv(0x02, value.to_bytes(max(1, (value.bit_length() + 8) // 8), 'big', signed=True))
+
+
+def utf8(string):
+    return tlv(0x0C, string.encode())
+
+
+def ia5(string):
+    return tlv(0x16, string.encode())
+
+
+def attribute(kind, value):
+    return tlv(0x30, integer(kind) + integer(1) + tlv(0x04, value))
+
+
+def set_of(items):
+    return tlv(0x31, b''.join(items))
+
+
+def purchase(product_id, date, expires, trial, transaction_id="1000", original_transaction_id="999"):
+    return set_of([attribute(1701, integer(1)),
+                   attribute(1702, utf8(product_id)),
+                   attribute(1703, utf8(transaction_id)),
+                   attribute(1705, utf8(original_transaction_id)),
+                   attribute(1704, ia5(date)),
+                   attribute(1706, ia5(date)),
+                   attribute(1708, ia5(expires)),
+                   attribute(1712, ia5("")),
+                   attribute(1713, integer(trial)),
+                   attribute(1719, integer(0))])
+
+
+def receipt(indefinite, purchases=None):
+    if purchases is None:
+        purchases = [purchase("com.money", "2018-12-03T17:12:03Z", "", 0),
+                     purchase("com.year", "2018-12-07T18:29:01.5+01:00", "2018-12-07T19:29:01Z", 1)]
+
+    payload = set_of([attribute(2, utf8("com.site.bundleId")),
+                      attribute(3, utf8("29")),
+                      attribute(19, utf8("1.0")),
+                      attribute(12, ia5("2019-11-21T16:15:06Z")),
+                      attribute(18, ia5("2013-08-01T07:00:00Z")),
+                      attribute(5, b'\x01\x02')] +
+                     [attribute(17, item) for item in purchases])
+
+    signed_data_oid = tlv(0x06, bytes([0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x02]))
+    data_oid        = tlv(0x06, bytes([0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x01]))
+    sha256_oid      = tlv(0x06, bytes([0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01]))
+
+    content = tlv(0x30, data_oid + tlv(0xA0, tlv(0x04, payload), indefinite), indefinite)
+
+    signed_data = tlv(0x30,
+                      integer(1) +
+                      tlv(0x31, tlv(0x30, sha256_oid), indefinite) +
+                      content +
+                      tlv(0xA0, b'\x30\x00', indefinite) +
+                      tlv(0x31, b'', indefinite),
+                      indefinite)
+
+    return tlv(0x30, signed_data_oid + tlv(0xA0, signed_data, indefinite), indefinite)
+
+
+def write(name, data):
+    with open(name, 'wb') as file:
+        file.write(data)
+
+
+# Подписки из 200 покупок по кругу, продление раз в час: как чек verifyReceipt у давнего подписчика
+def bench_purchases(count):
+    start = datetime.datetime(2018, 1, 1, tzinfo=datetime.timezone.utc)
+
+    purchases = []
+
+    for index in range(count):
+        date    = start + datetime.timedelta(hours=index)
+        expires = date + datetime.timedelta(days=30)
+
+        purchases.append(purchase("com.site.bench.%d" % (index % 200),
+                                  date.strftime("%Y-%m-%dT%H:%M:%SZ"),
+                                  expires.strftime("%Y-%m-%dT%H:%M:%SZ"),
+                                  1 if index < 200 else 0,
+                                  str(1000 + index),
+                                  str(1000 + index % 200)))
+
+    return purchases
+
+
+if len(sys.argv) == 3 and sys.argv[1] == '--bench':
+    os.makedirs(sys.argv[2], exist_ok=True)
+
+    for count in (10, 1000, 50000):
+        write(os.path.join(sys.argv[2], 'receipt_der_%d.bin' % count), receipt(False, bench_purchases(count)))
+
+    sys.exit(0)
+
+
+der = receipt(False)
+
+write('receipt_der.bin', der)
+write('receipt_ber.bin', receipt(True))
+
+# Обрывается посреди покупок
+write('receipt_truncated.bin', der[:len(der) // 2])
+
+# Вложенность больше STORE_RECEIPT_MAX_DEPTH
+write('receipt_deep.bin', b'\x30\x80' * 64 + b'\x00\x00' * 64)
+
+# Вместо SignedData другой contentType
+write('receipt_malformed.bin', der.replace(bytes([0x0D, 0x01, 0x07, 0x02]), bytes([0x0D, 0x01, 0x07, 0x03]), 1))
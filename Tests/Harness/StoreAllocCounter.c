@@ -0,0 +1,61 @@
+//
+//  StoreAllocCounter.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#include "StoreAllocCounter.h"
+
+#include <errno.h>
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t StoreAllocCounter = 0;
+
+uint64_t StoreAllocCount(void)
+{
+    return __atomic_load_n(&StoreAllocCounter, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&StoreAllocCounter, 1, __ATOMIC_RELAXED);
+
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&StoreAllocCounter, 1, __ATOMIC_RELAXED);
+
+    return __libc_calloc(count, size);
+}
+
+// realloc(NULL) это новое выделение, увеличение существующего блока тоже считается
+void *realloc(void *pointer, size_t size)
+{
+    __atomic_add_fetch(&StoreAllocCounter, 1, __ATOMIC_RELAXED);
+
+    return __libc_realloc(pointer, size);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+
+    __atomic_add_fetch(&StoreAllocCounter, 1, __ATOMIC_RELAXED);
+
+    void *memory = __libc_memalign(alignment, size);
+
+    if (memory == NULL && size)
+        return ENOMEM;
+
+    *pointer = memory;
+
+    return 0;
+}
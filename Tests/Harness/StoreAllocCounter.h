@@ -0,0 +1,26 @@
+//
+//  StoreAllocCounter.h
+//
+//  Created by agent on 10/18/26.
+//
+//  Счетчик выделений памяти для бенчмарков: malloc, calloc, realloc и posix_memalign
+//  подменяются в исполняемом файле и передаются в glibc (__libc_*). Только Linux/glibc
+//
+
+#ifndef StoreAllocCounter_h
+#define StoreAllocCounter_h
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Число выделений с запуска процесса, со всех потоков
+uint64_t StoreAllocCount(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
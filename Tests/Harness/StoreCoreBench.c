@@ -0,0 +1,526 @@
+//
+//  StoreCoreBench.c
+//
+//  Created by agent on 10/18/26.
+//
+//  Бенчмарк модулей на чистом C: разбор чека, правила setAsPurchasedForRanges:, журнал StoreState
+//  баланс одноразовых покупок и файл лога.
+//  Печатает по строке JSON на операцию, сравнение двух коммитов через bench_compare.sh
+//
+//      make -C Tests bench
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "StoreAllocCounter.h"
+
+// Модули появились в разных коммитах, bench_compare.sh собирает бенчмарк и против старых
+#if __has_include("StoreReceipt.h")
+#include "StoreReceipt.h"
+#define BENCH_RECEIPT 1
+#endif
+
+#if __has_include("StoreRanges.h")
+#include "StoreRanges.h"
+#define BENCH_RANGES 1
+#endif
+
+#if __has_include("StoreJournal.h")
+#include "StoreJournal.h"
+#define BENCH_JOURNAL 1
+#endif
+
+#if __has_include("StoreBalance.h")
+#include "StoreBalance.h"
+#define BENCH_BALANCE 1
+#endif
+
+#if __has_include("StoreLogFile.h")
+#include "StoreLogFile.h"
+#define BENCH_LOG 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef void (*BenchOperation)(void *context);
+
+static const char *label = "";
+
+static volatile uint64_t sink = 0;
+
+static uint64_t Now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+}
+
+static void Bench(const char     *name,
+                  unsigned long   iterations,
+                  BenchOperation  operation,
+                  void           *context)
+{
+    // Прогрев: первые вызовы не должны попадать в замер
+    operation(context);
+
+    uint64_t allocs = StoreAllocCount();
+    uint64_t start  = Now();
+
+    for (unsigned long index = 0; index < iterations; index ++)
+        operation(context);
+
+    uint64_t elapsed = Now() - start;
+
+    allocs = StoreAllocCount() - allocs;
+
+    printf("{\"op\":\"%s\",\"iterations\":%lu,\"nsPerOp\":%.1f,\"allocsPerOp\":%.2f,\"label\":\"%s\"}\n",
+           name,
+           iterations,
+           (double)elapsed / iterations,
+           (double)allocs  / iterations,
+           label);
+}
+
+#ifdef BENCH_RECEIPT
+
+#pragma mark - Receipt
+
+static uint8_t *ReadFixture(const char *directory,
+                            const char *name,
+                            size_t     *length)
+{
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "can't open %s\n", path);
+
+        exit(2);
+    }
+
+    fseek(file, 0, SEEK_END);
+
+    long size = ftell(file);
+
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *bytes = malloc(size > 0 ? (size_t)size : 1);
+
+    *length = fread(bytes, 1, (size_t)size, file);
+
+    fclose(file);
+
+    return bytes;
+}
+
+
+typedef struct
+{
+    const uint8_t *bytes;
+    size_t         length;
+}Receipt;
+
+static int CountPurchase(const StoreReceiptPurchase *purchase, void *context)
+{
+    (void)context;
+
+    sink += (uint64_t)purchase->purchaseDateMs;
+
+    return 0;
+}
+
+static void DecodeReceipt(void *context)
+{
+    Receipt *receipt = context;
+
+    StoreReceiptInfo info;
+
+    sink += (uint64_t)StoreReceiptDecode(receipt->bytes, receipt->length, &info, CountPurchase, NULL);
+}
+
+// Чеки из Fixtures/Bench (make bench-fixtures): сколько стоит разбор на покупку при росте чека
+static void DecodeBenchReceipt(const char    *directory,
+                               unsigned long  count,
+                               unsigned long  iterations)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "Bench/receipt_der_%lu.bin", count);
+
+    Receipt receipt;
+
+    uint8_t *bytes = ReadFixture(directory, name, &receipt.length);
+
+    receipt.bytes = bytes;
+
+    snprintf(name, sizeof(name), "receipt.decode.%lu", count);
+
+    Bench(name, iterations, DecodeReceipt, &receipt);
+
+    free(bytes);
+}
+
+static void ParseDate(void *context)
+{
+    const char *date = context;
+
+    sink += (uint64_t)StoreReceiptDateMs((const uint8_t *)date, strlen(date));
+}
+
+#endif
+
+#ifdef BENCH_RANGES
+
+#pragma mark - Ranges
+
+#define RANGES_COUNT 64
+
+// Правил много и они пересекаются: как в конфиге, где диапазоны дописывались годами
+#define RANGES_COMPILE_COUNT 1024
+
+typedef struct
+{
+    StoreRangesInterval intervals[RANGES_COUNT];
+    size_t              count;
+    uint64_t            value;
+}Ranges;
+
+typedef struct
+{
+    StoreRangesInterval rules[RANGES_COMPILE_COUNT];     // Исходные правила, не меняются
+    StoreRangesInterval intervals[RANGES_COMPILE_COUNT]; // Копия, которую компилирует каждая итерация
+}RangesRules;
+
+static void ContainsRange(void *context)
+{
+    Ranges *ranges = context;
+
+    sink += (uint64_t)StoreRangesContains(ranges->intervals, ranges->count, ranges->value ++ % (RANGES_COUNT * 40));
+}
+
+// Копирование правил входит в замер, оно на порядок дешевле сортировки
+static void CompileRanges(void *context)
+{
+    RangesRules *rules = context;
+
+    memcpy(rules->intervals, rules->rules, sizeof(rules->rules));
+
+    sink += (uint64_t)StoreRangesCompile(rules->intervals, RANGES_COMPILE_COUNT);
+}
+
+static void ParseDay(void *context)
+{
+    const char *day = context;
+
+    uint64_t value;
+
+    sink += (uint64_t)StoreRangesParseDay(day, strlen(day), &value) + value;
+}
+
+static void ParseVersion(void *context)
+{
+    const char *version = context;
+
+    uint64_t value;
+
+    sink += (uint64_t)StoreRangesParseVersion(version, strlen(version), &value) + value;
+}
+
+#endif
+
+#ifdef BENCH_JOURNAL
+
+#pragma mark - Journal
+
+// Размер типичной записи commit: пара ключей consumableCount:<id> в binary plist
+#define JOURNAL_RECORD_SIZE 160
+
+// Журнал сворачивается в Store.state после STORE_STATE_COMPACT_SIZE, длиннее он не бывает
+#define JOURNAL_SIZE 65536
+
+typedef struct
+{
+    uint8_t record[JOURNAL_RECORD_SIZE];
+    int     descriptor;
+}JournalAppend;
+
+typedef struct
+{
+    uint8_t *bytes;
+    size_t   length;
+}JournalScan;
+
+// То же, что StoreState.commit после сериализации: заголовок, запись в конец файла, fsync
+static void AppendRecord(void *context)
+{
+    JournalAppend *append = context;
+
+    uint8_t header[STORE_JOURNAL_HEADER_SIZE];
+
+    StoreJournalHeader(header, append->record, JOURNAL_RECORD_SIZE);
+
+    sink += (uint64_t)write(append->descriptor, header, sizeof(header));
+    sink += (uint64_t)write(append->descriptor, append->record, JOURNAL_RECORD_SIZE);
+
+    fsync(append->descriptor);
+
+    // Файл не растет между итерациями, как после сворачивания
+    if (lseek(append->descriptor, 0, SEEK_CUR) > JOURNAL_SIZE)
+    {
+        sink += (uint64_t)ftruncate(append->descriptor, 0);
+        sink += (uint64_t)lseek(append->descriptor, 0, SEEK_SET);
+    }
+}
+
+static int CountRecord(const uint8_t *payload, size_t length, void *context)
+{
+    (void)payload;
+    (void)context;
+
+    sink += length;
+
+    return 0;
+}
+
+static void ScanJournal(void *context)
+{
+    JournalScan *scan = context;
+
+    sink += StoreJournalScan(scan->bytes, scan->length, CountRecord, NULL);
+}
+
+#endif
+
+#ifdef BENCH_BALANCE
+
+#pragma mark - Balance
+
+// То же, что consumableSpendCount: без записи и уведомлений: блокировка, проверка, списание
+static void SpendBalance(void *context)
+{
+    StoreBalance *balance = context;
+
+    StoreBalanceChange change;
+
+    StoreBalanceLock(balance);
+
+    sink += (uint64_t)StoreBalanceSpend(balance, 1, &change);
+
+    StoreBalanceUnlock(balance);
+}
+
+#endif
+
+#ifdef BENCH_LOG
+
+#pragma mark - Log
+
+// Как в Store.h и Store.m
+#define LOG_MAX_SIZE     262144
+#define LOG_MAX_SEGMENTS 4
+#define LOG_FLUSH_SIZE   16384
+
+#define LOG_LINE "[INFO] Store: Update transaction fired with Purchase Queue\n"
+
+typedef struct
+{
+    StoreLogFile file;
+    uint8_t      buffer[LOG_FLUSH_SIZE + 256];
+    size_t       length;
+}Log;
+
+// То же, что StoreLog.addLog: без очереди: строка в буфер, полный буфер в файл
+static void AppendLog(void *context)
+{
+    Log *log = context;
+
+    memcpy(log->buffer + log->length, LOG_LINE, sizeof(LOG_LINE) - 1);
+
+    log->length += sizeof(LOG_LINE) - 1;
+
+    if (log->length >= LOG_FLUSH_SIZE)
+    {
+        sink += (uint64_t)StoreLogFileWrite(&log->file, log->buffer, log->length);
+
+        log->length = 0;
+    }
+}
+
+// Время строки, когда в лог уже записано lines строк (с ротациями)
+static void AppendLogAfter(const char    *directory,
+                           unsigned long  lines)
+{
+    Log *log = calloc(1, sizeof(Log));
+
+    StoreLogFileInit(&log->file, directory, LOG_MAX_SIZE, LOG_MAX_SEGMENTS);
+
+    StoreLogFileRemove(&log->file);
+
+    for (unsigned long index = 0; index < lines; index ++)
+        AppendLog(log);
+
+    char name[64];
+
+    snprintf(name, sizeof(name), "log.append.%lu", lines);
+
+    Bench(name, 1000000, AppendLog, log);
+
+    StoreLogFileRemove(&log->file);
+
+    free(log);
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+    if (argc > 2)
+        label = argv[2];
+
+#ifdef BENCH_RECEIPT
+    const char *directory = argc > 1 ? argv[1] : "Fixtures";
+
+    Receipt der, ber;
+
+    uint8_t *derBytes = ReadFixture(directory, "receipt_der.bin", &der.length);
+    uint8_t *berBytes = ReadFixture(directory, "receipt_ber.bin", &ber.length);
+
+    der.bytes = derBytes;
+    ber.bytes = berBytes;
+
+    Bench("receipt.decode.der", 200000, DecodeReceipt, &der);
+    Bench("receipt.decode.ber", 200000, DecodeReceipt, &ber);
+    Bench("receipt.date",       1000000, ParseDate, "2018-12-07T18:29:01.500+01:00");
+
+    DecodeBenchReceipt(directory, 10,    100000);
+    DecodeBenchReceipt(directory, 1000,  2000);
+    DecodeBenchReceipt(directory, 50000, 40);
+
+    free(derBytes);
+    free(berBytes);
+#endif
+
+#ifdef BENCH_RANGES
+    Ranges ranges = {{{0, 0}}, 0, 0};
+
+    for (size_t index = 0; index < RANGES_COUNT; index ++)
+    {
+        ranges.intervals[index].from = index * 40;
+        ranges.intervals[index].to   = index * 40 + 20;
+    }
+
+    ranges.count = StoreRangesCompile(ranges.intervals, RANGES_COUNT);
+
+    RangesRules *rules = malloc(sizeof(RangesRules));
+
+    // Детерминированный генератор, чтобы прогоны разных коммитов компилировали одни и те же правила
+    uint32_t seed = 1;
+
+    for (size_t index = 0; index < RANGES_COMPILE_COUNT; index ++)
+    {
+        seed = seed * 1103515245u + 12345u;
+
+        uint64_t from = (seed >> 8) % 20000;
+
+        seed = seed * 1103515245u + 12345u;
+
+        rules->rules[index].from = from;
+        rules->rules[index].to   = from + (seed >> 8) % 400;
+
+        // Каждое тридцать второе правило перевернуто и должно отброситься
+        if (index % 32 == 31)
+            rules->rules[index].from = rules->rules[index].to + 1;
+    }
+
+    Bench("ranges.compile",  20000, CompileRanges, rules);
+
+    free(rules);
+
+    Bench("ranges.contains", 5000000, ContainsRange, &ranges);
+    Bench("ranges.day",      2000000, ParseDay, "29/2/2024");
+    Bench("ranges.version",  2000000, ParseVersion, "3.10.2.1");
+#endif
+
+#ifdef BENCH_JOURNAL
+    JournalAppend append;
+
+    for (size_t index = 0; index < JOURNAL_RECORD_SIZE; index ++)
+        append.record[index] = (uint8_t)(index * 31);
+
+    char path[] = "/tmp/StoreCoreBench.XXXXXX";
+
+    append.descriptor = mkstemp(path);
+
+    if (append.descriptor < 0)
+    {
+        fprintf(stderr, "can't create %s\n", path);
+
+        return 2;
+    }
+
+    Bench("journal.append", 2000, AppendRecord, &append);
+
+    close(append.descriptor);
+    unlink(path);
+
+    // Журнал перед сворачиванием, как его читает StoreState.load
+    JournalScan scan;
+
+    scan.bytes  = malloc(JOURNAL_SIZE);
+    scan.length = 0;
+
+    while (scan.length + STORE_JOURNAL_HEADER_SIZE + JOURNAL_RECORD_SIZE <= JOURNAL_SIZE)
+    {
+        StoreJournalHeader(scan.bytes + scan.length, append.record, JOURNAL_RECORD_SIZE);
+
+        memcpy(scan.bytes + scan.length + STORE_JOURNAL_HEADER_SIZE, append.record, JOURNAL_RECORD_SIZE);
+
+        scan.length += STORE_JOURNAL_HEADER_SIZE + JOURNAL_RECORD_SIZE;
+    }
+
+    Bench("journal.scan", 2000, ScanJournal, &scan);
+
+    free(scan.bytes);
+#endif
+
+#ifdef BENCH_BALANCE
+    StoreBalance balance;
+
+    StoreBalanceInit(&balance);
+
+    balance.balance = 1000000000;
+
+    Bench("balance.spend", 10000000, SpendBalance, &balance);
+
+    StoreBalanceDestroy(&balance);
+#endif
+
+#ifdef BENCH_LOG
+    char logDirectory[] = "/tmp/StoreCoreBench.XXXXXX";
+
+    if (mkdtemp(logDirectory) == NULL)
+    {
+        fprintf(stderr, "can't create %s\n", logDirectory);
+
+        return 2;
+    }
+
+    AppendLogAfter(logDirectory, 10000);
+    AppendLogAfter(logDirectory, 100000);
+    AppendLogAfter(logDirectory, 1000000);
+
+    rmdir(logDirectory);
+#endif
+
+    return sink == 42;
+}
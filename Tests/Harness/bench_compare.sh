@@ -0,0 +1,52 @@
+#!/bin/sh
+# Сравнивает бенчмарки двух коммитов: для каждого собирает StoreCoreBench
+# из этой папки против исходников коммита (git worktree) и печатает разницу:
+#
+#     ./bench_compare.sh <коммит до> <коммит после>
+#     ./bench_compare.sh HEAD~1 HEAD
+#
+# Результаты остаются в $OUT (по умолчанию /tmp/store-bench): <коммит>.jsonl
+
+set -eu
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 <rev before> <rev after>" >&2
+    exit 2
+fi
+
+HARNESS=$(cd "$(dirname "$0")" && pwd)
+TESTS=$(dirname "$HARNESS")
+REPO=$(git -C "$HARNESS" rev-parse --show-toplevel)
+OUT=${OUT:-/tmp/store-bench}
+
+mkdir -p "$OUT"
+
+run() {
+    REV=$1
+    SHA=$(git -C "$REPO" rev-parse --short "$REV")
+    TREE=$OUT/tree-$SHA
+    RESULT=$OUT/$SHA.jsonl
+
+    rm -rf "$TREE"
+    git -C "$REPO" worktree add --detach "$TREE" "$SHA" >/dev/null
+
+    SOURCES=$TREE/Classes/ios
+
+    : > "$RESULT"
+
+    # Модули на C есть не во всех коммитах
+    if [ -f "$SOURCES/StoreReceipt.c" ] || [ -f "$SOURCES/StoreRanges.c" ]; then
+        make -s -B -C "$TESTS" StoreCoreBench SOURCES="$SOURCES" >&2
+        make -s -C "$TESTS" bench-fixtures >&2
+        "$TESTS/StoreCoreBench" "$TESTS/Fixtures" "$SHA" >> "$RESULT"
+    fi
+
+    git -C "$REPO" worktree remove --force "$TREE"
+
+    echo "$RESULT"
+}
+
+BEFORE=$(run "$1")
+AFTER=$(run "$2")
+
+python3 "$HARNESS/compare_bench.py" "$BEFORE" "$AFTER"
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+# Сравнение двух прогонов StoreCoreBench (строки JSON):
+#
+#     python3 compare_bench.py before.jsonl after.jsonl
+#
+# Для каждой операции время и выделения до и после, изменение в процентах
+
+import json
+import sys
+
+
+def load(path):
+    results = {}
+
+    with open(path) as file:
+        for line in file:
+            line = line.strip()
+
+            if line.startswith('{'):
+                result = json.loads(line)
+                results[result['op']] = result
+
+    return results
+
+
+def delta(before, after):
+    if not before:
+        return '    n/a'
+
+    return '%+6.1f%%' % ((after - before) * 100.0 / before)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: compare_bench.py before.jsonl after.jsonl')
+
+    before = load(sys.argv[1])
+    after  = load(sys.argv[2])
+
+    print('%-24s %12s %12s %8s %10s %10s %8s' % ('op', 'ns before', 'ns after', 'time', 'allocs bef', 'allocs aft', 'allocs'))
+
+    for op in list(before) + [op for op in after if op not in before]:
+        if op not in before or op not in after:
+            print('%-24s %s' % (op, 'only before' if op in before else 'only after'))
+            continue
+
+        b, a = before[op], after[op]
+
+        print('%-24s %12.1f %12.1f %8s %10.2f %10.2f %8s' % (
+            op,
+            b['nsPerOp'], a['nsPerOp'], delta(b['nsPerOp'], a['nsPerOp']),
+            b['allocsPerOp'], a['allocsPerOp'], delta(b['allocsPerOp'], a['allocsPerOp'])))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+# Локальный сервер конфига и verifyReceipt для прогона сценариев Store без App Store:
+# конфиг отдается по setupWithURLString:, verifyReceipt перенаправляется через setTransport:
+#
+#     python3 stub_server.py [--port 8765] [--scenarios Scenarios]
+#
+# GET  /control/reset?scenario=<имя>  загружает Scenarios/<имя>.json, сбрасывает счетчики
+# GET  /control/stats                 сколько раз вызывался каждый путь
+# GET  /config                        конфиг сценария, ETag и 304 по If-None-Match
+# POST /production/verifyReceipt      ответы verify.production по порядку, последний повторяется
+# POST /sandbox/verifyReceipt         то же для verify.sandbox
+#
+# В ответах verifyReceipt даты задаются смещением в секундах от текущего момента
+# (purchaseOffset, expiresOffset), поэтому сценарии продления и истечения не зависят от даты запуска
+
+import argparse
+import hashlib
+import json
+import os
+import sys
+import threading
+import time
+import urllib.parse
+
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class Scenario:
+
+    def __init__(self, directory):
+        self.directory = directory
+        self.lock      = threading.Lock()
+        self.load(None)
+
+    def load(self, name):
+        with self.lock:
+            self.name   = name
+            self.data   = {}
+            self.stats  = {}
+            self.cursor = {}
+
+            if name:
+                with open(os.path.join(self.directory, name + '.json')) as file:
+                    self.data = json.load(file)
+
+    def count(self, path):
+        with self.lock:
+            self.stats[path] = self.stats.get(path, 0) + 1
+
+    def next_verify(self, environment):
+        with self.lock:
+            responses = self.data.get('verify', {}).get(environment, [])
+
+            if not responses:
+                return {'status': 21005}
+
+            index = self.cursor.get(environment, 0)
+
+            self.cursor[environment] = index + 1
+
+            return responses[min(index, len(responses) - 1)]
+
+
+def milliseconds(offset):
+    return int((time.time() + offset) * 1000)
+
+
+def rfc_date(ms):
+    return time.strftime('%Y-%m-%d %H:%M:%S Etc/GMT', time.gmtime(ms / 1000))
+
+
+def render_purchase(purchase, index):
+    purchase_ms = milliseconds(purchase.get('purchaseOffset', 0))
+
+    rendered = {
+        'product_id':              purchase['identifier'],
+        'quantity':                str(purchase.get('quantity', 1)),
+        'transaction_id':          str(purchase.get('transactionId', 1000 + index)),
+        'original_transaction_id': str(purchase.get('originalTransactionId', 1000)),
+        'purchase_date':           rfc_date(purchase_ms),
+        'purchase_date_ms':        str(purchase_ms),
+        'original_purchase_date':  rfc_date(purchase_ms),
+        'original_purchase_date_ms': str(purchase_ms),
+        'is_trial_period':         'true' if purchase.get('trial') else 'false',
+    }
+
+    if 'expiresOffset' in purchase:
+        expires_ms = milliseconds(purchase['expiresOffset'])
+
+        rendered['expires_date']    = rfc_date(expires_ms)
+        rendered['expires_date_ms'] = str(expires_ms)
+
+    return rendered
+
+
+def render_verify(scenario, response):
+    status = response.get('status', 0)
+
+    if status not in (0, 21006):
+        return {'status': status}
+
+    purchases = [render_purchase(purchase, index)
+                 for index, purchase in enumerate(response.get('inApp', []))]
+
+    first_install_ms = milliseconds(response.get('originalPurchaseOffset', -30 * 86400))
+
+    receipt = {
+        'bundle_id':                    scenario.data.get('bundleId', 'com.site.bundleId'),
+        'application_version':          response.get('applicationVersion', '1.0'),
+        'original_application_version': response.get('originalApplicationVersion', '1.0'),
+        'original_purchase_date':       rfc_date(first_install_ms),
+        'original_purchase_date_ms':    str(first_install_ms),
+        'request_date_ms':              str(milliseconds(0)),
+        'in_app':                       purchases,
+    }
+
+    return {'status': status,
+            'environment': response.get('environment', 'Production'),
+            'receipt': receipt,
+            'latest_receipt_info': purchases}
+
+
+class Handler(BaseHTTPRequestHandler):
+
+    scenario = None
+
+    def log_message(self, format, *arguments):
+        if self.server.verbose:
+            sys.stderr.write('stub: ' + format % arguments + '\n')
+
+    def reply(self, code, body=None, headers=None):
+        data = json.dumps(body).encode() if body is not None else b''
+
+        self.send_response(code)
+
+        for key, value in (headers or {}).items():
+            self.send_header(key, value)
+
+        if body is not None:
+            self.send_header('Content-Type', 'application/json')
+
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+
+        self.wfile.write(data)
+
+    def do_GET(self):
+        url   = urllib.parse.urlparse(self.path)
+        query = urllib.parse.parse_qs(url.query)
+
+        if url.path == '/control/reset':
+            try:
+                self.scenario.load(query.get('scenario', [None])[0])
+            except OSError as error:
+                return self.reply(404, {'error': str(error)})
+
+            return self.reply(200, {'scenario': self.scenario.name})
+
+        if url.path == '/control/stats':
+            return self.reply(200, self.scenario.stats)
+
+        self.scenario.count(url.path)
+
+        if url.path == '/config':
+            config = self.scenario.data.get('config')
+
+            if config is None:
+                return self.reply(404, {'error': 'no config'})
+
+            etag = '"%s"' % hashlib.sha1(json.dumps(config, sort_keys=True).encode()).hexdigest()
+
+            if self.headers.get('If-None-Match') == etag:
+                return self.reply(304, headers={'ETag': etag})
+
+            return self.reply(200, config, {'ETag': etag})
+
+        self.reply(404, {'error': 'unknown path'})
+
+    def do_POST(self):
+        url = urllib.parse.urlparse(self.path)
+
+        length = int(self.headers.get('Content-Length') or 0)
+
+        self.rfile.read(length)
+
+        self.scenario.count(url.path)
+
+        environments = {'/production/verifyReceipt': 'production',
+                        '/sandbox/verifyReceipt':    'sandbox'}
+
+        if url.path not in environments:
+            return self.reply(404, {'error': 'unknown path'})
+
+        response = self.scenario.next_verify(environments[url.path])
+
+        time.sleep(response.get('delay', 0))
+
+        self.reply(200, render_verify(self.scenario, response))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--port', type=int, default=8765)
+    parser.add_argument('--scenarios', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'Scenarios'))
+    parser.add_argument('--verbose', action='store_true')
+
+    arguments = parser.parse_args()
+
+    Handler.scenario = Scenario(arguments.scenarios)
+
+    server = ThreadingHTTPServer(('127.0.0.1', arguments.port), Handler)
+    server.verbose = arguments.verbose
+
+    print('stub: listening on http://127.0.0.1:%d' % arguments.port, flush=True)
+
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
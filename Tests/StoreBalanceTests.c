@@ -0,0 +1,288 @@
+//
+//  StoreBalanceTests.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#include "StoreBalance.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+do { if (!(condition)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); failures ++; } } while (0)
+
+#pragma mark - Balance
+
+static void TestBalance(void)
+{
+    StoreBalance balance;
+
+    StoreBalanceInit(&balance);
+
+    // Первое изменение просит записать и разослать, следующие нет, пока флаги не сброшены
+    CHECK(StoreBalanceApply(&balance, 5) == (StoreBalanceChangeDirty | StoreBalanceChangeNotify | StoreBalanceChangeCrossedZero));
+    CHECK(StoreBalanceApply(&balance, 1) == StoreBalanceChangeNone);
+    CHECK(balance.balance == 6 && balance.notifyBalance == 0);
+
+    balance.isDirty         = 0;
+    balance.isNotifyPending = 0;
+
+    CHECK(StoreBalanceApply(&balance, 0) == StoreBalanceChangeNone);
+
+    StoreBalanceChange change;
+
+    CHECK(!StoreBalanceSpend(&balance, 7, &change) && change == StoreBalanceChangeNone);
+    CHECK( StoreBalanceSpend(&balance, 2, &change) && change == (StoreBalanceChangeDirty | StoreBalanceChangeNotify));
+    CHECK(balance.balance == 4 && balance.notifyBalance == 6);
+
+    // Резерв нельзя потратить, а списание без проверки не опускает баланс ниже него
+    CHECK( StoreBalanceReserve(&balance, 3));
+    CHECK(!StoreBalanceReserve(&balance, 2));
+    CHECK(StoreBalanceAvailable(&balance) == 1);
+    CHECK(!StoreBalanceSpend(&balance, 2, &change));
+
+    StoreBalanceApply(&balance, -100);
+
+    CHECK(balance.balance == 3 && balance.reserved == 3);
+
+    // Откат возвращает резерв, подтверждение списывает
+    CHECK(StoreBalanceFinish(&balance, 1, 0) == StoreBalanceChangeNone);
+    CHECK(balance.balance == 3 && balance.reserved == 2);
+
+    balance.isDirty         = 0;
+    balance.isNotifyPending = 0;
+
+    CHECK(StoreBalanceFinish(&balance, 2, 1) == (StoreBalanceChangeDirty | StoreBalanceChangeNotify));
+    CHECK(balance.balance == 1 && balance.reserved == 0);
+
+    balance.isDirty         = 0;
+    balance.isNotifyPending = 0;
+
+    CHECK(StoreBalanceApply(&balance, -1) == (StoreBalanceChangeDirty | StoreBalanceChangeNotify | StoreBalanceChangeCrossedZero));
+    CHECK(balance.balance == 0);
+
+    StoreBalanceDestroy(&balance);
+}
+
+#pragma mark - Stress
+
+#define STRESS_THREADS    8
+#define STRESS_ITERATIONS 200000
+
+// Каждая десятая итерация резервирует 2 и подтверждает, каждая десятая со сдвигом на 5 резервирует 3 и откатывает
+#define STRESS_START     (STRESS_THREADS * (STRESS_ITERATIONS + STRESS_ITERATIONS / 10 * 2) + 1000)
+#define STRESS_REMAINING 1000
+
+typedef struct
+{
+    StoreBalance balance;
+
+    // Отложенная запись: то, что попало бы в StoreState
+    pthread_mutex_t persistedLock;
+    int64_t         persisted;
+    int             isFlushing;
+
+    long            spent[STRESS_THREADS];
+    long            dirty;   // Сколько раз изменение вернуло Dirty
+    long            flushed; // Сколько раз Flush сбросил isDirty
+}Stress;
+
+typedef struct
+{
+    Stress *stress;
+    int     index;
+    int     isDraining; // Тратить, пока не кончится, а не фиксированное число раз
+}Worker;
+
+// Как persistConsumableBalance: под блокировкой баланса берется значение и сбрасывается isDirty
+static void Flush(Stress *stress)
+{
+    pthread_mutex_lock(&stress->persistedLock);
+
+    StoreBalanceLock(&stress->balance);
+
+    if (stress->balance.isDirty)
+        stress->flushed ++;
+
+    stress->persisted       = stress->balance.balance;
+    stress->balance.isDirty = 0;
+
+    StoreBalanceUnlock(&stress->balance);
+
+    pthread_mutex_unlock(&stress->persistedLock);
+}
+
+static void *Flusher(void *context)
+{
+    Stress *stress = context;
+
+    while (__atomic_load_n(&stress->isFlushing, __ATOMIC_ACQUIRE))
+        Flush(stress);
+
+    return NULL;
+}
+
+static void *Spender(void *context)
+{
+    Worker *worker = context;
+    Stress *stress = worker->stress;
+
+    for (long iteration = 0; worker->isDraining || iteration < STRESS_ITERATIONS; iteration ++)
+    {
+        StoreBalanceChange change;
+
+        StoreBalanceLock(&stress->balance);
+
+        int isSpent = StoreBalanceSpend(&stress->balance, 1, &change);
+
+        StoreBalanceUnlock(&stress->balance);
+
+        if (isSpent == 0)
+        {
+            CHECK(worker->isDraining);
+
+            break;
+        }
+
+        stress->spent[worker->index] ++;
+
+        if (change & StoreBalanceChangeDirty)
+            __atomic_add_fetch(&stress->dirty, 1, __ATOMIC_RELAXED);
+
+        if (worker->isDraining)
+            continue;
+
+        if (iteration % 10 == 0 ||
+            iteration % 10 == 5)
+        {
+            int64_t count  = iteration % 10 == 0 ? 2 : 3;
+            int     commit = iteration % 10 == 0;
+
+            StoreBalanceLock(&stress->balance);
+
+            int isReserved = StoreBalanceReserve(&stress->balance, count);
+
+            StoreBalanceUnlock(&stress->balance);
+
+            CHECK(isReserved);
+
+            if (isReserved == 0)
+                continue;
+
+            StoreBalanceLock(&stress->balance);
+
+            CHECK(stress->balance.balance >= stress->balance.reserved);
+
+            change = StoreBalanceFinish(&stress->balance, count, commit);
+
+            StoreBalanceUnlock(&stress->balance);
+
+            if (change & StoreBalanceChangeDirty)
+                __atomic_add_fetch(&stress->dirty, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+static void RunSpenders(Stress *stress, int isDraining)
+{
+    pthread_t threads[STRESS_THREADS];
+    Worker    workers[STRESS_THREADS];
+
+    for (int index = 0; index < STRESS_THREADS; index ++)
+    {
+        workers[index].stress     = stress;
+        workers[index].index      = index;
+        workers[index].isDraining = isDraining;
+
+        pthread_create(&threads[index], NULL, Spender, &workers[index]);
+    }
+
+    for (int index = 0; index < STRESS_THREADS; index ++)
+        pthread_join(threads[index], NULL);
+}
+
+static void TestStress(void)
+{
+    static Stress stress;
+
+    StoreBalanceInit(&stress.balance);
+
+    pthread_mutex_init(&stress.persistedLock, NULL);
+
+    stress.balance.balance  = STRESS_START;
+    stress.balance.isLoaded = 1;
+    stress.isFlushing       = 1;
+
+    pthread_t flusher;
+
+    pthread_create(&flusher, NULL, Flusher, &stress);
+
+    // N потоков по M списаний, резервы вперемешку: остаток известен точно
+    RunSpenders(&stress, 0);
+
+    __atomic_store_n(&stress.isFlushing, 0, __ATOMIC_RELEASE);
+
+    pthread_join(flusher, NULL);
+
+    long spent = 0;
+
+    for (int index = 0; index < STRESS_THREADS; index ++)
+        spent += stress.spent[index];
+
+    CHECK(spent == (long)STRESS_THREADS * STRESS_ITERATIONS);
+    CHECK(stress.balance.reserved == 0);
+    CHECK(stress.balance.balance  == STRESS_REMAINING);
+
+    // Запись планируется ровно один раз на каждый сброс isDirty, ни одна не теряется
+    CHECK(stress.dirty == stress.flushed + stress.balance.isDirty);
+
+    // Последняя отложенная запись после остановки потоков совпадает с балансом в памяти
+    if (stress.balance.isDirty)
+        Flush(&stress);
+
+    CHECK(stress.persisted == STRESS_REMAINING);
+
+    // Все тратят остаток наперегонки: успешных списаний ровно столько, сколько было
+    for (int index = 0; index < STRESS_THREADS; index ++)
+        stress.spent[index] = 0;
+
+    RunSpenders(&stress, 1);
+
+    spent = 0;
+
+    for (int index = 0; index < STRESS_THREADS; index ++)
+        spent += stress.spent[index];
+
+    CHECK(spent == STRESS_REMAINING);
+    CHECK(stress.balance.balance == 0);
+
+    Flush(&stress);
+
+    CHECK(stress.persisted == 0);
+
+    pthread_mutex_destroy(&stress.persistedLock);
+
+    StoreBalanceDestroy(&stress.balance);
+}
+
+int main(void)
+{
+    TestBalance();
+    TestStress();
+
+    if (failures)
+    {
+        fprintf(stderr, "StoreBalanceTests: %d failed\n", failures);
+
+        return 1;
+    }
+
+    printf("StoreBalanceTests: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+//
+//  StoreJournalTests.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "StoreJournal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+do { if (!(condition)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); failures ++; } } while (0)
+
+// Записи в тестах текстовые: формат журнала от содержимого не зависит
+static const char *records[] =
+{
+    "set consumableCount:com.money 10",
+    "set com.lifetime 1",
+    "set consumableCount:com.money 11",
+    "remove com.lifetime"
+};
+
+#define RECORDS_COUNT (sizeof(records) / sizeof(records[0]))
+
+typedef struct
+{
+    uint8_t bytes[1024];
+    size_t  length;
+    size_t  ends[RECORDS_COUNT]; // Конец каждой записи
+}Journal;
+
+static void Append(Journal *journal, const char *record)
+{
+    uint32_t length = (uint32_t)strlen(record);
+
+    StoreJournalHeader(journal->bytes + journal->length, (const uint8_t *)record, length);
+
+    memcpy(journal->bytes + journal->length + STORE_JOURNAL_HEADER_SIZE, record, length);
+
+    journal->length += STORE_JOURNAL_HEADER_SIZE + length;
+}
+
+static void MakeJournal(Journal *journal)
+{
+    journal->length = 0;
+
+    for (size_t index = 0; index < RECORDS_COUNT; index ++)
+    {
+        Append(journal, records[index]);
+
+        journal->ends[index] = journal->length;
+    }
+}
+
+typedef struct
+{
+    size_t count;
+    size_t stopAt;   // Номер записи, на которой handler отказывается, или RECORDS_COUNT
+    int    isOrdered;
+}Replay;
+
+static int ReplayRecord(const uint8_t *payload, size_t length, void *context)
+{
+    Replay *replay = context;
+
+    if (replay->count == replay->stopAt)
+        return 1;
+
+    const char *record = records[replay->count];
+
+    if (length != strlen(record) || memcmp(payload, record, length) != 0)
+        replay->isOrdered = 0;
+
+    replay->count ++;
+
+    return 0;
+}
+
+static size_t Scan(const uint8_t *bytes, size_t length, Replay *replay)
+{
+    replay->count     = 0;
+    replay->isOrdered = 1;
+
+    return StoreJournalScan(bytes, length, ReplayRecord, replay);
+}
+
+#pragma mark - Checksum
+
+static void TestChecksum(void)
+{
+    // Контрольные значения FNV-1a 32
+    CHECK(StoreJournalChecksum((const uint8_t *)"",       0) == 0x811c9dc5u);
+    CHECK(StoreJournalChecksum((const uint8_t *)"a",      1) == 0xe40c292cu);
+    CHECK(StoreJournalChecksum((const uint8_t *)"foobar", 6) == 0xbf9cf968u);
+
+    // Заголовок little endian независимо от платформы
+    uint8_t header[STORE_JOURNAL_HEADER_SIZE];
+
+    StoreJournalHeader(header, (const uint8_t *)"a", 1);
+
+    CHECK(header[0] == 1 && header[1] == 0 && header[2] == 0 && header[3] == 0);
+    CHECK(header[4] == 0x2c && header[5] == 0x29 && header[6] == 0x0c && header[7] == 0xe4);
+}
+
+#pragma mark - Scan
+
+static void TestScan(void)
+{
+    Journal journal;
+
+    MakeJournal(&journal);
+
+    Replay replay = {0, RECORDS_COUNT, 1};
+
+    CHECK(Scan(journal.bytes, journal.length, &replay) == journal.length);
+    CHECK(replay.count == RECORDS_COUNT);
+    CHECK(replay.isOrdered);
+
+    // Пустой журнал и обрывок заголовка
+    CHECK(Scan(journal.bytes, 0, &replay) == 0 && replay.count == 0);
+    CHECK(Scan(journal.bytes, STORE_JOURNAL_HEADER_SIZE - 1, &replay) == 0 && replay.count == 0);
+    CHECK(StoreJournalScan(journal.bytes, journal.length, NULL, NULL) == journal.length);
+
+    // Отказ handler останавливает проход на начале записи
+    replay.stopAt = 2;
+
+    CHECK(Scan(journal.bytes, journal.length, &replay) == journal.ends[1]);
+    CHECK(replay.count == 2);
+
+    replay.stopAt = RECORDS_COUNT;
+
+    // Испорченный байт в payload третьей записи отбрасывает ее и все после нее
+    journal.bytes[journal.ends[1] + STORE_JOURNAL_HEADER_SIZE] ^= 0x01;
+
+    CHECK(Scan(journal.bytes, journal.length, &replay) == journal.ends[1]);
+    CHECK(replay.count == 2 && replay.isOrdered);
+
+    // Длина в заголовке указывает за конец журнала
+    MakeJournal(&journal);
+
+    journal.bytes[journal.ends[2] + 1] = 0xFF;
+
+    CHECK(Scan(journal.bytes, journal.length, &replay) == journal.ends[2]);
+    CHECK(replay.count == 3 && replay.isOrdered);
+}
+
+#pragma mark - Crash
+
+// Сбой посреди commit: последняя запись дописана до любого байта. Журнал пишется в файл
+// и читается обратно, как при загрузке после перезапуска. Приращение баланса из
+// предпоследней записи должно остаться, недописанная запись отбрасывается целиком
+static void TestTornTail(void)
+{
+    Journal journal;
+
+    MakeJournal(&journal);
+
+    char path[] = "/tmp/StoreJournalTests.XXXXXX";
+
+    int descriptor = mkstemp(path);
+
+    CHECK(descriptor >= 0);
+
+    if (descriptor < 0)
+        return;
+
+    close(descriptor);
+
+    size_t tornStart = journal.ends[RECORDS_COUNT - 2];
+
+    for (size_t cut = tornStart; cut < journal.length; cut ++)
+    {
+        FILE *file = fopen(path, "wb");
+
+        fwrite(journal.bytes, 1, cut, file);
+        fclose(file);
+
+        uint8_t bytes[sizeof(journal.bytes)];
+
+        file = fopen(path, "rb");
+
+        size_t length = fread(bytes, 1, sizeof(bytes), file);
+
+        fclose(file);
+
+        Replay replay = {0, RECORDS_COUNT, 1};
+
+        size_t offset = Scan(bytes, length, &replay);
+
+        CHECK(length == cut);
+        CHECK(offset == tornStart);
+        CHECK(replay.count == RECORDS_COUNT - 1 && replay.isOrdered);
+
+        // После обрезки хвоста следующий commit дописывает целую запись, и она читается
+        length = offset;
+
+        memcpy(bytes + length, journal.bytes + tornStart, journal.length - tornStart);
+
+        length += journal.length - tornStart;
+
+        CHECK(Scan(bytes, length, &replay) == length);
+        CHECK(replay.count == RECORDS_COUNT && replay.isOrdered);
+    }
+
+    unlink(path);
+}
+
+int main(void)
+{
+    TestChecksum();
+    TestScan();
+    TestTornTail();
+
+    if (failures)
+    {
+        fprintf(stderr, "StoreJournalTests: %d failed\n", failures);
+
+        return 1;
+    }
+
+    printf("StoreJournalTests: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+//
+//  StoreLogFileTests.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "StoreLogFile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+do { if (!(condition)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); failures ++; } } while (0)
+
+static long SegmentSize(const StoreLogFile *file, unsigned segment)
+{
+    char path[STORE_LOG_FILE_PATH_SIZE + 32];
+
+    struct stat info;
+
+    if (!StoreLogFileSegmentPath(file, segment, path, sizeof(path)) ||
+        stat(path, &info) != 0)
+        return -1;
+
+    return (long)info.st_size;
+}
+
+static int SegmentStartsWith(const StoreLogFile *file, unsigned segment, const char *prefix)
+{
+    char path[STORE_LOG_FILE_PATH_SIZE + 32];
+    char bytes[64] = {0};
+
+    StoreLogFileSegmentPath(file, segment, path, sizeof(path));
+
+    FILE *handle = fopen(path, "rb");
+
+    if (handle == NULL)
+        return 0;
+
+    size_t length = fread(bytes, 1, sizeof(bytes) - 1, handle);
+
+    fclose(handle);
+
+    return length >= strlen(prefix) && memcmp(bytes, prefix, strlen(prefix)) == 0;
+}
+
+static void TestSegmentPath(void)
+{
+    StoreLogFile file;
+
+    StoreLogFileInit(&file, "/tmp/logs", 100, 3);
+
+    char path[64];
+
+    CHECK(StoreLogFileSegmentPath(&file, 0, path, sizeof(path)) && strcmp(path, "/tmp/logs/Store.log")   == 0);
+    CHECK(StoreLogFileSegmentPath(&file, 2, path, sizeof(path)) && strcmp(path, "/tmp/logs/Store.2.log") == 0);
+
+    CHECK(!StoreLogFileSegmentPath(&file, 0, path, 8));
+}
+
+// Пачки по 40 байт, файл до 100 байт: в сегмент помещаются две пачки, третья ротирует
+static void TestRotation(const char *directory)
+{
+    StoreLogFile file;
+
+    StoreLogFileInit(&file, directory, 100, 3);
+
+    StoreLogFileRemove(&file);
+
+    char batch[41];
+
+    for (int index = 0; index < 7; index ++)
+    {
+        snprintf(batch, sizeof(batch), "batch %d %-31s\n", index, "");
+
+        CHECK(StoreLogFileWrite(&file, (const uint8_t *)batch, 40));
+    }
+
+    // 0,1 удалены при последней ротации, 2,3 -> Store.2.log, 4,5 -> Store.1.log, 6 -> Store.log:
+    // сегментов не больше трех, поэтому самые старые пачки пропали
+    CHECK(SegmentSize(&file, 0) == 40);
+    CHECK(SegmentSize(&file, 1) == 80);
+    CHECK(SegmentSize(&file, 2) == 80);
+    CHECK(SegmentSize(&file, 3) == -1);
+
+    CHECK(SegmentStartsWith(&file, 0, "batch 6"));
+    CHECK(SegmentStartsWith(&file, 1, "batch 4"));
+    CHECK(SegmentStartsWith(&file, 2, "batch 2"));
+
+    // После перезапуска размер читается из файла, ротация продолжается с того же места
+    StoreLogFileClose(&file);
+
+    StoreLogFileInit(&file, directory, 100, 3);
+
+    CHECK(StoreLogFileWrite(&file, (const uint8_t *)"batch 7", 7));
+    CHECK(SegmentSize(&file, 0) == 47);
+    CHECK(file.size == 47);
+
+    // Пачка больше maxSize пишется в пустой файл целиком
+    char large[150];
+
+    memset(large, 'x', sizeof(large));
+
+    CHECK(StoreLogFileWrite(&file, (const uint8_t *)large, sizeof(large)));
+    CHECK(SegmentSize(&file, 0) == 150);
+    CHECK(SegmentSize(&file, 1) == 47);
+
+    CHECK(StoreLogFileWrite(&file, (const uint8_t *)"", 0));
+
+    StoreLogFileRemove(&file);
+
+    for (unsigned segment = 0; segment < 3; segment ++)
+        CHECK(SegmentSize(&file, segment) == -1);
+
+    // В папку, которой нет, записать нельзя
+    StoreLogFileInit(&file, "/nonexistent/StoreLogFileTests", 100, 3);
+
+    CHECK(!StoreLogFileWrite(&file, (const uint8_t *)"batch", 5));
+}
+
+int main(void)
+{
+    char directory[] = "/tmp/StoreLogFileTests.XXXXXX";
+
+    if (mkdtemp(directory) == NULL)
+    {
+        fprintf(stderr, "can't create %s\n", directory);
+
+        return 2;
+    }
+
+    TestSegmentPath();
+    TestRotation(directory);
+
+    rmdir(directory);
+
+    if (failures)
+    {
+        fprintf(stderr, "StoreLogFileTests: %d failed\n", failures);
+
+        return 1;
+    }
+
+    printf("StoreLogFileTests: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+//
+//  StoreRangesTests.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#include "StoreRanges.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+do { if (!(condition)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); failures ++; } } while (0)
+
+#define PARSE_DAY(string, day)         StoreRangesParseDay(string, strlen(string), day)
+#define PARSE_VERSION(string, version) StoreRangesParseVersion(string, strlen(string), version)
+
+#pragma mark - Intervals
+
+static void TestIntervals(void)
+{
+    StoreRangesInterval intervals[] =
+    {
+        {10, 20}, {15, 25}, {26, 30}, {40, 35}, {50, 60}, {0, 0}, {5, 5}
+    };
+
+    // Пересекающиеся и смежные сливаются, перевернутый отбрасывается
+    size_t count = StoreRangesCompile(intervals, sizeof(intervals) / sizeof(intervals[0]));
+
+    CHECK(count == 4);
+    CHECK(intervals[0].from == 0  && intervals[0].to == 0);
+    CHECK(intervals[1].from == 5  && intervals[1].to == 5);
+    CHECK(intervals[2].from == 10 && intervals[2].to == 30);
+    CHECK(intervals[3].from == 50 && intervals[3].to == 60);
+
+    CHECK( StoreRangesContains(intervals, count, 0));
+    CHECK(!StoreRangesContains(intervals, count, 1));
+    CHECK( StoreRangesContains(intervals, count, 5));
+    CHECK( StoreRangesContains(intervals, count, 10));
+    CHECK( StoreRangesContains(intervals, count, 30));
+    CHECK(!StoreRangesContains(intervals, count, 31));
+    CHECK(!StoreRangesContains(intervals, count, 37));
+    CHECK( StoreRangesContains(intervals, count, 60));
+    CHECK(!StoreRangesContains(intervals, count, 61));
+
+    CHECK(StoreRangesCompile(intervals, 0) == 0);
+    CHECK(!StoreRangesContains(intervals, 0, 5));
+    CHECK(!StoreRangesContains(NULL, 0, 5));
+}
+
+#pragma mark - Days
+
+static void TestDays(void)
+{
+    uint64_t day, next;
+
+    CHECK(StoreRangesDaysFromCivil(1970, 1, 1) == STORE_RANGES_DAY_1970);
+    CHECK(StoreRangesDaysFromCivil(0, 3, 1)    == 0);
+
+    CHECK(PARSE_DAY("1/1/1970", &day));
+    CHECK(day == StoreRangesDayWithTime(0));
+    CHECK(day == StoreRangesDayWithTime(86399.9));
+    CHECK(day == StoreRangesDayWithTime(-1) + 1);
+
+    // Граница дня по UTC
+    CHECK(PARSE_DAY("31/12/2020", &day) && PARSE_DAY("1/1/2021", &next));
+    CHECK(next == day + 1);
+    CHECK(StoreRangesDayWithTime(1609459199) == day);
+    CHECK(StoreRangesDayWithTime(1609459200) == next);
+
+    CHECK( PARSE_DAY("29/2/2020", &day));
+    CHECK( PARSE_DAY("29/2/2000", &day));
+    CHECK(!PARSE_DAY("29/2/2019", &day));
+    CHECK(!PARSE_DAY("29/2/1900", &day));
+    CHECK(!PARSE_DAY("31/4/2020", &day));
+    CHECK(!PARSE_DAY("12/31/2020", &day));
+    CHECK(!PARSE_DAY("0/1/2020", &day));
+    CHECK(!PARSE_DAY("1/1/", &day));
+    CHECK(!PARSE_DAY("/1/2020", &day));
+    CHECK(!PARSE_DAY("1/1/20201", &day));
+    CHECK(!PARSE_DAY("1/1/2020 ", &day));
+    CHECK(!PARSE_DAY("", &day));
+    CHECK(!StoreRangesParseDay(NULL, 0, &day));
+}
+
+#pragma mark - Versions
+
+static void TestVersions(void)
+{
+    uint64_t version, other;
+
+    CHECK(PARSE_VERSION("3.0.1", &version));
+    CHECK(version == 0x0003000000010000ULL);
+
+    // Недостающие компоненты это нули
+    CHECK(PARSE_VERSION("1.0", &version) && PARSE_VERSION("1.0.0", &other));
+    CHECK(version == other);
+
+    CHECK(PARSE_VERSION("1.9", &version) && PARSE_VERSION("1.10", &other));
+    CHECK(version < other);
+
+    // Компоненты больше 65535 обрезаются, после четвертого не учитываются
+    CHECK(PARSE_VERSION("99999", &version));
+    CHECK(version == 0xFFFF000000000000ULL);
+
+    CHECK(PARSE_VERSION("1.2.3.4.5", &version) && PARSE_VERSION("1.2.3.4", &other));
+    CHECK(version == other);
+
+    // Как intValue: буквы и все после них в компоненте отбрасываются
+    CHECK(PARSE_VERSION("1.0b3.2", &version));
+    CHECK(version == 0x0001000000020000ULL);
+
+    CHECK(!PARSE_VERSION("", &version));
+}
+
+int main(void)
+{
+    TestIntervals();
+    TestDays();
+    TestVersions();
+
+    if (failures)
+    {
+        fprintf(stderr, "StoreRangesTests: %d failed\n", failures);
+
+        return 1;
+    }
+
+    printf("StoreRangesTests: ok\n");
+
+    return 0;
+}
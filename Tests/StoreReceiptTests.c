@@ -0,0 +1,207 @@
+//
+//  StoreReceiptTests.c
+//
+//  Created by agent on 10/18/26.
+//
+
+#include "StoreReceipt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+do { if (!(condition)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); failures ++; } } while (0)
+
+#define STRING_EQUAL(string, literal) \
+((string).length == strlen(literal) && memcmp((string).bytes, literal, (string).length) == 0)
+
+#define MAX_PURCHASES 4
+
+typedef struct
+{
+    StoreReceiptPurchase purchases[MAX_PURCHASES];
+    size_t               count;
+    size_t               stopAfter; // 0 без остановки
+}Purchases;
+
+static int AddPurchase(const StoreReceiptPurchase *purchase, void *context)
+{
+    Purchases *purchases = context;
+
+    if (purchases->count < MAX_PURCHASES)
+        purchases->purchases[purchases->count] = *purchase;
+
+    purchases->count ++;
+
+    return purchases->stopAfter && purchases->count >= purchases->stopAfter;
+}
+
+static uint8_t *ReadFixture(const char *directory,
+                            const char *name,
+                            size_t     *length)
+{
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "can't open %s\n", path);
+
+        exit(2);
+    }
+
+    fseek(file, 0, SEEK_END);
+
+    long size = ftell(file);
+
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *bytes = malloc(size > 0 ? (size_t)size : 1);
+
+    *length = fread(bytes, 1, (size_t)size, file);
+
+    fclose(file);
+
+    return bytes;
+}
+
+#pragma mark - Receipts
+
+// DER и BER с неопределенной длиной разбираются одинаково
+static void TestValidReceipt(const char *directory,
+                             const char *name)
+{
+    size_t length;
+
+    uint8_t *bytes = ReadFixture(directory, name, &length);
+
+    StoreReceiptInfo info;
+
+    Purchases purchases = {0};
+
+    CHECK(StoreReceiptDecode(bytes, length, &info, AddPurchase, &purchases) == StoreReceiptResultOK);
+
+    CHECK(STRING_EQUAL(info.bundleId, "com.site.bundleId"));
+    CHECK(STRING_EQUAL(info.applicationVersion, "29"));
+    CHECK(STRING_EQUAL(info.originalApplicationVersion, "1.0"));
+    CHECK(info.creationDateMs         == 1574352906000LL);
+    CHECK(info.originalPurchaseDateMs == 1375340400000LL);
+    CHECK(info.expirationDateMs       == -1);
+
+    CHECK(purchases.count == 2);
+
+    if (purchases.count == 2)
+    {
+        const StoreReceiptPurchase *money = &purchases.purchases[0];
+        const StoreReceiptPurchase *year  = &purchases.purchases[1];
+
+        CHECK(STRING_EQUAL(money->productId, "com.money"));
+        CHECK(STRING_EQUAL(money->transactionId, "1000"));
+        CHECK(STRING_EQUAL(money->originalTransactionId, "999"));
+        CHECK(STRING_EQUAL(money->purchaseDate, "2018-12-03T17:12:03Z"));
+        CHECK(money->quantity           == 1);
+        CHECK(money->purchaseDateMs     == 1543857123000LL);
+        CHECK(money->expiresDateMs      == -1);
+        CHECK(money->cancellationDateMs == -1);
+        CHECK(money->isTrialPeriod      == 0);
+
+        CHECK(STRING_EQUAL(year->productId, "com.year"));
+        CHECK(year->purchaseDateMs == 1544203741500LL);
+        CHECK(year->expiresDateMs  == 1544210941000LL);
+        CHECK(year->isTrialPeriod  == 1);
+    }
+
+    // Обработчик может остановить разбор после первой покупки
+    Purchases first = {0};
+
+    first.stopAfter = 1;
+
+    CHECK(StoreReceiptDecode(bytes, length, NULL, AddPurchase, &first) == StoreReceiptResultStopped);
+    CHECK(first.count == 1);
+
+    // Любой обрезанный чек отклоняется, а не читается за границей буфера
+    for (size_t prefix = 0; prefix < length; prefix ++)
+    {
+        uint8_t *copy = malloc(prefix ? prefix : 1);
+
+        memcpy(copy, bytes, prefix);
+
+        CHECK(StoreReceiptDecode(copy, prefix, NULL, NULL, NULL) != StoreReceiptResultOK);
+
+        free(copy);
+    }
+
+    free(bytes);
+}
+
+static void TestInvalidReceipt(const char         *directory,
+                               const char         *name,
+                               StoreReceiptResult  expected)
+{
+    size_t length;
+
+    uint8_t *bytes = ReadFixture(directory, name, &length);
+
+    Purchases purchases = {0};
+
+    StoreReceiptResult result = StoreReceiptDecode(bytes, length, NULL, AddPurchase, &purchases);
+
+    if (result != expected)
+        fprintf(stderr, "%s: result %d, expected %d\n", name, (int)result, (int)expected);
+
+    CHECK(result == expected);
+
+    free(bytes);
+}
+
+#pragma mark - Dates
+
+static void TestDates(void)
+{
+#define DATE_MS(string) StoreReceiptDateMs((const uint8_t *)string, strlen(string))
+
+    CHECK(DATE_MS("1970-01-01T00:00:00Z")          == 0);
+    CHECK(DATE_MS("1969-12-31T23:59:59Z")          == -1000);
+    CHECK(DATE_MS("2000-02-29T00:00:00Z")          == 951782400000LL);
+    CHECK(DATE_MS("2018-12-07T18:29:01.5+01:00")   == 1544203741500LL);
+    CHECK(DATE_MS("2018-12-07T18:29:01.500+01:00") == 1544203741500LL);
+    CHECK(DATE_MS("2018-12-07T17:29:01-00:00")     == 1544203741000LL);
+
+    CHECK(DATE_MS("")                              == -1);
+    CHECK(DATE_MS("2018-12-07")                    == -1);
+    CHECK(DATE_MS("2018-13-07T18:29:01Z")          == -1);
+    CHECK(DATE_MS("2018-12-07 18:29:01Z")          == -1);
+
+#undef DATE_MS
+}
+
+int main(int argc, char **argv)
+{
+    const char *directory = argc > 1 ? argv[1] : "Fixtures";
+
+    TestValidReceipt(directory, "receipt_der.bin");
+    TestValidReceipt(directory, "receipt_ber.bin");
+
+    TestInvalidReceipt(directory, "receipt_truncated.bin", StoreReceiptResultTruncated);
+    TestInvalidReceipt(directory, "receipt_deep.bin",      StoreReceiptResultTooDeep);
+    TestInvalidReceipt(directory, "receipt_malformed.bin", StoreReceiptResultMalformed);
+
+    TestDates();
+
+    if (failures)
+    {
+        fprintf(stderr, "StoreReceiptTests: %d failed\n", failures);
+
+        return 1;
+    }
+
+    printf("StoreReceiptTests: ok\n");
+
+    return 0;
+}